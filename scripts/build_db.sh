@@ -73,11 +73,15 @@ fi
 cd "$DATABASE_DIR"
 
 MEMFLAG=""
+LCA_MEMFLAG=""
 if [ -z "$KRAKEN_WORK_ON_DISK" ]
 then
   MEMFLAG="-M"
+  LCA_MEMFLAG="-M"
   echo "Kraken build set to minimize disk writes."
 else
+  # set_lcas sorts its updates in runs of 2G and applies them sequentially
+  LCA_MEMFLAG="-B 2G"
   echo "Kraken build set to minimize RAM usage."
 fi
 
@@ -116,7 +120,17 @@ echo "Found $N_FILES sequence files (*.{fna,fa,ffn,fasta,fsa}) in the library di
 if [ -e "database.jdb" ] || [ -e "database0.kdb" ]
 then
   echo "Skipping step 1, k-mer set already exists."
+elif [ -z "$KRAKEN_MAX_DB_SIZE" ]
+then
+  # kmer_count writes the sorted k-mer set and its index, so step 3 is skipped
+  echo "Creating sorted k-mer set (steps 1 and 3 of 6)..."
+  start_time1=$(date "+%s.%N")
+  exe eval kmer_count -k $KRAKEN_KMER_LEN -n $KRAKEN_MINIMIZER_LEN -t $KRAKEN_THREAD_CT \
+    -o database0.kdb.tmp -i database.idx <( cat_library )
+  mv database0.kdb.tmp database0.kdb
+  echo "K-mer set created. [$(report_time_elapsed $start_time1)]"
 else
+  # database reduction (step 2) works on the unsorted Jellyfish output
   echo "Creating k-mer set (step 1 of 6)..."
   start_time1=$(date "+%s.%N")
 
@@ -267,7 +281,7 @@ if [ "$KRAKEN_LCA_DATABASE" != "0" ]; then
     fi
 
 	[[ -z "${KRAKEN_LCA_ORDER}" ]] && DC="-c database.kdb.counts" || DC=""
-    set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
+    set_lcas $LCA_MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
         -b taxDB $PARAM $PARAM1 -t $KRAKEN_THREAD_CT -m seqid2taxid.map $DC \
         -F <( cat_library ) -T > seqid2taxid-plus.map
     if [ "$KRAKEN_ADD_TAXIDS_FOR_SEQ" == "1" ] || [ "$KRAKEN_ADD_TAXIDS_FOR_GENOME" == "1" ]; then
@@ -286,12 +300,12 @@ if [ "$KRAKEN_LCA_DATABASE" != "0" ]; then
         echo " Setting LCAs for $DDIR (substep 6.$COUNTER of 6.$TOTAL) ..."
 	    [[ $COUNTER -eq $TOTAL ]] && DC="-c database.kdb.counts" || DC=""
 		  ## First reset all taxids that appear in the set to zero (flag -R)
-        exe eval set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
+        exe eval set_lcas $LCA_MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
           -b taxDB $PARAM1 -t $KRAKEN_THREAD_CT -m seqid2taxid.map \
           -F <( cat_libraryp $DDIR ) -TR
 
 		  ## Then just re-set them
-        exe eval set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
+        exe eval set_lcas $LCA_MEMFLAG -x -d $SORTED_DB_NAME -o database.kdb -i database.idx -v \
           -b taxDB $PARAM1 -t $KRAKEN_THREAD_CT -m seqid2taxid.map $DC \
           -F <( cat_libraryp $DDIR ) -T
 
@@ -331,7 +345,7 @@ if [ "$KRAKEN_UID_DATABASE" != "0" ]; then
       fi
     fi
     start_time1=$(date "+%s.%N")
-      set_lcas $MEMFLAG -x -d $SORTED_DB_NAME -I uid_to_taxid.map -o uid_database.kdb -i database.idx -v \
+      set_lcas $LCA_MEMFLAG -x -d $SORTED_DB_NAME -I uid_to_taxid.map -o uid_database.kdb -i database.idx -v \
         -b taxDB $PARAM -t $KRAKEN_THREAD_CT -m seqid2taxid.map -c uid_database.kdb.counts -F <( cat_library )
   
     echo "UID Database created. [$(report_time_elapsed $start_time1)]"
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "kmerstore.hpp"
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <algorithm>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+using namespace std;
+using namespace kraken;
+
+// Counts hardware cache misses of this process; returns -1 if unavailable
+static int open_cache_miss_counter() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Half of the queries are k-mers sampled from the database, half random k-mers
+static vector<uint64_t> make_queries(KmerStore &db, uint64_t nr_queries) {
+  mt19937_64 rng(42);
+  uint64_t k_mask = (1ull << (db.get_k() * 2)) - 1;
+  vector<uint64_t> queries(nr_queries);
+  for (uint64_t j = 0; j < nr_queries; j++) {
+    if (j % 2 == 0)
+      queries[j] = db.get_key(rng() % db.get_key_ct());
+    else
+      queries[j] = db.canonical_representation(rng() & k_mask);
+  }
+  shuffle(queries.begin(), queries.end(), rng);
+  return queries;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 4 || argc % 2) {
+    std::cerr << "USAGE: bench_kmer_query NR_QUERIES DATABASE INDEX [DATABASE INDEX ...]\n"
+       "\n"
+       "Times NR_QUERIES k-mer lookups on each database, half of them k-mers sampled from\n"
+       " the database and half random k-mers, and reports the number of cache misses.\n"
+       " Use it to compare the storage engines, e.g. the pair layout with the blocked\n"
+       " layout (db_sort -B) or the compact format (db_compress). INDEX is ignored\n"
+       " for engines w/o index (e.g. '-').\n";
+    return 1;
+  }
+  uint64_t nr_queries = strtoull(argv[1], NULL, 10);
+  int fd = open_cache_miss_counter();
+  if (fd < 0)
+    warn("cannot count cache misses");
+
+  for (int i = 2; i < argc; i += 2) {
+    QuickFile db_file(argv[i]);
+    QuickFile idx_file;
+    bool has_index = KmerStore::needs_index(db_file.ptr());
+    if (has_index)
+      idx_file.open_file(argv[i+1]);
+    KmerStore *db = KmerStore::open(db_file.ptr(), db_file.size(),
+                                    has_index ? idx_file.ptr() : NULL);
+    // touch all pages before timing
+    db_file.load_file();
+    size_t total_size = db_file.size();
+    if (has_index) {
+      idx_file.load_file();
+      total_size += idx_file.size();
+    }
+    vector<uint64_t> queries = make_queries(*db, nr_queries);
+
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    auto start = chrono::steady_clock::now();
+    uint64_t found = 0;
+    KmerStore::QueryState state;
+    for (uint64_t j = 0; j < nr_queries; j++) {
+      if (db->lookup(queries[j], db->bin_key(queries[j]), state) != NULL)
+        ++found;
+    }
+    auto end = chrono::steady_clock::now();
+    long long cache_misses = -1;
+    if (fd >= 0) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd, &cache_misses, sizeof(cache_misses)) != sizeof(cache_misses))
+        cache_misses = -1;
+    }
+
+    double secs = chrono::duration<double>(end - start).count();
+    cout << argv[i] << " (" << db->engine_name() << "):\t"
+         << found << "/" << nr_queries << " found\t"
+         << secs * 1e9 / nr_queries << " ns/query\t";
+    if (cache_misses >= 0)
+      cout << (double) cache_misses / nr_queries << " cache misses/query\t";
+    else
+      cout << "n/a cache misses/query\t";
+    cout << total_size << " bytes\n";
+    delete db;
+  }
+  if (fd >= 0)
+    close(fd);
+}
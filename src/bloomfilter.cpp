@@ -0,0 +1,174 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bloomfilter.hpp"
+#include <cmath>
+
+using std::string;
+using std::vector;
+
+namespace kraken {
+
+static const char BLOOM_FILTER_MAGIC[] = "KRAKBLM1";
+static const size_t BLOOM_FILTER_HEADER_WORDS = 8;
+static const uint64_t BLOCK_BYTES = BloomFilter::BLOCK_WORDS * sizeof(uint64_t);
+// block_of() maps the high half of the hash onto the blocks
+static const uint64_t MAX_BLOCKS = 1ull << 32;
+
+// odd multipliers picking a bit of a word for each hash (the first eight
+// are the salts of the split block Bloom filters of Parquet)
+const uint32_t BloomFilter::BIT_SALTS[BloomFilter::MAX_HASHES] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+  0x85ebca77U, 0xc2b2ae3dU, 0x27d4eb2fU, 0x165667b1U,
+  0xd3a2646dU, 0xfd7046c5U, 0xb55a4f09U, 0x6c8e9cf5U
+};
+
+BloomFilter::BloomFilter() {
+  fptr = NULL;
+  k = 0;
+  key_ct = block_ct = hash_ct = 0;
+  blocks = NULL;
+}
+
+BloomFilter::BloomFilter(char *ptr) {
+  fptr = ptr;
+  if (! is_bloom_filter(ptr))
+    errx(EX_DATAERR, "not a k-mer Bloom filter");
+  const uint64_t *header = (const uint64_t *) ptr;
+  k = header[1];
+  key_ct = header[2];
+  block_ct = header[3];
+  hash_ct = header[4];
+  if (hash_ct == 0 || hash_ct > MAX_HASHES || block_ct == 0 || block_ct > MAX_BLOCKS)
+    errx(EX_DATAERR, "corrupt k-mer Bloom filter");
+  blocks = header + BLOOM_FILTER_HEADER_WORDS;
+}
+
+bool BloomFilter::is_bloom_filter(const char *ptr) {
+  return strncmp(BLOOM_FILTER_MAGIC, ptr, 8) == 0;
+}
+
+size_t BloomFilter::filesize() const {
+  return BLOOM_FILTER_HEADER_WORDS * 8 + block_ct * BLOCK_BYTES;
+}
+
+double BloomFilter::get_fpr() const {
+  return estimate_fpr((double) key_ct / block_ct, hash_ct);
+}
+
+// The number of k-mers in a block is Poisson distributed. A block w/ j
+// k-mers has about j * hash_ct / 8 of them setting a bit in each word.
+double BloomFilter::estimate_fpr(double keys_per_block, uint64_t hash_ct) {
+  double lambda = keys_per_block;
+  double spread = 10 * sqrt(lambda) + 10;
+  uint64_t lo = lambda > spread ? (uint64_t) (lambda - spread) : 0;
+  uint64_t hi = (uint64_t) (lambda + spread);
+  double fpr = 0;
+  for (uint64_t j = lo; j <= hi; j++) {
+    double p_j = exp(-lambda + j * log(lambda) - lgamma(j + 1.0));
+    double bits_per_word = (double) j * hash_ct / BLOCK_WORDS;
+    double p_set = 1 - pow(1 - 1.0 / 64, bits_per_word);
+    fpr += p_j * pow(p_set, (double) hash_ct);
+  }
+  return fpr;
+}
+
+// lowest estimated rate w/ block_ct blocks, and the number of hashes for it
+static double best_fpr(uint64_t key_ct, uint64_t block_ct, uint64_t &hash_ct) {
+  double best = 2;
+  for (uint64_t h = 1; h <= BloomFilter::MAX_HASHES; h++) {
+    double fpr = BloomFilter::estimate_fpr((double) key_ct / block_ct, h);
+    if (fpr < best) {
+      best = fpr;
+      hash_ct = h;
+    }
+  }
+  return best;
+}
+
+void BloomFilter::write(string filename, KmerStore &db, double fpr, uint64_t max_bytes) {
+  BloomFilter filter;
+  filter.k = db.get_k();
+  filter.key_ct = db.get_key_ct();
+  uint64_t key_ct = filter.key_ct;
+
+  uint64_t max_blocks = MAX_BLOCKS;
+  if (max_bytes > 0) {
+    if (max_bytes < BLOOM_FILTER_HEADER_WORDS * 8 + BLOCK_BYTES)
+      errx(EX_USAGE, "memory limit for the Bloom filter is too small");
+    max_blocks = std::min(max_blocks, (max_bytes - BLOOM_FILTER_HEADER_WORDS * 8) / BLOCK_BYTES);
+  }
+
+  // fewest blocks w/ the estimated rate at most fpr (the rate falls w/ the
+  // number of blocks)
+  uint64_t lo = 1, hi = max_blocks;
+  uint64_t hash_ct = 1;
+  if (key_ct > 0 && best_fpr(key_ct, hi, hash_ct) <= fpr) {
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      if (best_fpr(key_ct, mid, hash_ct) <= fpr)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+  }
+  else if (key_ct > 0) {
+    fprintf(stderr, "Warning: false positive rate %g needs more than %llu bytes\n",
+            fpr, (unsigned long long) (max_blocks * BLOCK_BYTES));
+  }
+  filter.block_ct = key_ct > 0 ? hi : 1;
+  best_fpr(std::max(key_ct, (uint64_t) 1), filter.block_ct, hash_ct);
+  filter.hash_ct = hash_ct;
+
+  vector<uint64_t> block_data(filter.block_ct * BLOCK_WORDS, 0);
+  uint64_t *words = block_data.data();
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (uint64_t i = 0; i < key_ct; i++) {
+    uint64_t h = hash(db.get_key(i));
+    uint64_t *block = words + filter.block_of(h) * BLOCK_WORDS;
+    uint32_t x = (uint32_t) h;
+    uint32_t word = (x * WORD_SALT) >> 29;
+    for (uint64_t j = 0; j < filter.hash_ct; j++) {
+      uint64_t *w = block + (word + j) % BLOCK_WORDS;
+      uint64_t bit = bit_of(x, j);
+      if (! (__atomic_load_n(w, __ATOMIC_RELAXED) & bit))
+        __sync_fetch_and_or(w, bit);
+    }
+  }
+
+  std::ofstream out(filename.c_str(), std::ofstream::binary);
+  if (! out)
+    err(EX_CANTCREAT, "unable to open %s", filename.c_str());
+  uint64_t header[BLOOM_FILTER_HEADER_WORDS] = {0};
+  memcpy(header, BLOOM_FILTER_MAGIC, 8);
+  header[1] = filter.k;
+  header[2] = key_ct;
+  header[3] = filter.block_ct;
+  header[4] = filter.hash_ct;
+  out.write((const char *) header, sizeof(header));
+  out.write((const char *) block_data.data(), block_data.size() * sizeof(uint64_t));
+  out.close();
+  if (! out)
+    err(EX_IOERR, "error writing %s", filename.c_str());
+}
+
+} // namespace
@@ -0,0 +1,115 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BLOOMFILTER_HPP
+#define BLOOMFILTER_HPP
+
+#include "kraken_headers.hpp"
+#include "kmerstore.hpp"
+
+namespace kraken {
+  // Blocked Bloom filter of the k-mers of a database, used to skip the
+  // lookup of k-mers that are not in the DB. It is kept in a sidecar file
+  // next to the DB (database.bloom, made by db_bloom).
+  //
+  // Each k-mer hashes to one block of a cache line (8 words of 64 bits)
+  // and sets hash_ct bits in it, in consecutive words starting at a hashed
+  // word; so a query reads a single cache line. There are no false
+  // negatives: contains() is true for all k-mers of the DB.
+  //
+  // File layout (8-byte words):
+  //   magic, k, key_ct, block_ct, hash_ct, 3 words reserved, blocks
+  class BloomFilter {
+    public:
+    static const uint64_t BLOCK_WORDS = 8;
+    static const uint64_t MAX_HASHES = 16;
+
+    // Null constructor
+    BloomFilter();
+
+    // ptr points to start of mmap'ed filter
+    BloomFilter(char *ptr);
+
+    // true if ptr points to a filter in this format
+    static bool is_bloom_filter(const char *ptr);
+
+    // Write a filter of the k-mers of db w/ a false positive rate of about
+    // fpr, using at most max_bytes (0 for no limit). W/ a limit that is too
+    // small for fpr, the filter w/ the lowest rate in max_bytes is written.
+    static void write(std::string filename, KmerStore &db, double fpr, uint64_t max_bytes);
+
+    // Expected false positive rate w/ keys_per_block k-mers per block
+    static double estimate_fpr(double keys_per_block, uint64_t hash_ct);
+
+    uint8_t get_k() const { return k; }
+    uint64_t get_key_ct() const { return key_ct; }
+    uint64_t get_block_ct() const { return block_ct; }
+    uint64_t get_hash_ct() const { return hash_ct; }
+    double get_fpr() const;
+    size_t filesize() const;
+
+    // false if kmer (canonical) is certainly not in the DB
+    bool contains(uint64_t kmer) const {
+      uint64_t h = hash(kmer);
+      const uint64_t *block = blocks + block_of(h) * BLOCK_WORDS;
+      uint32_t x = (uint32_t) h;
+      uint32_t word = (x * WORD_SALT) >> 29;
+      for (uint64_t i = 0; i < hash_ct; i++) {
+        if (! (block[(word + i) % BLOCK_WORDS] & bit_of(x, i)))
+          return false;
+      }
+      return true;
+    }
+
+    // prefetch the block of kmer, for queries of many k-mers
+    void prefetch(uint64_t kmer) const {
+      __builtin_prefetch(blocks + block_of(hash(kmer)) * BLOCK_WORDS);
+    }
+
+    private:
+    static const uint32_t WORD_SALT = 0x9e3779b1;
+    static const uint32_t BIT_SALTS[MAX_HASHES];
+
+    char *fptr;
+    uint8_t k;
+    uint64_t key_ct;
+    uint64_t block_ct;
+    uint64_t hash_ct;
+    const uint64_t *blocks;
+
+    // MurmurHash3 finalizer
+    static uint64_t hash(uint64_t kmer) {
+      kmer ^= kmer >> 33;
+      kmer *= 0xff51afd7ed558ccdULL;
+      kmer ^= kmer >> 33;
+      kmer *= 0xc4ceb9fe1a85ec53ULL;
+      kmer ^= kmer >> 33;
+      return kmer;
+    }
+    // the high half of the hash picks the block, the low half the bits
+    uint64_t block_of(uint64_t h) const {
+      return ((h >> 32) * block_ct) >> 32;
+    }
+    static uint64_t bit_of(uint32_t x, uint64_t i) {
+      return 1ull << ((x * BIT_SALTS[i]) >> 26);
+    }
+  };
+}
+
+#endif
@@ -21,7 +21,8 @@
 #define __STDC_FORMAT_MACROS 1 // for PRIu64, etc.
 
 #include "kraken_headers.hpp"
-#include "krakendb.hpp"
+#include "kmerstore.hpp"
+#include "bloomfilter.hpp"
 #include "krakenutil.hpp"
 #include "quickfile.hpp"
 #include "seqreader.hpp"
@@ -32,6 +33,10 @@
 #include <sstream>
 #include <inttypes.h>
 #include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <cstdio>
 #include <inttypes.h>
 
@@ -41,16 +46,10 @@ int New_taxid_start = 1000000000;
 using namespace std;
 using namespace kraken;
 
-#define USE_KHSET_FOR_EXACT_COUNTING
-
 #ifdef EXACT_COUNTING
-  #ifdef USE_KHSET_FOR_EXACT_COUNTING
-    #include "khset.h"
-    using READCOUNTS = ReadCounts< kh::khset64_t >;
-  #else
-    #include <unordered_set>
-    using READCOUNTS = ReadCounts< unordered_set<uint64_t> >;
-  #endif
+  // k-mers found in a DB are counted by their pair in it (see DBHits)
+  #include "dbhits.hpp"
+  using READCOUNTS = ReadCounts< ExactKmerCount >;
 #else
   using READCOUNTS = ReadCounts<HyperLogLogPlusMinus<uint64_t> >;
 #endif
@@ -60,14 +59,30 @@ using namespace kraken;
   int omp_get_thread_num() { return 0; }
 #endif
 
+class TaxonCounts;
+
 void parse_command_line(int argc, char **argv);
 void usage(int exit_code=EX_USAGE);
-void process_file(char *filename);
-void process_file_with_db_chunk(char *filename);
-void classify_sequence_with_db_chunk(std::pair<DNASequence, uint32_t> & seq, std::fstream & fp, const uint32_t db_chunk_id, const uint32_t db_id);
-bool classify_sequence(DNASequence &dna, ostringstream &koss,
+void process_file(char *filename, char *mate_filename);
+void process_file_with_db_chunk(char *filename, char *mate_filename);
+void process_file_with_spilled_kmers(char *filename, char *mate_filename);
+void classify_sequence_with_db_chunk(DNASequence &dna, std::string &taxa_buf, const uint32_t db_chunk_id, const uint32_t db_id,
+                                     const uint32_t *known_taxa);
+bool classify_sequence_hits(DNASequence &dna, vector<uint32_t> &taxa, ostringstream &koss,
+                            ostringstream &coss, ostringstream &uoss,
+                            TaxonCounts&);
+void reduce_taxon_counts();
+#ifdef EXACT_COUNTING
+void add_db_hit_counts();
+#endif
+unordered_map<uint32_t, uint32_t> count_hits(const vector<uint32_t> &hit_taxa);
+uint32_t resolve_hits(const vector<uint32_t> &hit_taxa);
+void query_work_unit(vector<DNASequence> &work_unit, vector<size_t> &read_offsets,
+                     vector<uint64_t> &kmers, vector<uint64_t> &bin_keys,
+                     vector<const uint32_t*> &kmer_vals);
+bool classify_sequence(DNASequence &dna, const uint32_t **kmer_vals, ostringstream &koss,
                        ostringstream &coss, ostringstream &uoss,
-                       unordered_map<uint32_t, READCOUNTS>&);
+                       TaxonCounts&);
 inline void print_sequence(ostream* oss_ptr, const DNASequence& dna);
 string hitlist_string(const vector<uint32_t> &taxa, const vector<char>& ambig_list);
 
@@ -80,14 +95,21 @@ unordered_map<uint32_t, READCOUNTS> taxon_counts; // stats per taxon
 int Num_threads = 1;
 vector<string> DB_filenames;
 vector<string> Index_filenames;
+vector<string> Filter_filenames;
 bool Quick_mode = false;
 bool Fastq_input = false;
+bool Paired_input = false;
+bool Interleaved_input = false;
+bool Check_mate_names = false;
 bool Print_classified = false;
 bool Print_unclassified = false;
 bool Print_kraken = true;
 bool Print_kraken_report = false;
 bool Populate_memory = false;
 uint64_t Populate_memory_size = 0;
+bool Use_huge_pages = false;
+bool Spill_kmers = false;
+bool Numa_interleave = false;
 bool Only_classified_kraken_output = false;
 bool Print_sequence = false;
 bool Print_Progress = true;
@@ -110,14 +132,97 @@ vector<ofstream*> Open_fstreams;
 vector<ogzstream*> Open_gzstreams;
 size_t Work_unit_size = DEF_WORK_UNIT_SIZE;
 TaxonomyDB<uint32_t> taxdb;
-static vector<KrakenDB*> KrakenDatabases (DB_filenames.size());
+static vector<KmerStore*> KrakenDatabases (DB_filenames.size());
+// Bloom filters of the databases (NULL if none), consulted before lookups
+static vector<BloomFilter*> Prefilters;
+#ifdef EXACT_COUNTING
+static vector<DBHits*> DB_hits;  // distinct k-mers found in each database
+#endif
+// how many k-mers ahead the filter blocks are prefetched in query_work_unit
+static const size_t FILTER_PREFETCH_DIST = 8;
+// minimizer parameters shared by all databases (0 if they differ)
+uint8_t Minimizer_len = 0;
+uint64_t Minimizer_xor_mask = 0;
+
+// Read and k-mer counts of the taxa seen by one thread in the whole run.
+// Taxa are found by their dense index in the taxonomy (taxa that are not in
+// it in a map), their counts are allocated in chunks from a deque.
+// The sketches are not arena-allocated: the tables live for the whole run,
+// so each thread allocates the sketch of a taxon once, and an arena would
+// need an allocator parameter on HyperLogLogPlusMinus for little gain.
+class TaxonCounts {
+public:
+  void init(size_t n_dense_taxa) {
+    slot_of_dense.assign(n_dense_taxa, 0);
+  }
 
-struct db_status {
-  db_status() : current_bin_key(0), current_min_pos(1), current_max_pos(0) {}
-  uint64_t current_bin_key;
-  int64_t current_min_pos;
-  int64_t current_max_pos;
+  READCOUNTS& operator[](uint32_t taxon) {
+    return at(taxdb.getDenseIndex(taxon), taxon);
+  }
+
+  // Counts a k-mer of the current read. Consecutive k-mers of a read
+  // mostly have the same taxon, so they are buffered while it does not
+  // change and each run takes one table lookup and one bulk insert (per
+  // RUN_BUF_SIZE k-mers, to keep the buffer in cache).
+  // end_read() has to be called after the last k-mer of a read.
+  void add_kmer(uint32_t taxon, uint64_t kmer) {
+    if (taxon != run_taxon || kmer_buf.size() == RUN_BUF_SIZE)
+      end_read();
+    run_taxon = taxon;
+    kmer_buf.push_back(kmer);
+  }
+
+  void end_read() {
+    if (kmer_buf.empty())
+      return;
+#ifdef EXACT_COUNTING
+    // k-mers found in a DB were added to DB_hits when they were found
+    if (run_taxon != 0) {
+      (*this)[run_taxon].add_kmer_count(kmer_buf.size());
+      kmer_buf.clear();
+      return;
+    }
+#endif
+    (*this)[run_taxon].add_kmers(kmer_buf.data(), kmer_buf.size());
+    kmer_buf.clear();
+  }
+
+  // Moves the counts of other into this table
+  void merge(TaxonCounts &other) {
+    for (size_t s = 0; s < other.slots.size(); ++s)
+      at(other.slot_dense[s], other.slot_taxa[s]) += std::move(other.slots[s]);
+    other = TaxonCounts();
+  }
+
+  void move_to(unordered_map<uint32_t, READCOUNTS> &counts) {
+    for (size_t s = 0; s < slots.size(); ++s)
+      counts[slot_taxa[s]] += std::move(slots[s]);
+    *this = TaxonCounts();
+  }
+
+private:
+  static const size_t RUN_BUF_SIZE = 256;
+  vector<uint32_t> slot_of_dense;  // slot + 1 of each dense index, 0 if none yet
+  unordered_map<uint32_t, uint32_t> slot_of_other;  // same for taxa not in the taxonomy
+  std::deque<READCOUNTS> slots;
+  vector<uint32_t> slot_taxa, slot_dense;  // taxon of each slot
+  uint32_t run_taxon = 0;
+  vector<uint64_t> kmer_buf;  // k-mers of the current run
+
+  READCOUNTS& at(uint32_t dense, uint32_t taxon) {
+    // taxon 0 has dense index 0, which also stands for unknown taxa
+    uint32_t &slot = dense != 0 || taxon == 0 ? slot_of_dense[dense] : slot_of_other[taxon];
+    if (slot == 0) {
+      slots.emplace_back();
+      slot_taxa.push_back(taxon);
+      slot_dense.push_back(dense);
+      slot = slots.size();
+    }
+    return slots[slot - 1];
+  }
 };
+// counts of each thread, reduced into taxon_counts at the end
+vector<TaxonCounts> Thread_taxon_counts;
 
 unsigned long long total_classified = 0;
 unsigned long long total_sequences = 0;
@@ -174,24 +279,37 @@ int main(int argc, char **argv) {
 
   static vector<QuickFile> idx_files (DB_filenames.size());
   static vector<QuickFile> db_files (DB_filenames.size());
-  static vector<KrakenDBIndex> db_indices (DB_filenames.size());
 
 
-  // TODO: Check DB_filenames and Index_filesnames have the same length
+  size_t n_indices = 0;
   for (size_t i=0; i < DB_filenames.size(); ++i) {
     cerr << " Database " << DB_filenames[i] << endl;
     db_files[i].open_file(DB_filenames[i]);
+    // the storage engine is chosen by the file magic; not all engines have an index
+    bool has_index = KmerStore::needs_index(db_files[i].ptr());
+    // indices (-i) are given in order for the databases that need one
+    if (has_index) {
+      if (n_indices >= Index_filenames.size())
+        errx(EX_USAGE, "missing index (-i) for database %s", DB_filenames[i].c_str());
+      idx_files[i].open_file(Index_filenames[n_indices++]);
+    }
+    // copies have to be made before the DB objects point into the files
+    if (Populate_memory && Populate_memory_size == 0 && (Use_huge_pages || Numa_interleave)) {
+      db_files[i].copy_to_memory(Use_huge_pages, Numa_interleave);
+      if (has_index)
+        idx_files[i].copy_to_memory(Use_huge_pages, Numa_interleave);
+    }
 
-    KrakenDatabases.push_back(new KrakenDB(db_files[i].ptr()));
-    idx_files[i].open_file(Index_filenames[i]);
     // NOTE: we switched the order, i.e., we are creating the objects before loading everything into main memory
-    db_indices[i] = KrakenDBIndex(idx_files[i].ptr());
-    KrakenDatabases[i]->set_index(&db_indices[i]);
+    KrakenDatabases.push_back(KmerStore::open(db_files[i].ptr(), db_files[i].size(),
+                                              has_index ? idx_files[i].ptr() : NULL));
+    cerr << " Storage engine: " << KrakenDatabases[i]->engine_name() << endl;
 
-    if (Populate_memory && Populate_memory_size == 0) // only when no chunk size is passed!
+    if (Populate_memory && Populate_memory_size == 0 && !Use_huge_pages && !Numa_interleave) // only when no chunk size is passed!
     {
       db_files[i].load_file();
-      idx_files[i].load_file();
+      if (has_index)
+        idx_files[i].load_file();
     }
     else if (Populate_memory && Populate_memory_size > 0)
     {
@@ -199,6 +317,30 @@ int main(int argc, char **argv) {
     }
   }
 
+  // Bloom filters (-b) are given in order for the databases, "-" for none
+  if (Filter_filenames.size() > DB_filenames.size())
+    errx(EX_USAGE, "more Bloom filters (-b) than databases");
+  static vector<QuickFile> filter_files (DB_filenames.size());
+  Prefilters.assign(KrakenDatabases.size(), NULL);
+  for (size_t i=0; i < Filter_filenames.size(); ++i) {
+    if (Filter_filenames[i] == "-")
+      continue;
+    cerr << " Bloom filter " << Filter_filenames[i] << endl;
+    filter_files[i].open_file(Filter_filenames[i]);
+    // the filter is read for (nearly) every k-mer, so it is always loaded
+    filter_files[i].load_file();
+    Prefilters[i] = new BloomFilter(filter_files[i].ptr());
+    if (Prefilters[i]->get_k() != KrakenDatabases[i]->get_k() ||
+        Prefilters[i]->get_key_ct() != KrakenDatabases[i]->get_key_ct())
+      errx(EX_DATAERR, "Bloom filter %s does not match database %s",
+           Filter_filenames[i].c_str(), DB_filenames[i].c_str());
+  }
+
+#ifdef EXACT_COUNTING
+  for (size_t i=0; i < KrakenDatabases.size(); ++i)
+    DB_hits.push_back(new DBHits(*KrakenDatabases[i]));
+#endif
+
   // Check all databases have the same k
   uint8_t kmer_size = KrakenDatabases[0]->get_k();
   for (size_t i = 1; i < KrakenDatabases.size(); ++i) {
@@ -210,6 +352,16 @@ int main(int argc, char **argv) {
   };
   KmerScanner::set_k(kmer_size);
 
+  // Bin keys are computed while scanning the reads if all databases use the
+  // same minimizers - otherwise they are computed per database in kmer_query
+  Minimizer_len = KrakenDatabases[0]->bin_key_nt();
+  Minimizer_xor_mask = KrakenDatabases[0]->bin_key_xor_mask();
+  for (size_t i = 1; i < KrakenDatabases.size(); ++i) {
+    if (KrakenDatabases[i]->bin_key_nt() != Minimizer_len ||
+        KrakenDatabases[i]->bin_key_xor_mask() != Minimizer_xor_mask)
+      Minimizer_len = 0;
+  }
+
   if (Populate_memory && Populate_memory_size == 0)
     cerr << "\ncomplete." << endl;
 
@@ -245,14 +397,31 @@ int main(int argc, char **argv) {
 
   //cerr << "Print_kraken: " << Print_kraken << "; Print_kraken_report: " << Print_kraken_report << "; k: " << uint32_t(KrakenDatabases[0]->get_k()) << endl;
 
+  #ifdef _OPENMP
+  Thread_taxon_counts.resize(omp_get_max_threads());
+  #else
+  Thread_taxon_counts.resize(1);
+  #endif
+  for (size_t i = 0; i < Thread_taxon_counts.size(); ++i)
+    Thread_taxon_counts[i].init(taxdb.denseTaxIDs.size());
+
   struct timeval tv1, tv2;
   gettimeofday(&tv1, NULL);
-  for (int i = optind; i < argc; i++) {
-    if (Populate_memory && Populate_memory_size > 0)
-      process_file_with_db_chunk(argv[i]);
+  // with -P, files are given as pairs of mate files
+  int files_per_input = Paired_input && ! Interleaved_input ? 2 : 1;
+  for (int i = optind; i + files_per_input <= argc; i += files_per_input) {
+    char *mate_filename = files_per_input == 2 ? argv[i + 1] : NULL;
+    if (Populate_memory && Populate_memory_size > 0 && Spill_kmers)
+      process_file_with_spilled_kmers(argv[i], mate_filename);
+    else if (Populate_memory && Populate_memory_size > 0)
+      process_file_with_db_chunk(argv[i], mate_filename);
     else
-      process_file(argv[i]);
+      process_file(argv[i], mate_filename);
   }
+  reduce_taxon_counts();
+#ifdef EXACT_COUNTING
+  add_db_hit_counts();
+#endif
   gettimeofday(&tv2, NULL);
 
   report_stats(tv1, tv2);
@@ -273,13 +442,8 @@ int main(int argc, char **argv) {
         }
       } 
       if (!counts_file_gd) {
-        ofstream ofs(fname);
         cerr << "Writing kmer counts to " << fname << "... [only once for this database, may take a while] " << endl;
-        auto counts = KrakenDatabases[i]->count_taxons();
-        for (auto it = counts.begin(); it != counts.end(); ++it) {
-          ofs << it->first << '\t' << it->second << '\n';
-        }
-        ofs.close();
+        TaxonomyDB<uint32_t>::writeGenomeSizes(KrakenDatabases[i]->count_taxons(), fname);
       }
       taxdb.readGenomeSizes(fname);
     }
@@ -339,7 +503,11 @@ int main(int argc, char **argv) {
   }
 
   for (size_t i=0; i < KrakenDatabases.size(); ++i) {
+#ifdef EXACT_COUNTING
+    delete DB_hits[i];
+#endif
     delete KrakenDatabases[i];
+    delete Prefilters[i];
   }
 
   return 0;
@@ -374,201 +542,378 @@ void report_stats(struct timeval time1, struct timeval time2) {
           (total_sequences - total_classified) * 100.0 / total_sequences);
 }
 
-bool determine_input_file_type(char* filename)
-{
-  bxz::ifstream file;
-  file.open(filename);
-  if (file.rdstate() & ifstream::failbit) {
-    err(EX_NOINPUT, "can't open %s", filename);
-  }
-  std::istreambuf_iterator<char> file_iter(file);
-  bool ret = *file_iter == '@';
-  file.close();
-  return ret;
-};
-
-void merge_intermediate_results_by_workers(const bool first_intermediate_output, const std::string & tmp_file_name) {
-  const std::string filename_merged_summary = tmp_file_name;
+// Read IDs of mates may end in /1 and /2 (or .1, _1 ...)
+static void strip_mate_suffix(string &id) {
+  size_t len = id.size();
+  if (len >= 2 && (id[len - 1] == '1' || id[len - 1] == '2') &&
+      (id[len - 2] == '/' || id[len - 2] == '_' || id[len - 2] == '.'))
+    id.resize(len - 2);
+}
 
-  FILE *fp_prev_merged_summary = NULL;
-  std::string filename_prev_merged_summary;
-  if (!first_intermediate_output)
-  {
-    filename_prev_merged_summary = filename_merged_summary + ".prev";
-    rename(filename_merged_summary.c_str(), filename_prev_merged_summary.c_str());
-    fp_prev_merged_summary = fopen(filename_prev_merged_summary.c_str(), "rb");
+// Mates are classified as one sequence. They are joined by an N, so that
+// no k-mer spans both mates.
+static void merge_mates(DNASequence &dna, DNASequence &mate) {
+  strip_mate_suffix(dna.id);
+  if (Check_mate_names) {
+    strip_mate_suffix(mate.id);
+    if (dna.id != mate.id)
+      errx(EX_DATAERR, "mismatched mate pair names ('%s' & '%s')", dna.id.c_str(), mate.id.c_str());
   }
+  dna.seq += 'N';
+  dna.seq += mate.seq;
+  if (Fastq_input) {
+    dna.quals += '!';
+    dna.quals += mate.quals;
+  }
+}
 
-  std::fstream fp_merged_summary(filename_merged_summary, std::fstream::out | std::fstream::binary | std::fstream::trunc);
-  fp_merged_summary.exceptions(std::fstream::badbit);
-
-  std::vector<FILE*> worker_files(Num_threads);
-  std::vector<uint32_t> next_read_id(Num_threads);
-  for (int worker_id = 0; worker_id < Num_threads; ++worker_id)
+// Reads the input in work units of reads, or with -P of read pairs, which
+// are either in two mate files or interleaved in one file
+class InputReader {
+  public:
+  InputReader(char *filename, char *mate_filename)
+    : filename(filename), mate_filename(mate_filename),
+      reader(filename, Work_unit_size, Paired_input && mate_filename == NULL),
+      mate_reader(NULL)
   {
-    const std::string worker_filename = filename_merged_summary + "." + std::to_string(worker_id);
-    worker_files[worker_id] = fopen(worker_filename.c_str(), "rb");
+    Fastq_input = reader.is_fastq();
+    if (mate_filename != NULL) {
+      mate_reader = new SequenceBlockReader(mate_filename, Work_unit_size);
+      if (mate_reader->is_fastq() != Fastq_input)
+        errx(EX_DATAERR, "%s and %s are not of the same format", filename, mate_filename);
+    }
+  }
 
-    if (fread(&next_read_id[worker_id], sizeof(next_read_id[worker_id]), 1, worker_files[worker_id]) != 1)
-      next_read_id[worker_id] = 0; // 0 indicates that there is no read left in this file (reads are indexed starting at 1)
+  ~InputReader() {
+    delete mate_reader;
   }
 
-  std::vector<uint32_t> taxa, taxa_prev_summary;
-  uint32_t seq_idx = 1;
-  while (true)
-  {
-    // determine worker to get this read info from
-    int worker_to_retrieve_from = -1;
-    for (int worker_id = 0; worker_id < Num_threads; ++worker_id) {
-      if (seq_idx == next_read_id[worker_id]) {
-        worker_to_retrieve_from = worker_id;
-        break;
+  // Thread-safe, false at end of input. The block id is the unit id; units
+  // are the same every time the input is read.
+  bool read_work_unit(SequenceBlock &block, vector<DNASequence> &work_unit, size_t &total_nt) {
+    if (! reader.read_block(block))
+      return false;
+    total_nt = block.parse(work_unit);
+    if (! Paired_input)
+      return true;
+
+    if (mate_reader != NULL) {
+      SequenceBlock mate_block;
+      vector<DNASequence> mates;
+      mate_reader->read_records(mate_block, block.id, work_unit.size());
+      total_nt += mate_block.parse(mates);
+      if (mates.size() != work_unit.size())
+        errx(EX_DATAERR, "mismatched sequence counts - %s has fewer reads", mate_filename);
+      for (size_t j = 0; j < work_unit.size(); ++j)
+        merge_mates(work_unit[j], mates[j]);
+    }
+    else {
+      if (work_unit.size() % 2)
+        errx(EX_DATAERR, "odd number of reads in interleaved file %s", filename);
+      for (size_t j = 0; j < work_unit.size() / 2; ++j) {
+        std::swap(work_unit[j], work_unit[2 * j]);
+        merge_mates(work_unit[j], work_unit[2 * j + 1]);
       }
+      work_unit.resize(work_unit.size() / 2);
     }
-    if (worker_to_retrieve_from == -1)
-      break; // finished processing all files
-
-    // retrieve from that worker and load next sequence name
-    uint32_t taxa_size;
-    fread(&taxa_size, sizeof(uint32_t), 1, worker_files[worker_to_retrieve_from]);
-    taxa.resize(taxa_size);
-    fread(&taxa[0], sizeof(uint32_t), taxa_size, worker_files[worker_to_retrieve_from]);
+    total_nt += work_unit.size();  // the Ns between mates
+    return true;
+  }
 
-    if (!first_intermediate_output)
-    {
-      uint32_t taxa_prev_size;
-      fread(&taxa_prev_size, sizeof(uint32_t), 1, fp_prev_merged_summary);
-      assert(taxa_size == taxa_prev_size);
-      taxa_prev_summary.resize(taxa_prev_size);
-      fread(&taxa_prev_summary[0], sizeof(uint32_t), taxa_prev_size, fp_prev_merged_summary);
+  // Call after all work units are read
+  void finish() {
+    if (mate_reader != NULL && ! mate_reader->at_end())
+      errx(EX_DATAERR, "mismatched sequence counts - %s has more reads", mate_filename);
+  }
 
-      for (uint32_t i = 0; i < taxa_prev_summary.size(); ++i)
-      {
-        assert(!(taxa[i] && taxa_prev_summary[i])); // a kmer cannot be found in more than one database chunk
-        if (taxa_prev_summary[i])
-        {
-          taxa[i] = taxa_prev_summary[i]; // if previous chunk/database got a match, keep the tax info
-        }
-      }
-    }
+  private:
+  char *filename, *mate_filename;
+  SequenceBlockReader reader;
+  SequenceBlockReader *mate_reader;
+};
 
-    try {
-      fp_merged_summary.write((char*) &taxa_size, 1 * sizeof(uint32_t));
-      fp_merged_summary.write((char*) &taxa[0], taxa_size * sizeof(uint32_t));
-    }
-    catch (const std::fstream::failure& e) {
-      printf("ERROR: Could not write to temporary file: %s\n", e.what());
-      exit(1);
-    }
+// Output of a work unit; units are numbered in input order
+struct unit_output {
+  unit_output() : n_sequences(0), n_bases(0), n_classified(0) {}
+  string kraken, classified, unclassified;
+  uint64_t n_sequences;
+  uint64_t n_bases;
+  uint64_t n_classified;
+};
 
-    // load the next read id from that file
-    if (fread(&next_read_id[worker_to_retrieve_from], sizeof(next_read_id[worker_to_retrieve_from]), 1, worker_files[worker_to_retrieve_from]) != 1)
-      next_read_id[worker_to_retrieve_from] = 0; // 0 indicates that there is no read left in this file (reads are indexed starting at 1)
+// Writes the output of work units in input order. Workers only hand over
+// their output; a writer thread does the writing (and compression) and keeps
+// units that finish early until it is their turn.
+class OutputWriter {
+  public:
+  OutputWriter() : next_unit_id(0) {
+#ifdef _OPENMP
+    done = false;
+    // workers wait if they get too far ahead of the output
+    max_pending = 4 * Num_threads;
+    thread = std::thread(&OutputWriter::run, this);
+#endif
+  }
 
-    ++seq_idx;
+  ~OutputWriter() {
+    finish();
   }
 
-  for (int worker_id = 0; worker_id < Num_threads; ++worker_id)
-  {
-    fclose(worker_files[worker_id]);
-    const std::string worker_filename = filename_merged_summary + "." + std::to_string(worker_id);
-    unlink(worker_filename.c_str());
+  // Takes the output of a unit, leaving output empty
+  void push(uint64_t unit_id, unit_output &output) {
+#ifdef _OPENMP
+    std::unique_lock<std::mutex> lock(mutex);
+    space.wait(lock, [&] { return unit_id < next_unit_id + max_pending; });
+    std::swap(pending[unit_id], output);
+    if (unit_id == next_unit_id)
+      ready.notify_one();
+#else
+    std::swap(pending[unit_id], output);
+    for (auto it = pending.begin(); it != pending.end() && it->first == next_unit_id;
+         it = pending.erase(it), ++next_unit_id)
+      write(it->second);
+#endif
   }
 
-  if (!first_intermediate_output)
-  {
-    fclose(fp_prev_merged_summary);
-    unlink(filename_prev_merged_summary.c_str());
+  // Waits until all units are written
+  void finish() {
+#ifdef _OPENMP
+    if (thread.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+      }
+      ready.notify_one();
+      thread.join();
+    }
+#endif
   }
 
-  fp_merged_summary.close();
-}
+  private:
+  void write(unit_output &output) {
+    if (Print_kraken)
+      (*Kraken_output) << output.kraken;
+    if (Print_classified)
+      (*Classified_output) << output.classified;
+    if (Print_unclassified)
+      (*Unclassified_output) << output.unclassified;
+    total_sequences += output.n_sequences;
+    total_bases += output.n_bases;
+    total_classified += output.n_classified;
+    if (Print_Progress) {
+      fprintf(stderr, "\r Processed %llu sequences (%.2f%% classified)",
+              total_sequences, total_classified * 100.0 / total_sequences);
+    }
+  }
 
-void process_file(char *filename) {
-  string file_str(filename);
-  DNASequenceReader *reader;
-  DNASequence dna;
+#ifdef _OPENMP
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      ready.wait(lock, [&] {
+        return done || (! pending.empty() && pending.begin()->first == next_unit_id);
+      });
+      if (pending.empty() || pending.begin()->first != next_unit_id)
+        break;
+      unit_output output;
+      std::swap(output, pending.begin()->second);
+      pending.erase(pending.begin());
+      ++next_unit_id;
+      space.notify_all();
+      lock.unlock();
+      write(output);
+      lock.lock();
+    }
+  }
 
-  Fastq_input = determine_input_file_type(filename);
+  std::mutex mutex;
+  std::condition_variable ready, space;
+  std::thread thread;
+  bool done;
+  uint64_t max_pending;
+#endif
+  map<uint64_t, unit_output> pending;
+  uint64_t next_unit_id;  // next unit to be written
+};
 
-  if (Fastq_input)
-    reader = new FastqReader(file_str);
-  else
-    reader = new FastaReader(file_str);
+void process_file(char *filename, char *mate_filename) {
+  InputReader reader(filename, mate_filename);
+  OutputWriter writer;
 
 #ifdef _OPENMP
   #pragma omp parallel
 #endif
   {
+    SequenceBlock block;
     vector<DNASequence> work_unit;
+    unit_output output;
     ostringstream kraken_output_ss, classified_output_ss, unclassified_output_ss;
+    vector<size_t> read_offsets;
+    vector<uint64_t> kmers, bin_keys;
+    vector<const uint32_t*> kmer_vals;
+    TaxonCounts &my_taxon_counts = Thread_taxon_counts[omp_get_thread_num()];
 
-    while (reader->is_valid()) {
-      work_unit.clear();
-      size_t total_nt = 0;
-
-#ifdef _OPENMP
-      #pragma omp critical(get_input)
-#endif
-      {
-        while (total_nt < Work_unit_size) {
-          dna = reader->next_sequence();
-          if (! reader->is_valid())
-            break;
-          work_unit.push_back(dna);
-          total_nt += dna.seq.size();
-        }
-      }
-      if (total_nt == 0)
-        break;
-      
-      unordered_map<uint32_t, READCOUNTS> my_taxon_counts;
-      uint64_t my_total_classified = 0;
+    size_t total_nt;
+    while (reader.read_work_unit(block, work_unit, total_nt)) {
       kraken_output_ss.str("");
       classified_output_ss.str("");
       unclassified_output_ss.str("");
+      output.n_classified = 0;
+      // Look up the k-mers of all reads at once, unless in quick mode
+      // where most lookups would be wasted as reads are classified early
+      if (! Quick_mode)
+        query_work_unit(work_unit, read_offsets, kmers, bin_keys, kmer_vals);
       for (size_t j = 0; j < work_unit.size(); j++) {
-        my_total_classified += 
-            classify_sequence( work_unit[j], kraken_output_ss,
+        output.n_classified +=
+            classify_sequence( work_unit[j],
+                           Quick_mode ? NULL : kmer_vals.data() + read_offsets[j],
+                           kraken_output_ss,
                            classified_output_ss, unclassified_output_ss,
                            my_taxon_counts);
       }
- 
-#ifdef _OPENMP
-      #pragma omp critical(write_output)
-#endif
-      {
-        total_classified += my_total_classified;
-        for (auto it = my_taxon_counts.begin(); it != my_taxon_counts.end(); ++it) {
-          taxon_counts[it->first] += std::move(it->second);
-        }
-
-        if (Print_kraken)
-          (*Kraken_output) << kraken_output_ss.str();
-        if (Print_classified)
-          (*Classified_output) << classified_output_ss.str();
-        if (Print_unclassified)
-          (*Unclassified_output) << unclassified_output_ss.str();
-        total_sequences += work_unit.size();
-        total_bases += total_nt;
-        //if (Print_Progress && total_sequences % 100000 < work_unit.size()) 
-        if (Print_Progress) {  
-          fprintf(stderr, "\r Processed %llu sequences (%.2f%% classified)",
-                          total_sequences, total_classified * 100.0 / total_sequences);
-        }
-      }
+      output.kraken = kraken_output_ss.str();
+      output.classified = classified_output_ss.str();
+      output.unclassified = unclassified_output_ss.str();
+      output.n_sequences = work_unit.size();
+      output.n_bases = total_nt;
+      writer.push(block.id, output);
     }
   }  // end parallel section
+  writer.finish();
+  reader.finish();
+}
+
+// Temporary files of the chunked modes hold one block of records per work unit.
+// Blocks are written and read at their offsets and may be in any order.
+
+struct spill_block {
+  spill_block() : offset(0), size(0) {}
+  uint64_t offset;
+  uint64_t size;
+};
+
+// a k-mer in a chunk spill file
+struct spilled_kmer {
+  uint32_t read_idx;  // index of read in work unit
+  uint32_t pos;       // position of k-mer in read
+  uint64_t kmer;      // canonical k-mer
+  uint64_t minimizer; // bin key of the k-mer in the database of the file
+};
+
+// a hit in the hit file
+struct spilled_hit {
+  uint32_t read_idx;
+  uint32_t pos;
+  uint32_t taxon;
+#ifdef EXACT_COUNTING
+  uint64_t pair_id;   // added to DB_hits if the hit is used
+#endif
+};
 
-  delete reader;
+static int open_spill_file(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    err(EX_CANTCREAT, "unable to create temporary file %s", filename.c_str());
+  // the file is removed once it is closed
+  unlink(filename.c_str());
+  return fd;
 }
 
-void process_file_with_db_chunk(char *filename) {
-  string file_str(filename);
-  DNASequence dna;
+static void rewrite_spill_block(int fd, const spill_block &block, const std::string &buf) {
+  for (uint64_t done = 0; done < block.size; ) {
+    ssize_t ret = pwrite(fd, buf.data() + done, block.size - done, block.offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to write to temporary file");
+    done += ret;
+  }
+}
 
-  Fastq_input = determine_input_file_type(filename);
+// Appends buf at an offset reserved atomically, so workers can write concurrently
+static spill_block write_spill_block(int fd, uint64_t *file_size, const std::string &buf) {
+  spill_block block;
+  block.size = buf.size();
+  block.offset = __sync_fetch_and_add(file_size, block.size);
+  rewrite_spill_block(fd, block, buf);
+  return block;
+}
 
+static void read_spill_block(int fd, const spill_block &block, std::string &buf) {
+  buf.resize(block.size);
+  for (uint64_t done = 0; done < block.size; ) {
+    ssize_t ret = pread(fd, &buf[done], block.size - done, block.offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to read from temporary file");
+    done += ret;
+  }
+}
+
+static void append_string(std::string &buf, const std::string &str) {
+  uint32_t len = str.size();
+  buf.append((char *) &len, sizeof(len));
+  buf.append(str);
+}
+
+static std::string read_string(const char *&ptr) {
+  uint32_t len;
+  memcpy(&len, ptr, sizeof(len));
+  ptr += sizeof(len);
+  std::string str(ptr, len);
+  ptr += len;
+  return str;
+}
+
+// Classifies the reads of a work unit from their combined hits
+void classify_work_unit_hits(vector<DNASequence> &work_unit, vector<vector<uint32_t> > &taxa,
+                             unit_output &output, ostringstream &koss, ostringstream &coss,
+                             ostringstream &uoss, TaxonCounts &my_taxon_counts) {
+  koss.str("");
+  coss.str("");
+  uoss.str("");
+  output.n_classified = 0;
+  output.n_sequences = work_unit.size();
+  output.n_bases = 0;
+  for (size_t j = 0; j < work_unit.size(); j++) {
+    output.n_classified += classify_sequence_hits(work_unit[j], taxa[j], koss, coss, uoss, my_taxon_counts);
+    output.n_bases += work_unit[j].seq.size();
+  }
+  output.kraken = koss.str();
+  output.classified = coss.str();
+  output.unclassified = uoss.str();
+}
+
+// Merges the counts of the threads pairwise in a tree, with the merges of
+// each level in parallel, and moves the result into taxon_counts
+void reduce_taxon_counts() {
+  size_t n = Thread_taxon_counts.size();
+  for (size_t step = 1; step < n; step *= 2) {
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic)
+#endif
+    for (size_t i = 0; i < n; i += 2 * step) {
+      if (i + step < n)
+        Thread_taxon_counts[i].merge(Thread_taxon_counts[i + step]);
+    }
+  }
+  Thread_taxon_counts[0].move_to(taxon_counts);
+}
+
+#ifdef EXACT_COUNTING
+// Adds the distinct k-mers found in the databases to the unique k-mer
+// counts of their taxa
+void add_db_hit_counts() {
+  for (size_t i = 0; i < DB_hits.size(); ++i) {
+    unordered_map<uint32_t, uint64_t> counts = DB_hits[i]->count_values();
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+      // k-mers w/ taxon 0 are counted like the ones not in the DB
+      if (it->first != 0)
+        taxon_counts[it->first] += READCOUNTS(0, 0, ExactKmerCount(it->second));
+    }
+  }
+}
+#endif
+
+// Temporary files are put next to the output files
+std::string get_tmp_file_name() {
   std::string dir_for_tmp_file = "./";
   if (!Kraken_output_file.empty())
     dir_for_tmp_file = get_directory(Kraken_output_file);
@@ -578,64 +923,83 @@ void process_file_with_db_chunk(char *filename) {
     dir_for_tmp_file = get_directory(Unclassified_output_file);
   else if (!Report_output_file.empty())
     dir_for_tmp_file = get_directory(Report_output_file);
-  const std::string tmp_file_name = tempnam(dir_for_tmp_file.c_str(), "tmp");
+  return tempnam(dir_for_tmp_file.c_str(), "tmp");
+}
+
+// Every pass over the input looks up the k-mers in one database chunk. The
+// taxa of each work unit are kept in a block of a summary file; work units
+// are the same in every pass, so later passes update their block in place.
+void process_file_with_db_chunk(char *filename, char *mate_filename) {
+  const std::string tmp_file_name = get_tmp_file_name();
+  int summary_fd = open_spill_file(tmp_file_name);
+  uint64_t summary_file_size = 0;
+  vector<spill_block> summary_blocks;
+  bool first_pass = true;
 
   // iterate over databases
-  bool first_intermediate_output = true;
   for (size_t i=0; i<KrakenDatabases.size(); ++i)
   {
-    for (uint32_t db_chunk_id = 0; db_chunk_id < KrakenDatabases[0]->chunks(); ++db_chunk_id)
+    for (uint32_t db_chunk_id = 0; db_chunk_id < KrakenDatabases[i]->chunks(); ++db_chunk_id)
     {
       total_sequences = 0;
       total_bases = 0;
       KrakenDatabases[i]->load_chunk(db_chunk_id);
 
-      DNASequenceReader *reader;
-      if (Fastq_input)
-        reader = new FastqReader(file_str);
-      else
-        reader = new FastaReader(file_str);
-      uint32_t seq_idx = 1;
+      // blocks of the input are the same in every pass
+      InputReader reader(filename, mate_filename);
+      uint64_t n_units = 0;
 
 #ifdef _OPENMP
       #pragma omp parallel
 #endif
       {
-        vector <std::pair<DNASequence, uint32_t> > work_unit;
-        const int worker_id = omp_get_thread_num();
-        const std::string worker_filename = tmp_file_name + "." + std::to_string(worker_id);
-
-        std::fstream fp(worker_filename, std::fstream::out | std::fstream::binary | std::fstream::trunc);
-        fp.exceptions(std::fstream::badbit);
-
-        while (reader->is_valid()) {
-          work_unit.clear();
-          size_t total_nt = 0;
-
-#ifdef _OPENMP
-          #pragma omp critical(get_input)
-#endif
-          {
-            while (total_nt < Work_unit_size) {
-              dna = reader->next_sequence();
-              if (!reader->is_valid())
-                break;
-              work_unit.emplace_back(dna, seq_idx);
-              total_nt += dna.seq.size();
-              ++seq_idx;
-            }
+        SequenceBlock block;
+        vector<DNASequence> work_unit;
+        std::string taxa_buf, summary_buf;
+        vector<std::pair<uint64_t, spill_block> > my_blocks;
+
+        size_t total_nt;
+        while (reader.read_work_unit(block, work_unit, total_nt)) {
+          uint64_t unit_id = block.id;
+          if (! first_pass && unit_id >= summary_blocks.size())
+            errx(EX_DATAERR, "input changed while classifying %s", filename);
+
+          // k-mers found in earlier passes are skipped: a k-mer is found in at most one
+          // chunk, and earlier databases take precedence
+          const uint32_t *known_taxa = NULL;
+          if (! first_pass) {
+            read_spill_block(summary_fd, summary_blocks[unit_id], summary_buf);
+            known_taxa = (const uint32_t *) summary_buf.data();
           }
-          if (total_nt == 0)
-            break;
-
+          taxa_buf.clear();
           for (size_t j = 0; j < work_unit.size(); j++) {
-            classify_sequence_with_db_chunk(work_unit[j], fp, db_chunk_id, 0);
+            // the taxa of a read follow their number
+            classify_sequence_with_db_chunk(work_unit[j], taxa_buf, db_chunk_id, i,
+                                            known_taxa ? known_taxa + 1 : NULL);
+            if (known_taxa)
+              known_taxa += 1 + known_taxa[0];
+          }
+
+          if (first_pass) {
+            my_blocks.push_back(std::make_pair(unit_id,
+              write_spill_block(summary_fd, &summary_file_size, taxa_buf)));
+          }
+          else {
+            assert(summary_buf.size() == taxa_buf.size());
+            uint32_t *summary_taxa = (uint32_t *) &summary_buf[0];
+            const uint32_t *new_taxa = (const uint32_t *) taxa_buf.data();
+            for (size_t t = 0; t < taxa_buf.size() / sizeof(uint32_t); ++t) {
+              if (! summary_taxa[t])
+                summary_taxa[t] = new_taxa[t];
+            }
+            rewrite_spill_block(summary_fd, summary_blocks[unit_id], summary_buf);
           }
 
 #ifdef _OPENMP
           #pragma omp critical(progress)
 #endif
           {
+            n_units = std::max(n_units, unit_id + 1);
             total_sequences += work_unit.size();
             total_bases += total_nt;
             if (Print_Progress) {
@@ -644,153 +1008,476 @@ void process_file_with_db_chunk(char *filename) {
             }
           }
         }
-        fp.close();
+
+        if (first_pass) {
+#ifdef _OPENMP
+          #pragma omp barrier
+          #pragma omp single
+#endif
+          summary_blocks.resize(n_units);
+#ifdef _OPENMP
+          #pragma omp critical(collect_blocks)
+#endif
+          for (size_t b = 0; b < my_blocks.size(); ++b)
+            summary_blocks[my_blocks[b].first] = my_blocks[b].second;
+        }
       }  // end parallel section
+      reader.finish();
 
-      delete reader;
-      merge_intermediate_results_by_workers(first_intermediate_output, tmp_file_name);
-      first_intermediate_output = false;
+      first_pass = false;
     }
   }
 
   fprintf(stderr, "\r Processed %llu sequences\n", total_sequences);
 
-  // merge intermediate results of all chunks and classify
-  // TODO: parallelize this (need to buffer reads), we also do not care about the final output order
+  // classify using the combined results of all chunks
   total_sequences = 0;
+  total_bases = 0;
   total_classified = 0;
 
-  DNASequenceReader *reader;
-  if (Fastq_input)
-    reader = new FastqReader(file_str);
-  else
-    reader = new FastaReader(file_str);
+  InputReader reader(filename, mate_filename);
+  OutputWriter writer;
 
-  unordered_map<uint32_t, uint32_t> hit_counts;
-  vector<uint32_t> taxa;
-  vector<char> ambig_list;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    SequenceBlock block;
+    vector<DNASequence> work_unit;
+    vector<vector<uint32_t> > taxa;
+    std::string summary_buf;
+    unit_output output;
+    ostringstream kraken_output_ss, classified_output_ss, unclassified_output_ss;
+    TaxonCounts &my_taxon_counts = Thread_taxon_counts[omp_get_thread_num()];
+
+    size_t total_nt;
+    while (reader.read_work_unit(block, work_unit, total_nt)) {
+      uint64_t unit_id = block.id;
+      if (unit_id >= summary_blocks.size())
+        errx(EX_DATAERR, "input changed while classifying %s", filename);
+      read_spill_block(summary_fd, summary_blocks[unit_id], summary_buf);
+
+      // one taxa array per read in the block
+      taxa.resize(work_unit.size());
+      const char *ptr = summary_buf.data();
+      const char *end = ptr + summary_buf.size();
+      for (size_t j = 0; j < work_unit.size(); ++j) {
+        if (ptr >= end)
+          errx(EX_DATAERR, "input changed while classifying %s", filename);
+        // get number of elements (taxa.size())
+        uint32_t taxa_size;
+        memcpy(&taxa_size, ptr, sizeof(taxa_size));
+        ptr += sizeof(taxa_size);
+        taxa[j].resize(taxa_size);
+        memcpy(taxa[j].data(), ptr, taxa_size * sizeof(uint32_t));
+        ptr += taxa_size * sizeof(uint32_t);
+      }
+      if (ptr != end)
+        errx(EX_DATAERR, "input changed while classifying %s", filename);
 
-  const std::string taxa_summary_filename = tmp_file_name;
-  FILE* fp_taxa_summary = fopen(taxa_summary_filename.c_str(), "rb");
+      classify_work_unit_hits(work_unit, taxa, output, kraken_output_ss,
+                              classified_output_ss, unclassified_output_ss, my_taxon_counts);
+      writer.push(unit_id, output);
+    }
+  }  // end parallel section
+  writer.finish();
+  reader.finish();
+  if (Print_Progress)
+    fprintf(stderr, "\n");
 
-  while (reader->is_valid()) {
-    hit_counts.clear();
-    taxa.clear();
-    ambig_list.clear();
+  close(summary_fd);
+}
 
-    dna = reader->next_sequence();
-    if (!reader->is_valid())
-      break;
+// Single-pass classification with database chunks (-x together with -S):
+// The input is parsed only once. The k-mers of each work unit are spilled to
+// one temporary file per database chunk, together with the reads themselves.
+// Each chunk then only looks up the k-mers whose minimizers fall into it, and
+// writes the hits to another file. Finally, the reads are classified from the
+// spilled reads and hits, without parsing the input again.
+
+void process_file_with_spilled_kmers(char *filename, char *mate_filename) {
+  InputReader reader(filename, mate_filename);
+
+  const std::string tmp_file_name = get_tmp_file_name();
+  const size_t n_dbs = KrakenDatabases.size();
+  const bool spill_full_reads = Print_classified || Print_unclassified;
+
+  int reads_fd = open_spill_file(tmp_file_name + ".reads");
+  int hits_fd = open_spill_file(tmp_file_name + ".hits");
+  uint64_t reads_file_size = 0, hits_file_size = 0;
+  vector<vector<int> > spill_fds(n_dbs);
+  vector<vector<uint64_t> > spill_file_sizes(n_dbs);
+  for (size_t i = 0; i < n_dbs; ++i) {
+    for (uint32_t c = 0; c < KrakenDatabases[i]->chunks(); ++c)
+      spill_fds[i].push_back(open_spill_file(tmp_file_name + ".db" + std::to_string(i) + ".chunk" + std::to_string(c)));
+    spill_file_sizes[i].resize(spill_fds[i].size());
+  }
 
-    // merge results from chunks into 'taxa'
-    uint32_t hits = 0;
+  // blocks of each work unit, indexed [unit] and [db][chunk][unit]
+  vector<spill_block> read_blocks;
+  vector<vector<vector<spill_block> > > kmer_blocks(n_dbs), hit_blocks(n_dbs);
+  uint64_t n_units = 0;
 
-    // get number of elements (taxa.size())
-    uint32_t taxa_size;
-    fread(&taxa_size, sizeof(taxa_size), 1, fp_taxa_summary);
+  // Pass 1: parse input and spill k-mers
+  total_sequences = 0;
+  total_bases = 0;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    SequenceBlock block;
+    vector<DNASequence> work_unit;
+    std::string read_buf;
+    vector<vector<std::string> > kmer_bufs(n_dbs);
+    for (size_t i = 0; i < n_dbs; ++i)
+      kmer_bufs[i].resize(spill_fds[i].size());
+    vector<std::pair<uint64_t, spill_block> > my_read_blocks;
+    vector<std::pair<uint64_t, spill_block> > my_kmer_blocks;  // unit and block, order: db, chunk
+    vector<size_t> my_kmer_block_dbs, my_kmer_block_chunks;
+    uint64_t *kmer_ptr;
 
-    taxa.resize(taxa_size);
-    fread(&taxa[0], sizeof(uint32_t), taxa_size, fp_taxa_summary);
+    size_t total_nt;
+    while (reader.read_work_unit(block, work_unit, total_nt)) {
+      uint64_t unit_id = block.id;
+
+      read_buf.clear();
+      uint32_t n_reads = work_unit.size();
+      read_buf.append((char *) &n_reads, sizeof(n_reads));
+      for (size_t i = 0; i < n_dbs; ++i)
+        for (size_t c = 0; c < kmer_bufs[i].size(); ++c)
+          kmer_bufs[i][c].clear();
+
+      for (uint32_t j = 0; j < work_unit.size(); j++) {
+        DNASequence &dna = work_unit[j];
+        append_string(read_buf, dna.id);
+        append_string(read_buf, dna.seq);
+        if (spill_full_reads) {
+          append_string(read_buf, dna.header_line);
+          append_string(read_buf, dna.quals);
+        }
 
-    for (uint32_t i = 0; i < taxa.size(); ++i)
-    {
-      if (taxa[i])
+        if (dna.seq.size() < KrakenDatabases[0]->get_k())
+          continue;
+        KmerScanner scanner(dna.seq);
+        if (Minimizer_len)
+          scanner.track_minimizers(Minimizer_len, Minimizer_xor_mask);
+        uint32_t pos = 0;
+        for (; (kmer_ptr = scanner.next_kmer()) != NULL; ++pos) {
+          if (scanner.ambig_kmer())
+            continue;
+          spilled_kmer rec;
+          rec.read_idx = j;
+          rec.pos = pos;
+          rec.kmer = KrakenDatabases[0]->canonical_representation(*kmer_ptr);
+          for (size_t i = 0; i < n_dbs; ++i) {
+            if (Prefilters[i] && ! Prefilters[i]->contains(rec.kmer))
+              continue;
+            rec.minimizer = Minimizer_len ? scanner.minimizer()
+                                          : KrakenDatabases[i]->bin_key(rec.kmer);
+            uint32_t c = KrakenDatabases[i]->chunk_of_minimizer(rec.minimizer);
+            if (c < kmer_bufs[i].size())
+              kmer_bufs[i][c].append((char *) &rec, sizeof(rec));
+          }
+        }
+      }
+
+      my_read_blocks.push_back(std::make_pair(unit_id, write_spill_block(reads_fd, &reads_file_size, read_buf)));
+      for (size_t i = 0; i < n_dbs; ++i) {
+        for (size_t c = 0; c < kmer_bufs[i].size(); ++c) {
+          if (kmer_bufs[i][c].empty())
+            continue;
+          my_kmer_blocks.push_back(std::make_pair(unit_id,
+            write_spill_block(spill_fds[i][c], &spill_file_sizes[i][c], kmer_bufs[i][c])));
+          my_kmer_block_dbs.push_back(i);
+          my_kmer_block_chunks.push_back(c);
+        }
+      }
+
+#ifdef _OPENMP
+      #pragma omp critical(progress)
+#endif
       {
-        ++hit_counts[taxa[i]];
-        // TODO: stop querying this read with other databases
-        if (Quick_mode && ++hits >= Minimum_hit_count)
-          goto quick_mode_call;
+        n_units = std::max(n_units, unit_id + 1);
+        total_sequences += work_unit.size();
+        total_bases += total_nt;
+        if (Print_Progress)
+          fprintf(stderr, "\r Spilled k-mers of %llu sequences", total_sequences);
       }
     }
 
-quick_mode_call:
-    uint64_t *kmer_ptr;
-    uint32_t taxon = 0;
-    if (dna.seq.size() >= KrakenDatabases[0]->get_k()) {
-      KmerScanner scanner(dna.seq);
-      uint32_t taxa_idx = 0;
-      while ((kmer_ptr = scanner.next_kmer()) != NULL) {
-        if (scanner.ambig_kmer()) {
-          ambig_list.push_back(1);
-        } else {
-          ambig_list.push_back(0);
-          uint64_t cannonical_kmer = KrakenDatabases[0]->canonical_representation(*kmer_ptr);
-          taxon = taxa[taxa_idx];
-          taxon_counts[taxon].add_kmer(cannonical_kmer);
-        }
-        ++taxa_idx;
+#ifdef _OPENMP
+    #pragma omp barrier
+    #pragma omp single
+#endif
+    {
+      read_blocks.resize(n_units);
+      for (size_t i = 0; i < n_dbs; ++i) {
+        kmer_blocks[i].assign(spill_fds[i].size(), vector<spill_block>(n_units));
+        hit_blocks[i].assign(spill_fds[i].size(), vector<spill_block>(n_units));
       }
     }
+#ifdef _OPENMP
+    #pragma omp critical(collect_blocks)
+#endif
+    {
+      for (size_t b = 0; b < my_read_blocks.size(); ++b)
+        read_blocks[my_read_blocks[b].first] = my_read_blocks[b].second;
+      for (size_t b = 0; b < my_kmer_blocks.size(); ++b)
+        kmer_blocks[my_kmer_block_dbs[b]][my_kmer_block_chunks[b]][my_kmer_blocks[b].first] = my_kmer_blocks[b].second;
+    }
+  }  // end parallel section
+  reader.finish();
+  if (Print_Progress)
+    fprintf(stderr, "\n");
+
+  // Pass 2: look up the spilled k-mers of each chunk
+  for (size_t i = 0; i < n_dbs; ++i) {
+    for (uint32_t c = 0; c < spill_fds[i].size(); ++c) {
+      KrakenDatabases[i]->load_chunk(c);
+      if (Print_Progress)
+        fprintf(stderr, "\r Searching database %lu chunk %" PRIu32 " of %" PRIu32,
+                i + 1, c + 1, KrakenDatabases[i]->chunks());
 
-    uint32_t call = 0;
-    if (Map_UIDs) {
-      if (Quick_mode) {
-        cerr << "Quick mode not available when mapping UIDs" << endl;
-        exit(1);
-      } else {
-        call = resolve_uids3(hit_counts, Parent_map, Uid_dict,
-                             UID_to_TaxID_map_file.ptr(), UID_to_TaxID_map_file.size());
+#ifdef _OPENMP
+      #pragma omp parallel
+#endif
+      {
+        std::string kmer_buf, hit_buf;
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (uint64_t u = 0; u < n_units; ++u) {
+          if (kmer_blocks[i][c][u].size == 0)
+            continue;
+          read_spill_block(spill_fds[i][c], kmer_blocks[i][c][u], kmer_buf);
+          hit_buf.clear();
+          KmerStore::QueryState status;
+          const spilled_kmer *recs = (const spilled_kmer *) kmer_buf.data();
+          size_t n_recs = kmer_buf.size() / sizeof(spilled_kmer);
+          for (size_t r = 0; r < n_recs; ++r) {
+            const uint32_t *val_ptr = KrakenDatabases[i]->lookup_in_chunk(
+                recs[r].kmer, recs[r].minimizer, status);
+            if (val_ptr) {
+              spilled_hit hit;
+              hit.read_idx = recs[r].read_idx;
+              hit.pos = recs[r].pos;
+              hit.taxon = *val_ptr;
+#ifdef EXACT_COUNTING
+              hit.pair_id = KrakenDatabases[i]->pair_id(recs[r].kmer, val_ptr);
+#endif
+              hit_buf.append((char *) &hit, sizeof(hit));
+            }
+          }
+          if (! hit_buf.empty())
+            hit_blocks[i][c][u] = write_spill_block(hits_fd, &hits_file_size, hit_buf);
+        }
       }
-    } else {
-      if (Quick_mode)
-        call = hits >= Minimum_hit_count ? taxon : 0;
-      else
-        call = resolve_tree(hit_counts, Parent_map);
+      // spilled k-mers of this chunk are not needed anymore
+      close(spill_fds[i][c]);
     }
+  }
+  if (Print_Progress)
+    fprintf(stderr, "\n");
 
-    total_classified += (call != 0);
-    taxon_counts[call].incrementReadCount();
+  // Pass 3: combine hits and classify reads, output is in input order
+  total_sequences = 0;
+  total_bases = 0;
+  total_classified = 0;
+  const uint8_t k = KrakenDatabases[0]->get_k();
+  OutputWriter writer;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    std::string read_buf, hit_buf;
+    vector<DNASequence> work_unit;
+    vector<vector<uint32_t> > taxa;
+    unit_output output;
+    ostringstream kraken_output_ss, classified_output_ss, unclassified_output_ss;
+    TaxonCounts &my_taxon_counts = Thread_taxon_counts[omp_get_thread_num()];
 
-    if (Print_unclassified && !call)
-      print_sequence(Unclassified_output, dna);
+#ifdef _OPENMP
+    #pragma omp for schedule(dynamic)
+#endif
+    for (uint64_t u = 0; u < n_units; ++u) {
+      read_spill_block(reads_fd, read_blocks[u], read_buf);
+      const char *ptr = read_buf.data();
+      uint32_t n_reads;
+      memcpy(&n_reads, ptr, sizeof(n_reads));
+      ptr += sizeof(n_reads);
+      work_unit.resize(n_reads);
+      taxa.resize(n_reads);
+      for (uint32_t j = 0; j < n_reads; ++j) {
+        work_unit[j].id = read_string(ptr);
+        work_unit[j].seq = read_string(ptr);
+        if (spill_full_reads) {
+          work_unit[j].header_line = read_string(ptr);
+          work_unit[j].quals = read_string(ptr);
+        }
+        size_t n_kmers = work_unit[j].seq.size() >= k ? work_unit[j].seq.size() - k + 1 : 0;
+        taxa[j].assign(n_kmers, 0);
+      }
 
-    if (Print_classified && call)
-      print_sequence(Classified_output, dna);
+      // hits of earlier databases take precedence, chunks of a database are disjoint
+      for (size_t i = 0; i < n_dbs; ++i) {
+        for (size_t c = 0; c < hit_blocks[i].size(); ++c) {
+          if (hit_blocks[i][c][u].size == 0)
+            continue;
+          read_spill_block(hits_fd, hit_blocks[i][c][u], hit_buf);
+          const spilled_hit *hits = (const spilled_hit *) hit_buf.data();
+          size_t n_hits = hit_buf.size() / sizeof(spilled_hit);
+          for (size_t h = 0; h < n_hits; ++h) {
+            uint32_t &taxon = taxa[hits[h].read_idx][hits[h].pos];
+            if (! taxon) {
+              taxon = hits[h].taxon;
+#ifdef EXACT_COUNTING
+              DB_hits[i]->add_id(hits[h].pair_id);
+#endif
+            }
+          }
+        }
+      }
 
-    if (!Print_kraken) {
-      goto next_read; // return call;
+      classify_work_unit_hits(work_unit, taxa, output, kraken_output_ss,
+                              classified_output_ss, unclassified_output_ss, my_taxon_counts);
+      writer.push(u, output);
     }
+  }  // end parallel section
+  writer.finish();
+  if (Print_Progress)
+    fprintf(stderr, "\n");
+
+  close(reads_fd);
+  close(hits_fd);
+}
+
+unordered_map<uint32_t, uint32_t> count_hits(const vector<uint32_t> &hit_taxa) {
+  unordered_map<uint32_t, uint32_t> hit_counts;
+  for (size_t i = 0; i < hit_taxa.size(); ++i)
+    ++hit_counts[hit_taxa[i]];
+  return hit_counts;
+}
 
-    if (call) {
-      (*Kraken_output) << "C\t";
+// Resolves the hits of a read in the dense taxonomy arrays; hit taxa that are
+// not in the taxonomy are left to resolve_tree to complain about
+uint32_t resolve_hits(const vector<uint32_t> &hit_taxa) {
+  vector<std::pair<uint32_t, uint32_t> > dense_hits;
+  dense_hits.reserve(hit_taxa.size());
+  uint32_t last_taxon = 0, last_index = 0;
+  for (size_t i = 0; i < hit_taxa.size(); ++i) {
+    // consecutive k-mers mostly have the same taxon
+    if (hit_taxa[i] != last_taxon) {
+      last_taxon = hit_taxa[i];
+      last_index = taxdb.getDenseIndex(last_taxon);
+      if (last_index == 0)
+        return resolve_tree(count_hits(hit_taxa), Parent_map);
     }
-    else {
-      if (Only_classified_kraken_output) {
-        goto next_read; // return false;
+    dense_hits.push_back(std::make_pair(last_index, 1));
+  }
+  std::sort(dense_hits.begin(), dense_hits.end());
+  size_t n = 0;
+  for (size_t i = 0; i < dense_hits.size(); ++i) {
+    if (n > 0 && dense_hits[n - 1].first == dense_hits[i].first)
+      ++dense_hits[n - 1].second;
+    else
+      dense_hits[n++] = dense_hits[i];
+  }
+  dense_hits.resize(n);
+  return taxdb.resolveDenseTree(dense_hits);
+}
+
+// Classify a read given the taxa of all its k-mers (0 for ambiguous k-mers)
+// and print it to the given streams; used once the hits from all database chunks are combined
+bool classify_sequence_hits(DNASequence &dna, vector<uint32_t> &taxa, ostringstream &koss,
+                            ostringstream &coss, ostringstream &uoss,
+                            TaxonCounts &my_taxon_counts) {
+  vector<uint32_t> hit_taxa;
+  vector<char> ambig_list;
+  uint32_t hits = 0;
+
+  for (uint32_t i = 0; i < taxa.size(); ++i)
+  {
+    if (taxa[i])
+    {
+      hit_taxa.push_back(taxa[i]);
+      if (Quick_mode && ++hits >= Minimum_hit_count)
+        break;
+    }
+  }
+
+  uint64_t *kmer_ptr;
+  uint32_t taxon = 0;
+  if (dna.seq.size() >= KrakenDatabases[0]->get_k()) {
+    KmerScanner scanner(dna.seq);
+    uint32_t taxa_idx = 0;
+    while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+      if (scanner.ambig_kmer()) {
+        ambig_list.push_back(1);
+      } else {
+        ambig_list.push_back(0);
+        uint64_t cannonical_kmer = KrakenDatabases[0]->canonical_representation(*kmer_ptr);
+        taxon = taxa[taxa_idx];
+        my_taxon_counts.add_kmer(taxon, cannonical_kmer);
       }
-      (*Kraken_output) << "U\t";
+      ++taxa_idx;
     }
-    (*Kraken_output) << dna.id << '\t' << call << '\t' << dna.seq.size() << '\t';
+  }
+  my_taxon_counts.end_read();
 
+  uint32_t call = 0;
+  if (Map_UIDs) {
     if (Quick_mode) {
-      (*Kraken_output) << "Q:" << hits;
-    }
-    else {
-      if (taxa.empty())
-        (*Kraken_output) << "0:0";
-      else
-        (*Kraken_output) << hitlist_string(taxa, ambig_list);
+      cerr << "Quick mode not available when mapping UIDs" << endl;
+      exit(1);
+    } else {
+      call = resolve_uids3(count_hits(hit_taxa), Parent_map, Uid_dict,
+                           UID_to_TaxID_map_file.ptr(), UID_to_TaxID_map_file.size());
     }
+  } else {
+    if (Quick_mode)
+      call = hits >= Minimum_hit_count ? taxon : 0;
+    else
+      call = resolve_hits(hit_taxa);
+  }
 
-    if (Print_sequence)
-      (*Kraken_output) << "\t" << dna.seq;
+  my_taxon_counts[call].incrementReadCount();
+
+  if (Print_unclassified && !call)
+    print_sequence(&uoss, dna);
+
+  if (Print_classified && call)
+    print_sequence(&coss, dna);
+
+  if (!Print_kraken)
+    return call;
 
-    (*Kraken_output) << "\n";
-    // return call;
-next_read:
-    ++total_sequences;
-    fprintf(stderr, "\r Processed %llu sequences (%.2f%% classified)",
-            total_sequences, total_classified * 100.0 / total_sequences);
-    (void)1;
+  if (call) {
+    koss << "C\t";
+  }
+  else {
+    if (Only_classified_kraken_output)
+      return false;
+    koss << "U\t";
+  }
+  koss << dna.id << '\t' << call << '\t' << dna.seq.size() << '\t';
+
+  if (Quick_mode) {
+    koss << "Q:" << hits;
+  }
+  else {
+    if (taxa.empty())
+      koss << "0:0";
+    else
+      koss << hitlist_string(taxa, ambig_list);
   }
 
-  fclose(fp_taxa_summary);
-  unlink(taxa_summary_filename.c_str());
+  if (Print_sequence)
+    koss << "\t" << dna.seq;
 
-  delete reader;
+  koss << "\n";
+  return call;
 }
 
-
 inline void print_sequence(ostream* oss_ptr, const DNASequence& dna) {
       if (Fastq_input) {
         (*oss_ptr) << "@" << dna.header_line << endl
@@ -894,12 +1581,88 @@ string hitlist_string_depr(const vector<uint32_t> &taxa)
 }
 */
 
-bool classify_sequence(DNASequence &dna, ostringstream &koss,
+// Collects the canonical unambiguous k-mers of all reads in the work unit and
+// looks them up in the databases in batches; kmer_vals holds the value ptr
+// of the first database containing each k-mer, or NULL.
+// The k-mers of read j start at read_offsets[j].
+void query_work_unit(vector<DNASequence> &work_unit, vector<size_t> &read_offsets,
+                     vector<uint64_t> &kmers, vector<uint64_t> &bin_keys,
+                     vector<const uint32_t*> &kmer_vals) {
+  uint64_t *kmer_ptr;
+  read_offsets.clear();
+  kmers.clear();
+  bin_keys.clear();
+  for (size_t j = 0; j < work_unit.size(); j++) {
+    read_offsets.push_back(kmers.size());
+    if (work_unit[j].seq.size() < KrakenDatabases[0]->get_k())
+      continue;
+    KmerScanner scanner(work_unit[j].seq);
+    if (Minimizer_len)
+      scanner.track_minimizers(Minimizer_len, Minimizer_xor_mask);
+    while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+      if (scanner.ambig_kmer())
+        continue;
+      kmers.push_back(KrakenDatabases[0]->canonical_representation(*kmer_ptr));
+      if (Minimizer_len)
+        bin_keys.push_back(scanner.minimizer());
+    }
+  }
+
+  kmer_vals.assign(kmers.size(), NULL);
+  if (! Minimizer_len && ! Prefilters[0]) {
+    bin_keys.resize(kmers.size());
+    for (size_t i = 0; i < kmers.size(); i++)
+      bin_keys[i] = KrakenDatabases[0]->bin_key(kmers[i]);
+  }
+  size_t first_db = 0;
+  if (! Prefilters[0]) {
+    KrakenDatabases[0]->lookup_batch(kmers.data(), bin_keys.data(), kmers.size(), kmer_vals.data());
+#ifdef EXACT_COUNTING
+    for (size_t j = 0; j < kmers.size(); j++) {
+      if (kmer_vals[j])
+        DB_hits[0]->add(kmers[j], kmer_vals[j]);
+    }
+#endif
+    first_db = 1;
+  }
+
+  // k-mers not found so far are searched in the next database, unless its
+  // Bloom filter rules them out
+  for (size_t i = first_db; i < KrakenDatabases.size(); ++i) {
+    vector<size_t> missing;
+    for (size_t j = 0; j < kmers.size(); j++) {
+      if (Prefilters[i] && j + FILTER_PREFETCH_DIST < kmers.size())
+        Prefilters[i]->prefetch(kmers[j + FILTER_PREFETCH_DIST]);
+      if (kmer_vals[j] == NULL && (! Prefilters[i] || Prefilters[i]->contains(kmers[j])))
+        missing.push_back(j);
+    }
+    if (missing.empty())
+      continue;
+    vector<uint64_t> db_kmers(missing.size()), db_bin_keys(missing.size());
+    vector<const uint32_t*> db_vals(missing.size());
+    for (size_t j = 0; j < missing.size(); j++) {
+      db_kmers[j] = kmers[missing[j]];
+      db_bin_keys[j] = Minimizer_len ? bin_keys[missing[j]] : KrakenDatabases[i]->bin_key(db_kmers[j]);
+    }
+    KrakenDatabases[i]->lookup_batch(db_kmers.data(), db_bin_keys.data(), missing.size(), db_vals.data());
+    for (size_t j = 0; j < missing.size(); j++) {
+      kmer_vals[missing[j]] = db_vals[j];
+#ifdef EXACT_COUNTING
+      if (db_vals[j])
+        DB_hits[i]->add(db_kmers[j], db_vals[j]);
+#endif
+    }
+  }
+}
+
+// kmer_vals contains the results of query_work_unit for the read, or NULL if
+// the k-mers should be looked up one at a time
+bool classify_sequence(DNASequence &dna, const uint32_t **kmer_vals, ostringstream &koss,
                        ostringstream &coss, ostringstream &uoss,
-                       unordered_map<uint32_t, READCOUNTS>& my_taxon_counts) {
+                       TaxonCounts &my_taxon_counts) {
   vector<uint32_t> taxa;
   vector<char> ambig_list;
-  unordered_map<uint32_t, uint32_t> hit_counts;
+  vector<uint32_t> hit_taxa;
   uint64_t *kmer_ptr;
   uint32_t taxon = 0;
   uint32_t hits = 0;  // only maintained if in quick mode
@@ -908,13 +1671,15 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
   //uint32_t last_taxon;
   //uint32_t last_counter;
 
-  vector<db_status> db_statuses(KrakenDatabases.size());
+  vector<KmerStore::QueryState> db_statuses(KrakenDatabases.size());
 
   if (dna.seq.size() >= KrakenDatabases[0]->get_k()) {
     size_t n_kmers = dna.seq.size()-KrakenDatabases[0]->get_k()+1;
     taxa.reserve(n_kmers);
     ambig_list.reserve(n_kmers);
     KmerScanner scanner(dna.seq);
+    if (Minimizer_len)
+      scanner.track_minimizers(Minimizer_len, Minimizer_xor_mask);
     while ((kmer_ptr = scanner.next_kmer()) != NULL) {
       taxon = 0;
       if (scanner.ambig_kmer()) {
@@ -924,22 +1689,32 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
       else {
         uint64_t cannonical_kmer = KrakenDatabases[0]->canonical_representation(*kmer_ptr);
         ambig_list.push_back(0);
+        if (kmer_vals != NULL) {
+          const uint32_t *val_ptr = *kmer_vals++;
+          if (val_ptr)
+            taxon = *val_ptr;
+        }
         // go through multiple databases to map k-mer
-        for (size_t i=0; i<KrakenDatabases.size(); ++i) {
-          uint32_t* val_ptr = KrakenDatabases[i]->kmer_query(
-            cannonical_kmer, &db_statuses[i].current_bin_key,
-            &db_statuses[i].current_min_pos, &db_statuses[i].current_max_pos);
+        else for (size_t i=0; i<KrakenDatabases.size(); ++i) {
+          if (Prefilters[i] && ! Prefilters[i]->contains(cannonical_kmer))
+            continue;
+          uint64_t minimizer = Minimizer_len ? scanner.minimizer()
+                                             : KrakenDatabases[i]->bin_key(cannonical_kmer);
+          const uint32_t *val_ptr = KrakenDatabases[i]->lookup(cannonical_kmer, minimizer, db_statuses[i]);
           if (val_ptr) {
             taxon = *val_ptr;
+#ifdef EXACT_COUNTING
+            DB_hits[i]->add(cannonical_kmer, val_ptr);
+#endif
             break;
           }
         }
 
         // cerr << "taxon for " << *kmer_ptr << " is " << taxon << endl;
-        my_taxon_counts[taxon].add_kmer(cannonical_kmer);
+        my_taxon_counts.add_kmer(taxon, cannonical_kmer);
 
         if (taxon) {
-          hit_counts[taxon]++;
+          hit_taxa.push_back(taxon);
           if (Quick_mode && ++hits >= Minimum_hit_count)
             break;
         }
@@ -948,6 +1723,7 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
       //append_hitlist_string(hitlist_string, last_taxon, last_counter, taxon);
     }
   }
+  my_taxon_counts.end_read();
 
   uint32_t call = 0;
   if (Map_UIDs) {
@@ -955,14 +1731,14 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
       cerr << "Quick mode not available when mapping UIDs" << endl;
       exit(1);
     } else {
-      call = resolve_uids3(hit_counts, Parent_map, Uid_dict,
+      call = resolve_uids3(count_hits(hit_taxa), Parent_map, Uid_dict,
         UID_to_TaxID_map_file.ptr(), UID_to_TaxID_map_file.size());
     }
   } else {
     if (Quick_mode)
       call = hits >= Minimum_hit_count ? taxon : 0;
     else
-      call = resolve_tree(hit_counts, Parent_map);
+      call = resolve_hits(hit_taxa);
   }
 
   my_taxon_counts[call].incrementReadCount();
@@ -1011,48 +1787,51 @@ bool classify_sequence(DNASequence &dna, ostringstream &koss,
   return call;
 }
 
-void classify_sequence_with_db_chunk(std::pair<DNASequence, uint32_t> & seq, std::fstream & fp, const uint32_t db_chunk_id, const uint32_t db_id) {
+// known_taxa are the taxa of the k-mers found in earlier passes, or NULL;
+// these k-mers are not looked up again
+void classify_sequence_with_db_chunk(DNASequence &dna, std::string &taxa_buf, const uint32_t db_chunk_id, const uint32_t db_id,
+                                     const uint32_t *known_taxa) {
   vector<uint32_t> taxa;
   uint64_t *kmer_ptr;
   uint32_t taxon;
 
-  auto & dna = seq.first;
-  const uint32_t & seq_idx = seq.second;
-
-  vector<db_status> db_statuses(KrakenDatabases.size());
+  vector<KmerStore::QueryState> db_statuses(KrakenDatabases.size());
 
   if (dna.seq.size() >= KrakenDatabases[0]->get_k()) {
     size_t n_kmers = dna.seq.size()-KrakenDatabases[0]->get_k()+1;
     taxa.reserve(n_kmers);
     KmerScanner scanner(dna.seq);
+    if (Minimizer_len)
+      scanner.track_minimizers(Minimizer_len, Minimizer_xor_mask);
     while ((kmer_ptr = scanner.next_kmer()) != NULL) {
       taxon = 0;
-      if (!scanner.ambig_kmer()) {
+      if (!scanner.ambig_kmer() && !(known_taxa && known_taxa[taxa.size()])) {
         uint64_t cannonical_kmer = KrakenDatabases[db_id]->canonical_representation(*kmer_ptr);
-        const uint64_t minimizer = KrakenDatabases[db_id]->bin_key(cannonical_kmer); // TODO: inefficient because minimizer will also be computed in kmer_query()
+        if (Prefilters[db_id] && ! Prefilters[db_id]->contains(cannonical_kmer)) {
+          taxa.push_back(taxon);
+          continue;
+        }
+        const uint64_t minimizer = Minimizer_len ? scanner.minimizer()
+                                                 : KrakenDatabases[db_id]->bin_key(cannonical_kmer);
 
         if (KrakenDatabases[db_id]->is_minimizer_in_chunk(minimizer, db_chunk_id)) {
-          uint32_t* val_ptr = KrakenDatabases[db_id]->kmer_query_with_db_chunks(
-                  cannonical_kmer, &db_statuses[db_id].current_bin_key,
-                  &db_statuses[db_id].current_min_pos, &db_statuses[db_id].current_max_pos);
-          if (val_ptr)
+          const uint32_t *val_ptr = KrakenDatabases[db_id]->lookup_in_chunk(
+                  cannonical_kmer, minimizer, db_statuses[db_id]);
+          if (val_ptr) {
             taxon = *val_ptr;
+#ifdef EXACT_COUNTING
+            DB_hits[db_id]->add(cannonical_kmer, val_ptr);
+#endif
+          }
         }
       }
       taxa.push_back(taxon);
     }
   }
 
-  try {
-    const uint32_t taxa_size = taxa.size();
-    fp.write((char*) &seq_idx, 1 * sizeof(uint32_t)); // seq_idx
-    fp.write((char*) &taxa_size, 1 * sizeof(uint32_t)); // number of elements
-    fp.write((char*) &taxa[0], taxa_size * sizeof(uint32_t)); // elements
-  }
-  catch (const std::fstream::failure& e) {
-    printf("ERROR: Could not write to temporary file: %s\n", e.what());
-    exit(1);
-  }
+  const uint32_t taxa_size = taxa.size();
+  taxa_buf.append((char*) &taxa_size, sizeof(uint32_t)); // number of elements
+  taxa_buf.append((char*) taxa.data(), taxa_size * sizeof(uint32_t)); // elements
 }
 
 set<uint32_t> get_ancestry(uint32_t taxon) {
@@ -1071,7 +1850,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "d:i:t:u:n:m:o:qcC:U:Ma:r:sI:p:x:")) != -1) {
+  while ((opt = getopt(argc, argv, "d:i:b:t:u:n:m:o:qcC:U:MHNa:r:sI:p:x:SPLK")) != -1) {
     switch (opt) {
       case 'd' :
         DB_filenames.push_back(optarg);
@@ -1079,6 +1858,9 @@ void parse_command_line(int argc, char **argv) {
       case 'i' :
         Index_filenames.push_back(optarg);
         break;
+      case 'b' :
+        Filter_filenames.push_back(optarg);
+        break;
       case 't' :
         sig = atoll(optarg);
         if (sig <= 0)
@@ -1134,10 +1916,31 @@ void parse_command_line(int argc, char **argv) {
       case 'M' :
         Populate_memory = true;
         break;
+      case 'H' :
+        Populate_memory = true;
+        Use_huge_pages = true;
+        break;
+      case 'N' :
+        Populate_memory = true;
+        Numa_interleave = true;
+        break;
       case 'x' :
         Populate_memory = true;
         Populate_memory_size = parse_human_readable_size(optarg); // strtoull(optarg, NULL, 0);
         break;
+      case 'S' :
+        Spill_kmers = true;
+        break;
+      case 'P' :
+        Paired_input = true;
+        break;
+      case 'L' :
+        Paired_input = true;
+        Interleaved_input = true;
+        break;
+      case 'K' :
+        Check_mate_names = true;
+        break;
       case 'I' :
         UID_to_TaxID_map_filename = optarg;
         Map_UIDs = true;
@@ -1152,13 +1955,11 @@ void parse_command_line(int argc, char **argv) {
     cerr << "Missing mandatory option -d" << endl;
     usage();
   }
-  if (Index_filenames.empty()) {
-    cerr << "Missing mandatory option -i" << endl;
-    usage();
-  }
   if (optind == argc && !Populate_memory) {
     cerr << "No sequence data files specified" << endl;
   }
+  if (Paired_input && ! Interleaved_input && (argc - optind) % 2)
+    errx(EX_USAGE, "-P requires pairs of mate files");
 }
 
 void usage(int exit_code) {
@@ -1166,7 +1967,9 @@ void usage(int exit_code) {
        << endl
        << "Options: (*mandatory)" << endl
        << "* -d filename      Kraken DB filename" << endl
-       << "* -i filename      Kraken DB index filename" << endl
+       << "* -i filename      Kraken DB index filename (not needed for compact or hash table DBs)" << endl
+       << "  -b filename      Bloom filter of the k-mers of the DB (made by db_bloom), given" << endl
+       << "                   in order for each -d, or - for none" << endl
        << "  -o filename      Output file for Kraken output" << endl
        << "  -r filename      Output file for Kraken report output" << endl
        << "  -a filename      TaxDB" << endl
@@ -1180,7 +1983,14 @@ void usage(int exit_code) {
        << "  -U filename      Print unclassified sequences" << endl
        << "  -c               Only include classified reads in output" << endl
        << "  -M               Preload database files" << endl
+       << "  -H               Preload database files into huge pages (implies -M)" << endl
+       << "  -N               Preload database files interleaved across NUMA nodes (implies -M)" << endl
        << "  -x size          Preload database files using x amount of RAM (e.g. 10G)" << endl
+       << "  -S               With -x, parse input only once and spill k-mers to temporary" << endl
+       << "                   files (needs 24 bytes of disk space per k-mer)" << endl
+       << "  -P               Input files are pairs of mate files (paired-end reads)" << endl
+       << "  -L               Input files have mates interleaved (implies -P)" << endl
+       << "  -K               With -P, check that mates have the same names" << endl
        << "  -s               Print read sequence in Kraken output" << endl
        << "  -h               Print this message" << endl
        << endl
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "compactdb.hpp"
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+namespace kraken {
+
+static const char COMPACT_DB_MAGIC[] = "KRAKEF01";
+static const size_t COMPACT_DB_HEADER_WORDS = 8;
+
+static inline uint64_t low_mask(uint64_t w) {
+  return w >= 64 ? ~0ull : (1ull << w) - 1;
+}
+
+// w-bit field i of a packed array (padded by one word)
+static inline uint64_t get_bits(const uint64_t *a, uint64_t i, uint64_t w) {
+  if (w == 0)
+    return 0;
+  uint64_t bit = i * w;
+  uint64_t word = bit / 64, off = bit % 64;
+  uint64_t v = a[word] >> off;
+  if (off + w > 64)
+    v |= a[word + 1] << (64 - off);
+  return v & low_mask(w);
+}
+
+static inline void set_bits(uint64_t *a, uint64_t i, uint64_t w, uint64_t v) {
+  if (w == 0)
+    return;
+  uint64_t bit = i * w;
+  uint64_t word = bit / 64, off = bit % 64;
+  a[word] |= v << off;
+  if (off + w > 64)
+    a[word + 1] |= v >> (64 - off);
+}
+
+// position of the r-th set bit of word
+static inline uint64_t select_in_word(uint64_t word, uint64_t r) {
+  for (; r; r--)
+    word &= word - 1;
+  return __builtin_ctzll(word);
+}
+
+// words of a packed array of n w-bit fields, plus one for get_bits()
+static inline uint64_t packed_words(uint64_t n, uint64_t w) {
+  return (n * w + 63) / 64 + 1;
+}
+
+static inline uint64_t padded_words(uint64_t bytes) {
+  return (bytes + 7) / 8;
+}
+
+CompactDB::CompactDB() {
+  fptr = NULL;
+  k = 0;
+  key_ct = low_bits = high_bits = val_bits = taxid_ct = high_len = 0;
+  taxids = NULL;
+  zero_samples = one_samples = high = lows = val_idxs = NULL;
+  _filesize = 0;
+}
+
+CompactDB::CompactDB(char *ptr) {
+  fptr = ptr;
+  if (! is_compact_db(ptr))
+    errx(EX_DATAERR, "not a compact k-mer database");
+  const uint64_t *header = (const uint64_t *) ptr;
+  k = header[1];
+  key_ct = header[2];
+  low_bits = header[3];
+  high_bits = header[4];
+  val_bits = header[5];
+  taxid_ct = header[6];
+  high_len = header[7];
+
+  const uint64_t *p = header + COMPACT_DB_HEADER_WORDS;
+  taxids = (const uint32_t *) p;
+  p += padded_words(taxid_ct * sizeof(uint32_t));
+  zero_samples = p;
+  p += ((1ull << high_bits) + SELECT_SAMPLE - 1) / SELECT_SAMPLE;
+  one_samples = p;
+  p += (key_ct + SELECT_SAMPLE - 1) / SELECT_SAMPLE;
+  high = p;
+  p += packed_words(high_len, 1);
+  lows = p;
+  p += packed_words(key_ct, low_bits);
+  val_idxs = p;
+  p += packed_words(key_ct, val_bits);
+  _filesize = (char *) p - ptr;
+}
+
+bool CompactDB::is_compact_db(const char *ptr) {
+  return strncmp(COMPACT_DB_MAGIC, ptr, 8) == 0;
+}
+
+uint64_t CompactDB::get_key_ct() { return key_ct; }
+uint64_t CompactDB::get_taxid_ct() { return taxid_ct; }
+size_t CompactDB::filesize() const { return _filesize; }
+
+uint64_t CompactDB::select0(uint64_t r) {
+  uint64_t pos = zero_samples[r / SELECT_SAMPLE];
+  uint64_t left = r % SELECT_SAMPLE;
+  uint64_t w = pos / 64;
+  uint64_t word = ~high[w] & (~0ull << (pos % 64));
+  uint64_t c;
+  while (left >= (c = __builtin_popcountll(word))) {
+    left -= c;
+    word = ~high[++w];
+  }
+  return w * 64 + select_in_word(word, left);
+}
+
+uint64_t CompactDB::select1(uint64_t r) {
+  uint64_t pos = one_samples[r / SELECT_SAMPLE];
+  uint64_t left = r % SELECT_SAMPLE;
+  uint64_t w = pos / 64;
+  uint64_t word = high[w] & (~0ull << (pos % 64));
+  uint64_t c;
+  while (left >= (c = __builtin_popcountll(word))) {
+    left -= c;
+    word = high[++w];
+  }
+  return w * 64 + select_in_word(word, left);
+}
+
+uint64_t CompactDB::get_key(uint64_t pos) {
+  uint64_t h = select1(pos) - pos;
+  return (h << low_bits) | get_bits(lows, pos, low_bits);
+}
+
+const uint32_t *CompactDB::get_value_ptr(uint64_t pos) {
+  return taxids + get_bits(val_idxs, pos, val_bits);
+}
+
+uint64_t CompactDB::find(uint64_t kmer) {
+  uint64_t h = kmer >> low_bits;
+  if (h >> high_bits)
+    return key_ct;
+  // the k-mers w/ high bits h are the ones following the h-th zero
+  uint64_t pos = h ? select0(h - 1) + 1 : 0;
+  uint64_t i = pos - h;
+  uint64_t low = kmer & low_mask(low_bits);
+  // the bit vector ends w/ a zero, so this stops before high_len
+  while ((high[pos / 64] >> (pos % 64)) & 1) {
+    uint64_t l = get_bits(lows, i, low_bits);
+    if (l >= low)
+      return l == low ? i : key_ct;
+    ++pos;
+    ++i;
+  }
+  return key_ct;
+}
+
+const uint32_t *CompactDB::kmer_query(uint64_t kmer) {
+  uint64_t pos = find(kmer);
+  return pos < key_ct ? get_value_ptr(pos) : NULL;
+}
+
+const char *CompactDB::engine_name() { return "compact"; }
+uint8_t CompactDB::bin_key_nt() { return 0; }
+uint64_t CompactDB::bin_key_xor_mask() { return 0; }
+uint64_t CompactDB::bin_key(uint64_t kmer) { (void) kmer; return 0; }
+
+const uint32_t *CompactDB::lookup(uint64_t kmer, uint64_t b_key, QueryState &state) {
+  (void) b_key;
+  (void) state;
+  return kmer_query(kmer);
+}
+
+void CompactDB::lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                             size_t n, const uint32_t **results) {
+  (void) b_keys;
+  for (size_t i = 0; i < n; i++)
+    results[i] = kmer_query(kmers[i]);
+}
+
+uint32_t CompactDB::get_value(uint64_t pos) {
+  return *get_value_ptr(pos);
+}
+
+// Values only point into the taxid table, so the k-mer is searched again
+uint64_t CompactDB::pair_id(uint64_t kmer, const uint32_t *val_ptr) {
+  (void) val_ptr;
+  return find(kmer);
+}
+
+void CompactDB::set_value(uint64_t pos, uint32_t val) {
+  (void) pos;
+  (void) val;
+  errx(EX_SOFTWARE, "compact database is read-only");
+}
+
+struct __attribute__((packed)) compact_pair {
+  uint64_t key;
+  uint32_t val;
+  bool operator<(const compact_pair &o) const { return key < o.key; }
+};
+
+// Split [0, n) evenly among T threads
+static inline void thread_range(uint64_t n, int T, int t, uint64_t &first, uint64_t &last) {
+  first = n * t / T;
+  last = n * (t + 1) / T;
+}
+
+// Collect the pairs of db sorted by key, the DB itself is sorted by bin.
+// Pairs are bucketed by their top bits and the buckets sorted in parallel.
+static void sorted_pairs(KrakenDB &db, vector<compact_pair> &pairs) {
+  uint64_t key_ct = db.get_key_ct();
+  uint64_t key_bits = db.get_key_bits();
+  const int bucket_bits = key_bits < 8 ? key_bits : 8;
+  const uint64_t n_buckets = 1ull << bucket_bits;
+  const uint64_t shift = key_bits - bucket_bits;
+  int T = 1;
+  #ifdef _OPENMP
+  T = omp_get_max_threads();
+  #endif
+
+  // per-thread bucket counts, turned into per-thread scatter cursors
+  vector<uint64_t> cursors(n_buckets * T, 0);
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(T)
+#endif
+  {
+    int t = 0;
+    #ifdef _OPENMP
+    t = omp_get_thread_num();
+    #endif
+    uint64_t first, last;
+    thread_range(key_ct, T, t, first, last);
+    uint64_t *counts = &cursors[n_buckets * t];
+    for (uint64_t i = first; i < last; i++)
+      counts[db.get_key(i) >> shift]++;
+  }
+  vector<uint64_t> bucket_starts(n_buckets + 1, 0);
+  uint64_t sum = 0;
+  for (uint64_t b = 0; b < n_buckets; b++) {
+    bucket_starts[b] = sum;
+    for (int t = 0; t < T; t++) {
+      uint64_t c = cursors[n_buckets * t + b];
+      cursors[n_buckets * t + b] = sum;
+      sum += c;
+    }
+  }
+  bucket_starts[n_buckets] = sum;
+
+  pairs.resize(key_ct);
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(T)
+#endif
+  {
+    int t = 0;
+    #ifdef _OPENMP
+    t = omp_get_thread_num();
+    #endif
+    uint64_t first, last;
+    thread_range(key_ct, T, t, first, last);
+    uint64_t *cursor = &cursors[n_buckets * t];
+    for (uint64_t i = first; i < last; i++) {
+      compact_pair p;
+      p.key = db.get_key(i);
+      p.val = *db.get_value_ptr(i);
+      pairs[cursor[p.key >> shift]++] = p;
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic,1) num_threads(T)
+#endif
+  for (uint64_t b = 0; b < n_buckets; b++)
+    std::sort(pairs.begin() + bucket_starts[b], pairs.begin() + bucket_starts[b+1]);
+}
+
+static void write_words(std::ofstream &out, const void *data, uint64_t bytes) {
+  static const char zeros[8] = {0};
+  out.write((const char *) data, bytes);
+  if (bytes % 8)
+    out.write(zeros, 8 - bytes % 8);
+}
+
+void CompactDB::write(string filename, KrakenDB &db) {
+  vector<compact_pair> pairs;
+  sorted_pairs(db, pairs);
+  uint64_t key_ct = pairs.size();
+  uint64_t key_bits = db.get_key_bits();
+
+  // taxid table, values are stored as indices into it
+  vector<uint32_t> taxids;
+  taxids.reserve(key_ct);
+  for (uint64_t i = 0; i < key_ct; i++)
+    taxids.push_back(pairs[i].val);
+  std::sort(taxids.begin(), taxids.end());
+  taxids.erase(std::unique(taxids.begin(), taxids.end()), taxids.end());
+  taxids.shrink_to_fit();
+  uint64_t val_bits = 0;
+  while ((1ull << val_bits) < taxids.size())
+    val_bits++;
+
+  // about one k-mer per bucket of the high bits is the optimal split
+  uint64_t high_bits = 1;
+  while (high_bits < key_bits && (2ull << high_bits) <= key_ct)
+    high_bits++;
+  uint64_t low_bits = key_bits - high_bits;
+  uint64_t high_len = key_ct + (1ull << high_bits);
+
+  vector<uint64_t> high(packed_words(high_len, 1), 0);
+  vector<uint64_t> lows(packed_words(key_ct, low_bits), 0);
+  vector<uint64_t> val_idxs(packed_words(key_ct, val_bits), 0);
+  // fields of 64 consecutive k-mers start at a word boundary
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (uint64_t j = 0; j < key_ct; j += 64) {
+    uint64_t end = std::min(j + 64, key_ct);
+    for (uint64_t i = j; i < end; i++) {
+      set_bits(lows.data(), i, low_bits, pairs[i].key & low_mask(low_bits));
+      uint64_t v = std::lower_bound(taxids.begin(), taxids.end(), pairs[i].val) - taxids.begin();
+      set_bits(val_idxs.data(), i, val_bits, v);
+    }
+  }
+  for (uint64_t i = 0; i < key_ct; i++) {
+    uint64_t pos = (pairs[i].key >> low_bits) + i;
+    high[pos / 64] |= 1ull << (pos % 64);
+  }
+  vector<compact_pair>().swap(pairs);
+
+  vector<uint64_t> zero_samples, one_samples;
+  uint64_t zeros = 0, ones = 0;
+  for (uint64_t pos = 0; pos < high_len; pos++) {
+    if ((high[pos / 64] >> (pos % 64)) & 1) {
+      if (ones++ % SELECT_SAMPLE == 0)
+        one_samples.push_back(pos);
+    }
+    else {
+      if (zeros++ % SELECT_SAMPLE == 0)
+        zero_samples.push_back(pos);
+    }
+  }
+
+  std::ofstream out(filename.c_str(), std::ofstream::binary);
+  if (! out)
+    err(EX_CANTCREAT, "unable to open %s", filename.c_str());
+  uint64_t header[COMPACT_DB_HEADER_WORDS];
+  memcpy(header, COMPACT_DB_MAGIC, 8);
+  header[1] = db.get_k();
+  header[2] = key_ct;
+  header[3] = low_bits;
+  header[4] = high_bits;
+  header[5] = val_bits;
+  header[6] = taxids.size();
+  header[7] = high_len;
+  write_words(out, header, sizeof(header));
+  write_words(out, taxids.data(), taxids.size() * sizeof(uint32_t));
+  write_words(out, zero_samples.data(), zero_samples.size() * 8);
+  write_words(out, one_samples.data(), one_samples.size() * 8);
+  write_words(out, high.data(), high.size() * 8);
+  write_words(out, lows.data(), lows.size() * 8);
+  write_words(out, val_idxs.data(), val_idxs.size() * 8);
+  out.close();
+  if (! out)
+    err(EX_IOERR, "error writing %s", filename.c_str());
+}
+
+} // namespace
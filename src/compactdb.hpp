@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMPACTDB_HPP
+#define COMPACTDB_HPP
+
+#include "kraken_headers.hpp"
+#include "kmerstore.hpp"
+#include "krakendb.hpp"
+
+namespace kraken {
+  // Read-only k-mer database in about half the memory of a KrakenDB.
+  //
+  // The canonical k-mers are stored in sorted order as an Elias-Fano
+  // sequence: the low bits of each k-mer in a packed array, the high bits
+  // as unary-coded gaps in a bit vector. Every SELECT_SAMPLE-th zero and one
+  // of the bit vector are sampled, so a lookup jumps to the k-mers sharing
+  // its high bits w/o a separate index. Values are stored as packed indices
+  // into the table of the distinct taxids in the DB.
+  //
+  // File layout (8-byte words, arrays padded to whole words):
+  //   magic, k, key_ct, low_bits, high_bits, val_bits, taxid_ct, high_len,
+  //   taxids[taxid_ct] (uint32), zero samples, one samples, high bit vector,
+  //   low bits, value indices
+  class CompactDB : public KmerStore {
+    public:
+    static const uint64_t SELECT_SAMPLE = 256;
+
+    // Null constructor
+    CompactDB();
+
+    // ptr points to start of mmap'ed DB
+    CompactDB(char *ptr);
+
+    // true if ptr points to a DB in this format
+    static bool is_compact_db(const char *ptr);
+
+    // Write the k-mers and values of a KrakenDB in this format
+    static void write(std::string filename, KrakenDB &db);
+
+    uint64_t get_key_ct();      // how many keys are there?
+    uint64_t get_taxid_ct();    // how many distinct values are there?
+    size_t filesize() const;
+
+    // k-mers are numbered in sorted order
+    uint64_t get_key(uint64_t pos);
+    const uint32_t *get_value_ptr(uint64_t pos);
+
+    // return ptr to value of kmer (canonical), or NULL if not in the DB;
+    // the pointer is into the read-only taxid table
+    const uint32_t *kmer_query(uint64_t kmer);
+
+    // KmerStore interface, bin keys are not used
+    const char *engine_name();
+    uint8_t bin_key_nt();
+    uint64_t bin_key_xor_mask();
+    uint64_t bin_key(uint64_t kmer);
+    const uint32_t *lookup(uint64_t kmer, uint64_t b_key, QueryState &state);
+    void lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                      size_t n, const uint32_t **results);
+    uint32_t get_value(uint64_t pos);
+    void set_value(uint64_t pos, uint32_t val);
+    uint64_t pair_id(uint64_t kmer, const uint32_t *val_ptr);
+
+    private:
+    char *fptr;
+    uint64_t key_ct;
+    uint64_t low_bits;
+    uint64_t high_bits;
+    uint64_t val_bits;
+    uint64_t taxid_ct;
+    uint64_t high_len;
+
+    const uint32_t *taxids;
+    const uint64_t *zero_samples;
+    const uint64_t *one_samples;
+    const uint64_t *high;
+    const uint64_t *lows;
+    const uint64_t *val_idxs;
+    size_t _filesize;
+
+    // position of the r-th (0-based) zero / one in the high bit vector
+    // position of kmer, or key_ct if it is not in the DB
+    uint64_t find(uint64_t kmer);
+    uint64_t select0(uint64_t r);
+    uint64_t select1(uint64_t r);
+  };
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Build the Bloom filter of the k-mers of a database (see bloomfilter.hpp)
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakenutil.hpp"
+#include "kmerstore.hpp"
+#include "bloomfilter.hpp"
+
+using namespace std;
+using namespace kraken;
+
+string DB_filename, Filter_filename;
+double False_positive_rate = 0.01;
+uint64_t Max_filter_size = 0;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  QuickFile db_file(DB_filename);
+  KmerStore *db = KmerStore::open(db_file.ptr(), db_file.size(), NULL);
+  madvise(db_file.ptr(), db_file.size(), MADV_SEQUENTIAL);
+
+  cerr << "db_bloom: Adding " << db->get_key_ct() << " k-mers ..." << endl;
+  BloomFilter::write(Filter_filename, *db, False_positive_rate, Max_filter_size);
+  delete db;
+
+  QuickFile filter_file(Filter_filename);
+  BloomFilter filter(filter_file.ptr());
+  cerr << "db_bloom: Wrote " << filter.get_block_ct() << " blocks w/ "
+       << filter.get_hash_ct() << " hashes per k-mer ("
+       << (double) filter_file.size() * 8 / max(filter.get_key_ct(), (uint64_t) 1)
+       << " bits per k-mer, expected false positive rate " << filter.get_fpr() << "), "
+       << filter_file.size() << " bytes" << endl;
+  return 0;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "d:o:t:e:m:")) != -1) {
+    switch (opt) {
+      case 'd' :
+        DB_filename = optarg;
+        break;
+      case 'o' :
+        Filter_filename = optarg;
+        break;
+      case 'e' :
+        False_positive_rate = atof(optarg);
+        if (False_positive_rate <= 0 || False_positive_rate >= 1)
+          errx(EX_USAGE, "false positive rate must be in (0, 1)");
+        break;
+      case 'm' :
+        Max_filter_size = parse_human_readable_size(optarg);
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        omp_set_num_threads(sig);
+        #endif
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (DB_filename.empty() || Filter_filename.empty())
+    usage();
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_bloom [-t threads] [-e rate] [-m size] <-d db> <-o filter>\n"
+       << "  -e rate  False positive rate (default: 0.01)\n"
+       << "  -m size  Maximum size of the filter (e.g. 500M); if the rate needs more,\n"
+       << "           the filter w/ the lowest rate in that size is made\n"
+       << "  classify -b <filter> skips the DB lookup of k-mers not in the filter.\n";
+  exit(exit_code);
+}
@@ -0,0 +1,107 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Convert a database into the read-only hash table format (see hashdb.hpp)
+
+#include "kraken_headers.hpp"
+#include "quickfile.hpp"
+#include "krakendb.hpp"
+#include "hashdb.hpp"
+
+using namespace std;
+using namespace kraken;
+
+string Input_DB_filename, Output_DB_filename;
+double Max_load = 0.9;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  QuickFile input_db_file(Input_DB_filename);
+  KrakenDB input_db(input_db_file.ptr());
+  if (input_db.get_val_len() != sizeof(uint32_t))
+    errx(EX_DATAERR, "unsupported value length %llu", (unsigned long long) input_db.get_val_len());
+  madvise(input_db_file.ptr(), input_db_file.size(), MADV_SEQUENTIAL);
+
+  cerr << "db_hash: Hashing " << input_db.get_key_ct() << " k-mers ..." << endl;
+  HashDB::write(Output_DB_filename, input_db, Max_load);
+
+  QuickFile output_db_file(Output_DB_filename);
+  HashDB output_db(output_db_file.ptr());
+  cerr << "db_hash: Wrote " << output_db.get_key_ct() << " k-mers w/ "
+       << output_db.get_taxid_ct() << " distinct values into "
+       << output_db.get_bucket_ct() << " buckets (load "
+       << (double) output_db.get_key_ct() / (output_db.get_bucket_ct() * HashDB::SLOTS_PER_BUCKET)
+       << "), " << output_db_file.size() << " bytes" << endl;
+  return 0;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "d:o:t:l:")) != -1) {
+    switch (opt) {
+      case 'd' :
+        Input_DB_filename = optarg;
+        break;
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'l' :
+        Max_load = atof(optarg);
+        if (Max_load <= 0 || Max_load > 1)
+          errx(EX_USAGE, "load factor must be in (0, 1]");
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        omp_set_num_threads(sig);
+        #endif
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Input_DB_filename.empty() || Output_DB_filename.empty())
+    usage();
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: db_hash [-t threads] [-l load] <-d input db> <-o output db>\n"
+       << "  -l load  Maximum fraction of occupied slots (default: 0.9); the number of\n"
+       << "           buckets is a power of two, so the load is between load/2 and load\n"
+       << "  The output is read-only and needs no index.\n";
+  exit(exit_code);
+}
@@ -20,6 +20,8 @@
 #include "kraken_headers.hpp"
 #include "quickfile.hpp"
 #include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include <algorithm>
 
 using namespace std;
 using namespace kraken;
@@ -29,13 +31,19 @@ uint8_t Bin_key_nt = 15;
 int Num_threads = 1;
 bool Zero_vals = false;
 bool Operate_in_RAM = false;
-// Global until I can find a way to pass this to the sorting function
-size_t Key_len = 8;
+bool Blocked_layout = false;
+uint64_t Max_pass_size = 0;  // bytes of pairs sorted per pass, 0 for no limit
+
+// A pair while sorting, w/ the key widened to 64 bits
+struct __attribute__((packed)) sort_pair {
+  uint64_t key;
+  uint32_t val;
+};
 
-static int pair_cmp(const void *a, const void *b);
 static void parse_command_line(int argc, char **argv);
-static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx);
+static void bin_and_sort_data(KrakenDB &kdb, KrakenDBIndex &idx, int output_fd);
 static void usage(int exit_code=EX_USAGE);
+static void write_at(int fd, uint64_t offset, const char *data, uint64_t size);
 
 int main(int argc, char **argv) {
   #ifdef _OPENMP
@@ -46,85 +54,219 @@ int main(int argc, char **argv) {
 
   cerr << "db_sort: Getting database into memory ...";
   QuickFile input_db_file(Input_DB_filename);
-  KrakenDB *input_db = new KrakenDB(input_db_file.ptr());
-  Key_len = input_db->get_key_len();
-  uint64_t val_len = input_db->get_val_len();
-  uint64_t key_ct = input_db->get_key_ct();
-  input_db->make_index(Index_filename, Bin_key_nt);
+  KrakenDB input_db(input_db_file.ptr());
+  if (input_db.is_blocked())
+    errx(EX_DATAERR, "input database already sorted into blocked layout");
+  if (input_db.get_val_len() != sizeof(uint32_t))
+    errx(EX_DATAERR, "unsupported value length %llu", (unsigned long long) input_db.get_val_len());
+  input_db.make_index(Index_filename, Bin_key_nt);
   QuickFile index_file(Index_filename);
   KrakenDBIndex db_index(index_file.ptr());
+  // the pairs are read front to back by each thread
+  madvise(input_db_file.ptr(), input_db_file.size(), MADV_SEQUENTIAL);
 
-  uint64_t skip_len = input_db->header_size();
-  char *header = new char[ skip_len ];
-  memcpy(header, input_db_file.ptr(), skip_len);
-
-  delete input_db;
-  // No longer legit for traversal, but allows access to KDB functions
-  input_db = new KrakenDB(header);
-  input_db_file.close_file();  // Stop using memory-mapped file
+  int output_fd = open(Output_DB_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (output_fd < 0)
+    err(EX_CANTCREAT, "unable to create %s", Output_DB_filename.c_str());
 
   cerr << "db_sort: Sorting ...";
-  char *data = new char[ key_ct * (Key_len + val_len) ];
-  // Populate data w/ pairs from DB and sort bins in parallel
-  bin_and_sort_data(*input_db, data, db_index);
-
-  cerr << "db_sort: Sorting complete - writing database to disk ..." << endl;
-  ofstream output_file(Output_DB_filename.c_str(), std::ofstream::binary);
-  output_file.write(header, skip_len);
-  output_file.write(data, key_ct * (Key_len + val_len));
-  output_file.close();
-  
+  // Scatter pairs into bins and sort bins in parallel, write them as they are done
+  bin_and_sort_data(input_db, db_index, output_fd);
+
+  cerr << "db_sort: Sorting complete - writing database header ..." << endl;
+  string header = Blocked_layout ? input_db.blocked_header()
+                                 : string(input_db_file.ptr(), input_db.header_size());
+  write_at(output_fd, 0, header.data(), header.size());
+  uint64_t output_size = Blocked_layout
+    ? input_db.blocked_vals_offset() + input_db.get_key_ct() * sizeof(uint32_t)
+    : input_db.header_size() + input_db.get_key_ct() * input_db.pair_size();
+  // padding of the blocked layout may be at the end of the key array
+  if (ftruncate(output_fd, output_size) != 0)
+    err(EX_IOERR, "unable to resize %s", Output_DB_filename.c_str());
+  close(output_fd);
+
   return 0;
 }
 
-static void bin_and_sort_data(KrakenDB &kdb, char *data, KrakenDBIndex &idx) {
+static void write_at(int fd, uint64_t offset, const char *data, uint64_t size) {
+  for (uint64_t done = 0; done < size; ) {
+    ssize_t ret = pwrite(fd, data + done, size - done, offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to write to %s", Output_DB_filename.c_str());
+    done += ret;
+  }
+}
+
+// Writes the sorted pairs for positions first..first+n-1 of the database
+static void write_sorted_pairs(KrakenDB &kdb, int fd, uint64_t first, const sort_pair *pairs, uint64_t n) {
+  const uint64_t buf_size = 1 << 20;
+  uint64_t key_len = kdb.get_key_len();
+  uint64_t key_mask = (1ull << kdb.get_key_bits()) - 1;
+  if (Blocked_layout) {
+    vector<uint64_t> key_buf;
+    vector<uint32_t> val_buf;
+    for (uint64_t i = 0; i < n; i += buf_size) {
+      key_buf.clear();
+      val_buf.clear();
+      for (uint64_t j = i; j < n && j < i + buf_size; j++) {
+        key_buf.push_back(pairs[j].key & key_mask);
+        val_buf.push_back(pairs[j].val);
+      }
+      write_at(fd, kdb.blocked_keys_offset() + (first + i) * sizeof(uint64_t),
+               (char *) key_buf.data(), key_buf.size() * sizeof(uint64_t));
+      write_at(fd, kdb.blocked_vals_offset() + (first + i) * sizeof(uint32_t),
+               (char *) val_buf.data(), val_buf.size() * sizeof(uint32_t));
+    }
+  } else {
+    uint64_t pair_size = kdb.pair_size();
+    vector<char> buf;
+    for (uint64_t i = 0; i < n; i += buf_size) {
+      uint64_t m = min(buf_size, n - i);
+      buf.resize(m * pair_size);
+      for (uint64_t j = 0; j < m; j++) {
+        memcpy(&buf[j * pair_size], &pairs[i + j].key, key_len);
+        memcpy(&buf[j * pair_size + key_len], &pairs[i + j].val, sizeof(uint32_t));
+      }
+      write_at(fd, kdb.header_size() + (first + i) * pair_size, buf.data(), buf.size());
+    }
+  }
+}
+
+// Bins are grouped into buckets of consecutive bins. Each thread scatters the
+// pairs of a contiguous part of the input into the buckets, at cursors
+// computed from per-thread bucket histograms, then the buckets are sorted
+// into their bins in parallel. With a maximum pass size, only a range of
+// buckets whose pairs fit into memory is scattered and sorted per pass.
+static void bin_and_sort_data(KrakenDB &kdb, KrakenDBIndex &idx, int output_fd) {
   uint8_t nt = idx.indexed_nt();
   uint64_t *offsets = idx.get_array();
   uint64_t entries = 1ull << (nt * 2);
+  uint64_t key_ct = kdb.get_key_ct();
   uint64_t key_len = kdb.get_key_len();
-  uint64_t val_len = kdb.get_val_len();
-  uint64_t pair_size = key_len + val_len;
-  char pair[pair_size];
-
-  ifstream input_file(Input_DB_filename.c_str(), std::ifstream::binary);
-  input_file.seekg(kdb.header_size(), ios_base::beg);
-
-  // Create a copy of the offsets array for use as insertion positions
-  vector<uint64_t> pos(offsets, offsets + entries);
-  for (uint64_t i = 0; i < kdb.get_key_ct(); i++) {
-    input_file.read(pair, pair_size);
-    uint64_t kmer = 0;
-    memcpy(&kmer, pair, key_len);
-    uint64_t b_key = kdb.bin_key(kmer, nt);
-    char *pair_pos = data + pair_size * pos[b_key]++;
-    // Copy pair into correct bin (but not final position)
-    memcpy(pair_pos, pair, pair_size);
+  uint64_t pair_size = kdb.pair_size();
+  const char *input_pairs = kdb.get_pair_ptr();
+
+  int bucket_shift = 0;
+  while ((entries >> bucket_shift) > (1 << 16))
+    ++bucket_shift;
+  uint64_t n_buckets = entries >> bucket_shift;
+  uint64_t bins_per_bucket = 1ull << bucket_shift;
+  auto bucket_offset = [&](uint64_t bucket) { return offsets[bucket << bucket_shift]; };
+
+  auto read_pair = [&](uint64_t i, sort_pair &pair) {
+    pair.key = 0;
+    memcpy(&pair.key, input_pairs + i * pair_size, key_len);
     if (Zero_vals)
-      memset(pair_pos + key_len, 0, val_len);
-  }
-  input_file.close();
+      pair.val = 0;
+    else
+      memcpy(&pair.val, input_pairs + i * pair_size + key_len, sizeof(uint32_t));
+  };
 
-  // Sort all bins
+  // Histograms of the buckets for the part of the input of each thread
+  int n_threads = 1;
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads();
+#endif
+  vector<uint64_t> thread_first(n_threads + 1);
+  for (int t = 0; t <= n_threads; t++)
+    thread_first[t] = key_ct * t / n_threads;
+  vector<vector<uint64_t> > thread_counts(n_threads, vector<uint64_t>(n_buckets, 0));
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+#endif
+  {
+    int t = 0;
 #ifdef _OPENMP
-  #pragma omp parallel for schedule(dynamic)
+    t = omp_get_thread_num();
 #endif
-  for (uint64_t i = 0; i < entries; i++) {
-    qsort(data + offsets[i] * pair_size,
-          offsets[i+1] - offsets[i], pair_size,
-          pair_cmp);
+    vector<uint64_t> &counts = thread_counts[t];
+    sort_pair pair;
+    for (uint64_t i = thread_first[t]; i < thread_first[t+1]; i++) {
+      read_pair(i, pair);
+      counts[kdb.bin_key(pair.key, nt) >> bucket_shift]++;
+    }
   }
-}
 
-static int pair_cmp(const void *a, const void *b) {
-  uint64_t aval = 0, bval = 0;
-  memcpy(&aval, a, Key_len);
-  memcpy(&bval, b, Key_len);
-  if (aval < bval)
-    return -1;
-  else if (aval == bval)
-    return 0;
-  else
-    return 1;
+  uint64_t max_pass_pairs = Max_pass_size == 0 ? key_ct : max<uint64_t>(Max_pass_size / sizeof(sort_pair), 1);
+  vector<sort_pair> data;
+  vector<vector<uint64_t> > cursors(n_threads, vector<uint64_t>(n_buckets));
+  uint64_t n_passes = 0;
+  for (uint64_t first_bucket = 0; first_bucket < n_buckets; ) {
+    // as many buckets as fit, but at least one
+    uint64_t end_bucket = first_bucket + 1;
+    while (end_bucket < n_buckets &&
+           bucket_offset(end_bucket + 1) - bucket_offset(first_bucket) <= max_pass_pairs)
+      ++end_bucket;
+    uint64_t pass_first = bucket_offset(first_bucket);
+    uint64_t pass_size = bucket_offset(end_bucket) - pass_first;
+    data.resize(pass_size);
+    if (++n_passes > 1 || end_bucket < n_buckets)
+      cerr << "\rdb_sort: Sorting pass " << n_passes << " (" << 100 * end_bucket / n_buckets << "% of bins) ...";
+
+    for (uint64_t b = first_bucket; b < end_bucket; b++) {
+      uint64_t pos = bucket_offset(b) - pass_first;
+      for (int t = 0; t < n_threads; t++) {
+        cursors[t][b] = pos;
+        pos += thread_counts[t][b];
+      }
+    }
+
+    // Scatter pairs of the pass into their buckets
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(n_threads)
+#endif
+    {
+      int t = 0;
+#ifdef _OPENMP
+      t = omp_get_thread_num();
+#endif
+      vector<uint64_t> &cursor = cursors[t];
+      sort_pair pair;
+      for (uint64_t i = thread_first[t]; i < thread_first[t+1]; i++) {
+        read_pair(i, pair);
+        uint64_t bucket = kdb.bin_key(pair.key, nt) >> bucket_shift;
+        if (bucket >= first_bucket && bucket < end_bucket)
+          data[cursor[bucket]++] = pair;
+      }
+    }
+
+    // Counting sort of each bucket into its bins, then sort the bins by key
+#ifdef _OPENMP
+    #pragma omp parallel
+#endif
+    {
+      vector<sort_pair> tmp;
+      vector<uint64_t> bin_cursor(bins_per_bucket);
+#ifdef _OPENMP
+      #pragma omp for schedule(dynamic)
+#endif
+      for (uint64_t b = first_bucket; b < end_bucket; b++) {
+        uint64_t first_bin = b << bucket_shift;
+        uint64_t bucket_first = offsets[first_bin];
+        sort_pair *bucket_data = data.data() + bucket_first - pass_first;
+        uint64_t bucket_size = offsets[first_bin + bins_per_bucket] - bucket_first;
+        if (bucket_size == 0)
+          continue;
+        for (uint64_t j = 0; j < bins_per_bucket; j++)
+          bin_cursor[j] = offsets[first_bin + j] - bucket_first;
+        tmp.assign(bucket_data, bucket_data + bucket_size);
+        for (uint64_t j = 0; j < bucket_size; j++) {
+          uint64_t bin = kdb.bin_key(tmp[j].key, nt) - first_bin;
+          bucket_data[bin_cursor[bin]++] = tmp[j];
+        }
+        for (uint64_t j = 0; j < bins_per_bucket; j++) {
+          sort_pair *bin_data = bucket_data + offsets[first_bin + j] - bucket_first;
+          sort(bin_data, bin_data + (offsets[first_bin + j + 1] - offsets[first_bin + j]),
+               [](const sort_pair &a, const sort_pair &b) { return a.key < b.key; });
+        }
+      }
+    }
+
+    write_sorted_pairs(kdb, output_fd, pass_first, data.data(), pass_size);
+    first_bucket = end_bucket;
+  }
+  if (n_passes > 1)
+    cerr << endl;
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -133,7 +275,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "n:d:o:i:t:zM")) != -1) {
+  while ((opt = getopt(argc, argv, "n:d:o:i:t:zMBx:")) != -1) {
     switch (opt) {
       case 'n' :
         sig = atoll(optarg);
@@ -167,6 +309,12 @@ void parse_command_line(int argc, char **argv) {
       case 'z' :
         Zero_vals = true;
         break;
+      case 'B' :
+        Blocked_layout = true;
+        break;
+      case 'x' :
+        Max_pass_size = parse_human_readable_size(optarg);
+        break;
       default:
         usage();
         break;
@@ -179,6 +327,7 @@ void parse_command_line(int argc, char **argv) {
 }
 
 void usage(int exit_code) {
-  cerr << "Usage: db_sort [-z] [-M] [-t threads] [-n nt] <-d input db> <-o output db> <-i output idx>\n";
+  cerr << "Usage: db_sort [-z] [-M] [-B] [-t threads] [-n nt] [-x size] <-d input db> <-o output db> <-i output idx>\n"
+       << "  -x size  Sort at most size bytes of pairs (e.g. 20G) at a time, in several passes over the input\n";
   exit(exit_code);
 }
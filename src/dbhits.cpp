@@ -0,0 +1,64 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "dbhits.hpp"
+
+using std::unordered_map;
+
+namespace kraken {
+
+DBHits::DBHits(KmerStore &_db) : db(_db) {
+  n_bytes = std::max((db.pair_id_ct() + 63) / 64, (uint64_t) 1) * sizeof(uint64_t);
+  // untouched pages of an anonymous mapping read as zero and take no memory
+  void *ptr = mmap(NULL, n_bytes, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (ptr == MAP_FAILED)
+    err(EX_OSERR, "unable to allocate %llu bytes for the DB hits", (unsigned long long) n_bytes);
+  words = (uint64_t *) ptr;
+}
+
+DBHits::~DBHits() {
+  munmap(words, n_bytes);
+}
+
+unordered_map<uint32_t, uint64_t> DBHits::count_values() {
+  unordered_map<uint32_t, uint64_t> counts;
+  uint64_t n_words = n_bytes / sizeof(uint64_t);
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    unordered_map<uint32_t, uint64_t> my_counts;
+#ifdef _OPENMP
+    #pragma omp for schedule(static, 65536)
+#endif
+    for (uint64_t w = 0; w < n_words; w++) {
+      for (uint64_t word = words[w]; word != 0; word &= word - 1)
+        ++my_counts[db.pair_id_value(w * 64 + __builtin_ctzll(word))];
+    }
+#ifdef _OPENMP
+    #pragma omp critical(count_values)
+#endif
+    for (auto it = my_counts.begin(); it != my_counts.end(); ++it)
+      counts[it->first] += it->second;
+  }
+  return counts;
+}
+
+} // namespace
@@ -0,0 +1,92 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DBHITS_HPP
+#define DBHITS_HPP
+
+#include "kraken_headers.hpp"
+#include "kmerstore.hpp"
+#include "khset.h"
+#include <unordered_map>
+
+namespace kraken {
+  // Exact count of the distinct k-mers found in a database, for
+  // classifyExact. Every pair of the DB has a bit (by its pair id), which
+  // is set when its k-mer is found. All threads share the bitmap, so there
+  // is nothing to merge. It is mapped lazily: only pages w/ hits take
+  // memory, pair_id_ct() / 8 bytes at most.
+  //
+  // A k-mer has only one value, so the distinct k-mers of a taxon found in
+  // the DB are the set bits of the pairs w/ that value; they are counted
+  // once at the end by count_values().
+  class DBHits {
+    public:
+    DBHits(KmerStore &db);
+    ~DBHits();
+
+    // kmer was found w/ value ptr val_ptr by a lookup
+    void add(uint64_t kmer, const uint32_t *val_ptr) {
+      add_id(db.pair_id(kmer, val_ptr));
+    }
+
+    void add_id(uint64_t id) {
+      uint64_t *w = words + id / 64;
+      uint64_t bit = 1ull << (id % 64);
+      if (! (__atomic_load_n(w, __ATOMIC_RELAXED) & bit))
+        __sync_fetch_and_or(w, bit);
+    }
+
+    // number of distinct hits of each value
+    std::unordered_map<uint32_t, uint64_t> count_values();
+
+    private:
+    KmerStore &db;
+    uint64_t *words;
+    size_t n_bytes;
+
+    DBHits(const DBHits &);
+    DBHits &operator=(const DBHits &);
+  };
+
+  // Unique k-mers of a taxon in classifyExact: the number of distinct
+  // k-mers found in the DBs (from DBHits), and the set of the k-mers that
+  // are in none of them
+  class ExactKmerCount {
+    public:
+    ExactKmerCount() : n_hits(0) {}
+    explicit ExactKmerCount(uint64_t _n_hits) : n_hits(_n_hits) {}
+
+    void insert(uint64_t kmer) { misses.insert(kmer); }
+    template <typename It>
+    void insert(It first, It last) { misses.insert(first, last); }
+    size_t size() const { return n_hits + misses.size(); }
+
+    ExactKmerCount &operator+=(const ExactKmerCount &other) {
+      n_hits += other.n_hits;
+      misses += other.misses;
+      return *this;
+    }
+
+    private:
+    uint64_t n_hits;
+    kh::khset64_t misses;
+  };
+}
+
+#endif
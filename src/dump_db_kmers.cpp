@@ -18,7 +18,7 @@
  */
 
 #include "kraken_headers.hpp"
-#include "krakendb.hpp"
+#include "kmerstore.hpp"
 #include "quickfile.hpp"
 #include <iostream>
 #include <fstream>
@@ -40,22 +40,11 @@ int main(int argc, char **argv) {
   db_file.open_file(db_name);
   //db_file.load_file();
   //cerr << "Fully loaded\n";
-  KrakenDB db(db_file.ptr());
+  KmerStore *db = KmerStore::open(db_file.ptr(), db_file.size(), NULL);
+  uint64_t key_ct = db->get_key_ct();      // how many key/value pairs are there?
 
-  char* ptr = db.get_ptr();
-  //char* pair_ptr = db.get_pair_ptr();
-  uint64_t key_len = db.get_key_len();     // how many bytes does each key occupy?
-  //uint64_t val_len = db.get_val_len();     // how many bytes does each value occupy?
-  uint64_t key_ct = db.get_key_ct();      // how many key/value pairs are there?
-  uint64_t pair_sz = db.pair_size();       // how many bytes does each pair occupy?
-
-  if (ptr == NULL) { 
-    std::cerr << "Kraken database pointer is NULL [pair_sz: " << pair_sz << ", key_ct: "<<key_ct<<", key_len: "<< key_len<<"]!" << std::endl;
-    exit(1);
-  }
   for (uint64_t i = 0; i < key_ct; i++) {
-    uint64_t* kmer = (uint64_t *) (ptr + pair_sz * i);
-    cout << *kmer << '\n';
+    cout << db->get_key(i) << '\n';
   }
 }
 
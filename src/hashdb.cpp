@@ -0,0 +1,349 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hashdb.hpp"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+using std::string;
+using std::vector;
+
+namespace kraken {
+
+static const char HASH_DB_MAGIC[] = "KRAKHT01";
+static const size_t HASH_DB_HEADER_WORDS = 8;
+static const uint64_t BUCKET_BYTES = HashDB::SLOTS_PER_BUCKET * sizeof(uint64_t);
+
+// odd multipliers of the k-mer hash
+static const uint64_t HASH_MUL1 = 0xbf58476d1ce4e5b9ULL;
+static const uint64_t HASH_MUL2 = 0x94d049bb133111ebULL;
+
+// How many k-mers ahead of the current one are prefetched in lookup_batch
+static const size_t BATCH_PREFETCH_DIST = 8;
+
+static inline uint64_t low_mask(uint64_t w) {
+  return w >= 64 ? ~0ull : (1ull << w) - 1;
+}
+
+static inline uint64_t padded_words(uint64_t bytes) {
+  return (bytes + 7) / 8;
+}
+
+// multiplicative inverse of an odd number mod 2^64 (Newton's method)
+static uint64_t mul_inverse(uint64_t a) {
+  uint64_t inv = a;
+  for (int i = 0; i < 5; i++)
+    inv *= 2 - a * inv;
+  return inv;
+}
+
+// Words before the buckets, which start at a cache line
+static uint64_t words_before_buckets(uint64_t taxid_ct, uint64_t bucket_bits) {
+  uint64_t n_samples = ((1ull << bucket_bits) + HashDB::OCC_SAMPLE - 1) / HashDB::OCC_SAMPLE + 1;
+  uint64_t words = HASH_DB_HEADER_WORDS + padded_words(taxid_ct * sizeof(uint32_t)) + n_samples;
+  uint64_t line_words = BUCKET_BYTES / 8;
+  return (words + line_words - 1) / line_words * line_words;
+}
+
+// The hash is a bijection on k-mers of key_bits bits: xor-shifts by at
+// least half the bits are their own inverse, odd multipliers are invertible
+static inline uint64_t xorshift(uint64_t x, uint64_t key_bits) {
+  return x ^ (x >> ((key_bits + 1) / 2));
+}
+
+uint64_t HashDB::hash(uint64_t kmer) {
+  uint64_t mask = low_mask(key_bits);
+  uint64_t x = xorshift(kmer, key_bits);
+  x = (x * HASH_MUL1) & mask;
+  x = xorshift(x, key_bits);
+  x = (x * HASH_MUL2) & mask;
+  return xorshift(x, key_bits);
+}
+
+uint64_t HashDB::unhash(uint64_t h) {
+  uint64_t mask = low_mask(key_bits);
+  uint64_t x = xorshift(h, key_bits);
+  x = (x * mul_inverse(HASH_MUL2)) & mask;
+  x = xorshift(x, key_bits);
+  x = (x * mul_inverse(HASH_MUL1)) & mask;
+  return xorshift(x, key_bits);
+}
+
+HashDB::HashDB() {
+  fptr = NULL;
+  key_bits = key_ct = bucket_bits = val_bits = taxid_ct = fp_bits = 0;
+  taxids = NULL;
+  occ_samples = buckets = NULL;
+  _filesize = 0;
+}
+
+HashDB::HashDB(char *ptr) {
+  fptr = ptr;
+  if (! is_hash_db(ptr))
+    errx(EX_DATAERR, "not a hash table k-mer database");
+  const uint64_t *header = (const uint64_t *) ptr;
+  k = header[1];
+  key_ct = header[2];
+  bucket_bits = header[3];
+  val_bits = header[4];
+  taxid_ct = header[5];
+  key_bits = 2 * k;
+  fp_bits = key_bits - bucket_bits;
+
+  taxids = (const uint32_t *) (header + HASH_DB_HEADER_WORDS);
+  occ_samples = header + HASH_DB_HEADER_WORDS + padded_words(taxid_ct * sizeof(uint32_t));
+  buckets = header + words_before_buckets(taxid_ct, bucket_bits);
+  _filesize = (char *) (buckets + (SLOTS_PER_BUCKET << bucket_bits)) - ptr;
+}
+
+bool HashDB::is_hash_db(const char *ptr) {
+  return strncmp(HASH_DB_MAGIC, ptr, 8) == 0;
+}
+
+uint64_t HashDB::get_key_ct() { return key_ct; }
+uint64_t HashDB::get_taxid_ct() { return taxid_ct; }
+uint64_t HashDB::get_bucket_ct() { return 1ull << bucket_bits; }
+size_t HashDB::filesize() const { return _filesize; }
+
+const uint32_t *HashDB::kmer_query(uint64_t kmer) {
+  const uint64_t *slot = find_slot(kmer);
+  return slot ? taxids + (*slot & low_mask(val_bits)) - 1 : NULL;
+}
+
+const uint64_t *HashDB::find_slot(uint64_t kmer) {
+  if (kmer >> key_bits)
+    return NULL;
+  uint64_t h = hash(kmer);
+  uint64_t home = h >> fp_bits;
+  uint64_t fp = h & low_mask(fp_bits);
+  uint64_t bucket_mask = low_mask(bucket_bits);
+  for (uint64_t d = 0; d < (1ull << DISP_BITS); d++) {
+    const uint64_t *bucket = buckets + ((home + d) & bucket_mask) * SLOTS_PER_BUCKET;
+    for (uint64_t s = 0; s < SLOTS_PER_BUCKET; s++) {
+      uint64_t slot = bucket[s];
+      // later buckets are only used once this one is full
+      if (slot == 0)
+        return NULL;
+      if (((slot >> val_bits) & low_mask(DISP_BITS)) == d
+          && (fp_bits == 0 || slot >> (val_bits + DISP_BITS) == fp))
+        return bucket + s;
+    }
+  }
+  return NULL;
+}
+
+const char *HashDB::engine_name() { return "hash table"; }
+uint8_t HashDB::bin_key_nt() { return 0; }
+uint64_t HashDB::bin_key_xor_mask() { return 0; }
+uint64_t HashDB::bin_key(uint64_t kmer) { (void) kmer; return 0; }
+
+const uint32_t *HashDB::lookup(uint64_t kmer, uint64_t b_key, QueryState &state) {
+  (void) b_key;
+  (void) state;
+  return kmer_query(kmer);
+}
+
+void HashDB::lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                          size_t n, const uint32_t **results) {
+  (void) b_keys;
+  uint64_t bucket_mask = low_mask(bucket_bits);
+  for (size_t i = 0; i < n && i < BATCH_PREFETCH_DIST; i++)
+    __builtin_prefetch(buckets + ((hash(kmers[i]) >> fp_bits) & bucket_mask) * SLOTS_PER_BUCKET);
+  for (size_t i = 0; i < n; i++) {
+    if (i + BATCH_PREFETCH_DIST < n) {
+      uint64_t h = hash(kmers[i + BATCH_PREFETCH_DIST]);
+      __builtin_prefetch(buckets + ((h >> fp_bits) & bucket_mask) * SLOTS_PER_BUCKET);
+    }
+    results[i] = kmer_query(kmers[i]);
+  }
+}
+
+// Slot of the pos-th k-mer, counting occupied slots in table order
+const uint64_t *HashDB::slot_at(uint64_t pos) {
+  uint64_t n_samples = ((1ull << bucket_bits) + OCC_SAMPLE - 1) / OCC_SAMPLE + 1;
+  uint64_t j = std::upper_bound(occ_samples, occ_samples + n_samples, pos) - occ_samples - 1;
+  uint64_t left = pos - occ_samples[j];
+  for (uint64_t b = j * OCC_SAMPLE; ; b++) {
+    const uint64_t *bucket = buckets + b * SLOTS_PER_BUCKET;
+    uint64_t n = 0;
+    while (n < SLOTS_PER_BUCKET && bucket[n] != 0)
+      n++;
+    if (left < n)
+      return bucket + left;
+    left -= n;
+  }
+}
+
+uint64_t HashDB::get_key(uint64_t pos) {
+  const uint64_t *slot_ptr = slot_at(pos);
+  uint64_t slot = *slot_ptr;
+  uint64_t b = (slot_ptr - buckets) / SLOTS_PER_BUCKET;
+  uint64_t d = (slot >> val_bits) & low_mask(DISP_BITS);
+  uint64_t home = (b - d) & low_mask(bucket_bits);
+  uint64_t fp = fp_bits ? slot >> (val_bits + DISP_BITS) : 0;
+  return unhash((home << fp_bits) | fp);
+}
+
+uint32_t HashDB::get_value(uint64_t pos) {
+  return taxids[(*slot_at(pos) & low_mask(val_bits)) - 1];
+}
+
+// Pair ids are slot indices, as positions would need the slot counts
+uint64_t HashDB::pair_id_ct() {
+  return get_bucket_ct() * SLOTS_PER_BUCKET;
+}
+
+uint64_t HashDB::pair_id(uint64_t kmer, const uint32_t *val_ptr) {
+  (void) val_ptr;
+  return find_slot(kmer) - buckets;
+}
+
+uint32_t HashDB::pair_id_value(uint64_t id) {
+  return taxids[(buckets[id] & low_mask(val_bits)) - 1];
+}
+
+void HashDB::set_value(uint64_t pos, uint32_t val) {
+  (void) pos;
+  (void) val;
+  errx(EX_SOFTWARE, "hash table database is read-only");
+}
+
+static void write_words(std::ofstream &out, const void *data, uint64_t bytes) {
+  static const char zeros[8] = {0};
+  out.write((const char *) data, bytes);
+  if (bytes % 8)
+    out.write(zeros, 8 - bytes % 8);
+}
+
+void HashDB::write(string filename, KrakenDB &db, double max_load) {
+  uint64_t key_ct = db.get_key_ct();
+  HashDB table;
+  table.k = db.get_k();
+  table.key_bits = db.get_key_bits();
+  table.key_ct = key_ct;
+  if (table.key_bits > 62)
+    errx(EX_DATAERR, "k-mers of more than 62 bits are not supported");
+
+  // taxid table, values are stored as indices into it
+  std::unordered_set<uint32_t> taxid_set;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    std::unordered_set<uint32_t> my_taxids;
+#ifdef _OPENMP
+    #pragma omp for schedule(static)
+#endif
+    for (uint64_t i = 0; i < key_ct; i++)
+      my_taxids.insert(*db.get_value_ptr(i));
+#ifdef _OPENMP
+    #pragma omp critical(taxid_set)
+#endif
+    taxid_set.insert(my_taxids.begin(), my_taxids.end());
+  }
+  vector<uint32_t> taxids(taxid_set.begin(), taxid_set.end());
+  std::sort(taxids.begin(), taxids.end());
+  std::unordered_map<uint32_t, uint64_t> taxid_idx;
+  for (size_t i = 0; i < taxids.size(); i++)
+    taxid_idx[taxids[i]] = i;
+  table.taxid_ct = taxids.size();
+  table.val_bits = 1;
+  while ((1ull << table.val_bits) <= table.taxid_ct)
+    table.val_bits++;
+
+  // fewest buckets w/ the load below max_load, s.t. the slot fields fit
+  table.bucket_bits = 1;
+  while (table.bucket_bits < table.key_bits
+         && ((double) key_ct > max_load * (SLOTS_PER_BUCKET << table.bucket_bits)
+             || table.key_bits - table.bucket_bits + DISP_BITS + table.val_bits > 64))
+    table.bucket_bits++;
+  table.fp_bits = table.key_bits - table.bucket_bits;
+  uint64_t n_buckets = 1ull << table.bucket_bits;
+  if (key_ct > SLOTS_PER_BUCKET * n_buckets)
+    errx(EX_DATAERR, "too many k-mers for the hash table");
+
+  // Slots are claimed w/ compare-and-swap. A bucket is only skipped when
+  // it is full, so lookups can stop at the first empty slot.
+  vector<uint64_t> slots(SLOTS_PER_BUCKET * n_buckets, 0);
+  uint64_t *slot_data = slots.data();
+  uint64_t bucket_mask = n_buckets - 1;
+  bool disp_overflow = false;
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static)
+#endif
+  for (uint64_t i = 0; i < key_ct; i++) {
+    uint64_t h = table.hash(db.get_key(i));
+    uint64_t home = h >> table.fp_bits;
+    uint64_t fp = h & low_mask(table.fp_bits);
+    uint64_t val = taxid_idx.find(*db.get_value_ptr(i))->second + 1;
+    bool inserted = false;
+    for (uint64_t d = 0; d < (1ull << DISP_BITS) && ! inserted; d++) {
+      uint64_t *bucket = slot_data + ((home + d) & bucket_mask) * SLOTS_PER_BUCKET;
+      uint64_t slot = (table.fp_bits ? fp << (table.val_bits + DISP_BITS) : 0)
+                      | (d << table.val_bits) | val;
+      for (uint64_t s = 0; s < SLOTS_PER_BUCKET && ! inserted; s++) {
+        while (__atomic_load_n(bucket + s, __ATOMIC_RELAXED) == 0) {
+          if (__sync_bool_compare_and_swap(bucket + s, 0, slot)) {
+            inserted = true;
+            break;
+          }
+        }
+      }
+    }
+    if (! inserted)
+      disp_overflow = true;
+  }
+  if (disp_overflow)
+    errx(EX_DATAERR, "k-mers too far from their home bucket, use a lower load factor");
+
+  // occupied slots before every OCC_SAMPLE-th bucket
+  vector<uint64_t> occ_samples;
+  uint64_t occupied = 0;
+  for (uint64_t b = 0; b < n_buckets; b++) {
+    if (b % OCC_SAMPLE == 0)
+      occ_samples.push_back(occupied);
+    for (uint64_t s = 0; s < SLOTS_PER_BUCKET; s++)
+      occupied += slots[b * SLOTS_PER_BUCKET + s] != 0;
+  }
+  occ_samples.push_back(occupied);
+
+  std::ofstream out(filename.c_str(), std::ofstream::binary);
+  if (! out)
+    err(EX_CANTCREAT, "unable to open %s", filename.c_str());
+  uint64_t header[HASH_DB_HEADER_WORDS] = {0};
+  memcpy(header, HASH_DB_MAGIC, 8);
+  header[1] = table.k;
+  header[2] = key_ct;
+  header[3] = table.bucket_bits;
+  header[4] = table.val_bits;
+  header[5] = table.taxid_ct;
+  write_words(out, header, sizeof(header));
+  write_words(out, taxids.data(), taxids.size() * sizeof(uint32_t));
+  write_words(out, occ_samples.data(), occ_samples.size() * 8);
+  uint64_t written = HASH_DB_HEADER_WORDS + padded_words(taxids.size() * sizeof(uint32_t)) + occ_samples.size();
+  vector<uint64_t> padding(words_before_buckets(table.taxid_ct, table.bucket_bits) - written, 0);
+  write_words(out, padding.data(), padding.size() * 8);
+  write_words(out, slots.data(), slots.size() * 8);
+  out.close();
+  if (! out)
+    err(EX_IOERR, "error writing %s", filename.c_str());
+}
+
+} // namespace
@@ -0,0 +1,112 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HASHDB_HPP
+#define HASHDB_HPP
+
+#include "kraken_headers.hpp"
+#include "kmerstore.hpp"
+#include "krakendb.hpp"
+
+namespace kraken {
+  // Read-only k-mer database in an open-addressing hash table w/ buckets of
+  // one cache line (8 slots of 64 bits).
+  //
+  // K-mers are scrambled by an invertible hash h. The top bucket_bits of h
+  // select the home bucket, the remaining bits are stored as fingerprint,
+  // so k-mers are recovered exactly from their slot and lookups have no
+  // false positives. A k-mer whose home bucket is full is put into the next
+  // bucket w/ room (linear probing), and the distance to its home bucket is
+  // kept in the slot. Slots are filled front to back and never emptied, so
+  // a lookup stops at the first empty slot; mostly it reads one cache line.
+  //
+  // Slot: fingerprint | displacement (DISP_BITS) | value index + 1, 0 if empty
+  // Values are indices into the table of the distinct taxids in the DB.
+  //
+  // File layout (8-byte words, arrays padded to whole words):
+  //   magic, k, key_ct, bucket_bits, val_bits, taxid_ct, 2 words reserved,
+  //   taxids[taxid_ct] (uint32), slot counts before every OCC_SAMPLE-th bucket,
+  //   (padding to a cache line) buckets
+  class HashDB : public KmerStore {
+    public:
+    static const uint64_t SLOTS_PER_BUCKET = 8;
+    static const uint64_t DISP_BITS = 8;
+    static const uint64_t OCC_SAMPLE = 64;
+
+    // Null constructor
+    HashDB();
+
+    // ptr points to start of mmap'ed DB
+    HashDB(char *ptr);
+
+    // true if ptr points to a DB in this format
+    static bool is_hash_db(const char *ptr);
+
+    // Write the k-mers and values of a KrakenDB in this format, w/ the
+    // fewest (power of two) buckets that keep the load under max_load
+    static void write(std::string filename, KrakenDB &db, double max_load);
+
+    uint64_t get_key_ct();      // how many keys are there?
+    uint64_t get_taxid_ct();    // how many distinct values are there?
+    uint64_t get_bucket_ct();   // how many buckets are there?
+    size_t filesize() const;
+
+    // return ptr to value of kmer (canonical), or NULL if not in the DB;
+    // the pointer is into the read-only taxid table
+    const uint32_t *kmer_query(uint64_t kmer);
+
+    // KmerStore interface, bin keys are not used. Positions number the
+    // occupied slots in table order.
+    const char *engine_name();
+    uint8_t bin_key_nt();
+    uint64_t bin_key_xor_mask();
+    uint64_t bin_key(uint64_t kmer);
+    const uint32_t *lookup(uint64_t kmer, uint64_t b_key, QueryState &state);
+    void lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                      size_t n, const uint32_t **results);
+    uint64_t get_key(uint64_t pos);
+    uint32_t get_value(uint64_t pos);
+    void set_value(uint64_t pos, uint32_t val);
+    uint64_t pair_id_ct();
+    uint64_t pair_id(uint64_t kmer, const uint32_t *val_ptr);
+    uint32_t pair_id_value(uint64_t id);
+
+    private:
+    char *fptr;
+    uint64_t key_bits;
+    uint64_t key_ct;
+    uint64_t bucket_bits;
+    uint64_t val_bits;
+    uint64_t taxid_ct;
+    uint64_t fp_bits;
+
+    const uint32_t *taxids;
+    const uint64_t *occ_samples;
+    const uint64_t *buckets;
+    size_t _filesize;
+
+    uint64_t hash(uint64_t kmer);
+    uint64_t unhash(uint64_t h);
+    const uint64_t *slot_at(uint64_t pos);
+    // slot of kmer, or NULL if it is not in the DB
+    const uint64_t *find_slot(uint64_t kmer);
+  };
+}
+
+#endif
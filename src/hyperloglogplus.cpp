@@ -32,6 +32,10 @@
 #include "hyperloglogplus-bias.hpp"
 #include "assert_helpers.h"
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /////////////////////////////////////////////////////////////////////
 // Helper methods for bit operations
 
@@ -236,11 +240,55 @@ void addHashToSparseList(vector<uint32_t>& vec, const uint32_t val, const uint8_
   //}
 }
 
-template<typename SET>
-inline 
-void addHashToSparseList(SET& uset, const uint32_t val, const uint8_t /*pPrime*/) {
-  // this implementation currently does not check if there is a value for an index of length pPrime
-  uset.insert(val);
+/////////////////////////////////////////////////////////////////////
+// SparseList methods
+
+inline void appendVarint(vector<uint8_t>& bytes, uint32_t val) {
+  while (val >= 0x80) {
+    bytes.push_back(uint8_t(val) | 0x80);
+    val >>= 7;
+  }
+  bytes.push_back(uint8_t(val));
+}
+
+bool SparseList::contains(uint32_t val) const {
+  for (auto it = begin(); it != end(); ++it) {
+    if (*it >= val)
+      return *it == val;
+  }
+  return false;
+}
+
+// this implementation does not check if there is a value for an index of length pPrime
+template<typename IT1, typename IT2>
+void SparseList::merge_sorted(IT1 a, IT1 a_end, IT2 b, IT2 b_end, size_t b_bytes) {
+  vector<uint8_t> merged;
+  merged.reserve(bytes.size() + b_bytes);
+  size_t n_merged = 0;
+  uint32_t prev = 0;
+  while (a != a_end || b != b_end) {
+    uint32_t val;
+    if (b == b_end || (a != a_end && *a < *b)) {
+      val = *a; ++a;
+    } else {
+      if (a != a_end && *a == *b) ++a;
+      val = *b; ++b;
+    }
+    appendVarint(merged, val - prev);
+    prev = val;
+    ++n_merged;
+  }
+  merged.shrink_to_fit();
+  bytes.swap(merged);
+  n = n_merged;
+}
+
+void SparseList::merge(const uint32_t* vals, size_t n_vals) {
+  merge_sorted(begin(), end(), vals, vals + n_vals, 5 * n_vals);
+}
+
+void SparseList::merge(const SparseList& other) {
+  merge_sorted(begin(), end(), other.begin(), other.end(), other.bytes.size());
 }
 
 
@@ -431,10 +479,7 @@ HyperLogLogPlusMinus<uint64_t>::HyperLogLogPlusMinus(uint8_t precision, bool spa
           throw std::invalid_argument("precision (number of register = 2^precision) must be between 4 and 18");
     }
 
-    if (sparse) {
-      this->sparseList = SparseListType(); // TODO: if SparseListType is changed, initialize with appropriate size
-      this->sparseList.reserve(m/4);
-    } else {
+    if (!sparse) {
       this->M = vector<uint8_t>(m);
     }
 }
@@ -447,6 +492,7 @@ HyperLogLogPlusMinus<HASH>& HyperLogLogPlusMinus<HASH>::operator= (HyperLogLogPl
   n_observed = other.n_observed;
   sparse = other.sparse;
   sparseList = std::move(other.sparseList);
+  sparseBuffer = std::move(other.sparseBuffer);
   bit_mixer = other.bit_mixer;
   return *this;
 }
@@ -459,6 +505,7 @@ HyperLogLogPlusMinus<HASH>& HyperLogLogPlusMinus<HASH>::operator= (const HyperLo
   n_observed = other.n_observed;
   sparse = other.sparse;
   sparseList = other.sparseList;
+  sparseBuffer = other.sparseBuffer;
   bit_mixer = other.bit_mixer;
   return *this;
 }
@@ -467,7 +514,7 @@ template<typename HASH>
 HyperLogLogPlusMinus<HASH>::HyperLogLogPlusMinus(const HyperLogLogPlusMinus<HASH>& other):
       p(other.p), m(other.m), 
       M(other.M), n_observed(other.n_observed), sparse(other.sparse), 
-      sparseList(other.sparseList), 
+      sparseList(other.sparseList), sparseBuffer(other.sparseBuffer),
       bit_mixer(other.bit_mixer) {
 }
 
@@ -477,55 +524,85 @@ HyperLogLogPlusMinus<HASH>::HyperLogLogPlusMinus(HyperLogLogPlusMinus<HASH>&& ot
       p(other.p), m(other.m), 
       M(std::move(other.M)), 
       n_observed(other.n_observed), sparse(other.sparse), 
-      sparseList(std::move(other.sparseList)), 
+      sparseList(std::move(other.sparseList)), sparseBuffer(std::move(other.sparseBuffer)),
       bit_mixer(other.bit_mixer) {
 }
 
 
+template<typename T>
+void HyperLogLogPlusMinus<T>::insert(uint64_t item) {
+    insert(&item, 1);
+}
+
 template<>
-void HyperLogLogPlusMinus<uint64_t>::insert(uint64_t item) {
-    ++ n_observed;
-    // compute hash for item
-    uint64_t hash_value = bit_mixer(item);
+void HyperLogLogPlusMinus<uint64_t>::insert(const uint64_t* items, size_t n_items) {
+    n_observed += n_items;
+    for (size_t i = 0; i < n_items; ++i) {
+      // compute hash for item
+      uint64_t hash_value = bit_mixer(items[i]);
 
 #ifdef HLL_DEBUG2
-    cerr << "Value: " << item << "; hash(value): " << hash_value << endl;
-    cerr << bitset<64>(hash_value) << endl;
+      cerr << "Value: " << items[i] << "; hash(value): " << hash_value << endl;
+      cerr << bitset<64>(hash_value) << endl;
 #endif
 
-    if (sparse && this->sparseList.size() + 1 > this->m/4) {
-       switchToNormalRepresentation();
-     }
-    if (sparse) {
-      // sparse mode: put the encoded hash into sparse list
-      uint32_t encoded_hash_value = encodeHashIn32Bit(hash_value, pPrime, p);
-      addHashToSparseList(sparseList, encoded_hash_value, pPrime);
+      if (sparse) {
+        // sparse mode: put the encoded hash into the buffer of the sparse list
+        uint32_t encoded_hash_value = encodeHashIn32Bit(hash_value, pPrime, p);
+        sparseBuffer.push_back(encoded_hash_value);
 
 #ifdef HLL_DEBUG2
-      cerr << "encoded hash:   " << bitset<32>(encoded_hash_value) << endl;
-      assert_eq(getIndex(encoded_hash_value,p),getIndex(hash_value, p));
-      assert_eq(getEncodedRank(encoded_hash_value,pPrime,p), getRank(hash_value, p));
+        cerr << "encoded hash:   " << bitset<32>(encoded_hash_value) << endl;
+        assert_eq(getIndex(encoded_hash_value,p),getIndex(hash_value, p));
+        assert_eq(getEncodedRank(encoded_hash_value,pPrime,p), getRank(hash_value, p));
 #endif
 
-      // if the sparseList is too large, switch to normal (register) representation
-    } else {
-      // normal mode
-      // take first p bits as index  {x63,...,x64-p}
-      uint32_t idx = getIndex(hash_value, p);
-      // shift those p values off, and count leading zeros of the remaining string {x63-p,...,x0}
-      uint8_t rank = getRank(hash_value, p);
-
-      // update the register if current rank is bigger
-      if (rank > this->M[idx]) {
-        this->M[idx] = rank;
+        // the buffer is merged when it reaches a quarter of the list, so
+        // each hash is merged about four times on average
+        if (sparseBuffer.size() >= std::max(minSparseBuffer, sparseList.size() / 4)) {
+          flushSparseBuffer();
+        }
+      } else {
+        // normal mode
+        // take first p bits as index  {x63,...,x64-p}
+        uint32_t idx = getIndex(hash_value, p);
+        // shift those p values off, and count leading zeros of the remaining string {x63-p,...,x0}
+        uint8_t rank = getRank(hash_value, p);
+
+        // update the register if current rank is bigger
+        if (rank > this->M[idx]) {
+          this->M[idx] = rank;
+        }
       }
     }
 }
 
 template <typename T>
 void HyperLogLogPlusMinus<T>::insert(const vector<uint64_t>& items) {
-    for(auto i : items) {
-      this->insert(i);
+    insert(items.data(), items.size());
+}
+
+// An insertion switches to the normal representation if the sparse list
+// has m/4 values before it. The list only grows, so that happens for one of
+// the buffered hashes iff it happens for the last one.
+template <typename T>
+void HyperLogLogPlusMinus<T>::flushSparseBuffer() {
+    if (sparseBuffer.empty())
+      return;
+    uint32_t last = sparseBuffer.back();
+    size_t max_size = sparseList.size() + sparseBuffer.size();
+    bool last_is_dup = max_size >= m/4 &&
+      (std::find(sparseBuffer.begin(), sparseBuffer.end() - 1, last) != sparseBuffer.end() - 1 ||
+       sparseList.contains(last));
+
+    std::sort(sparseBuffer.begin(), sparseBuffer.end());
+    size_t n_vals = std::unique(sparseBuffer.begin(), sparseBuffer.end()) - sparseBuffer.begin();
+    sparseList.merge(sparseBuffer.data(), n_vals);
+    sparseBuffer.clear();
+
+    size_t size_before_last = sparseList.size() - (last_is_dup ? 0 : 1);
+    if (size_before_last >= m/4) {
+      switchToNormalRepresentation();
     }
 }
 
@@ -534,6 +611,7 @@ template <typename T>
 void HyperLogLogPlusMinus<T>::reset() {
     this->sparse = true;
     this->sparseList.clear();  // 
+    this->sparseBuffer.clear();
     this->M.clear();
 }
 
@@ -583,6 +661,23 @@ uint64_t HyperLogLogPlusMinus<T>::nObserved() const {
 }
 
 
+// M1[i] = max(M1[i], M2[i]) for the n registers
+inline void maxRegisters(uint8_t* M1, const uint8_t* M2, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= n; i += 16) {
+      __m128i r1 = _mm_loadu_si128((const __m128i*)(M1 + i));
+      __m128i r2 = _mm_loadu_si128((const __m128i*)(M2 + i));
+      _mm_storeu_si128((__m128i*)(M1 + i), _mm_max_epu8(r1, r2));
+    }
+#endif
+    for (; i < n; ++i) {
+      if (M2[i] > M1[i]) {
+        M1[i] = M2[i];
+      }
+    }
+}
+
 template<typename T>
 void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
     if (this->p != other.p) {
@@ -590,6 +685,8 @@ void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
     }
     if (other.n_observed == 0)
       return;
+    flushSparseBuffer();
+    other.flushSparseBuffer();
 
     if (this->n_observed == 0) {
       n_observed = other.n_observed;
@@ -601,7 +698,7 @@ void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
       if (this->sparse && other.sparse) {
         // this->merge(static_cast<const HyperLogLogPlusMinus<T>&>(other));
         // consider using addHashToSparseList(this->sparseList, val, pPrime) and checking for sizes
-        this->sparseList.insert(other.sparseList.begin(), other.sparseList.end());
+        this->sparseList.merge(other.sparseList);
       } else if (other.sparse) {
         // other is sparse, but this is not
         addToRegisters(other.sparseList);
@@ -613,11 +710,7 @@ void HyperLogLogPlusMinus<T>::merge(HyperLogLogPlusMinus<T>&& other) {
           this->sparseList.clear();
         } else {
           // merge registers
-          for (size_t i = 0; i < other.M.size(); ++i) {
-            if (other.M[i] > this->M[i]) {
-              this->M[i] = other.M[i];
-           }
-          }
+          maxRegisters(this->M.data(), other.M.data(), other.M.size());
         }
       }
     }
@@ -631,6 +724,11 @@ void HyperLogLogPlusMinus<T>::merge(const HyperLogLogPlusMinus<T>& other) {
     }
     if (other.n_observed == 0)
       return;
+    if (!other.sparseBuffer.empty()) {
+      merge(HyperLogLogPlusMinus<T>(other));
+      return;
+    }
+    flushSparseBuffer();
 
     if (this->n_observed == 0) {
       // TODO: Make this more efficient when other is disowned
@@ -642,7 +740,7 @@ void HyperLogLogPlusMinus<T>::merge(const HyperLogLogPlusMinus<T>& other) {
       n_observed += other.n_observed;
       if (this->sparse && other.sparse) {
         // consider using addHashToSparseList(this->sparseList, val, pPrime) and checking for sizes
-        this->sparseList.insert(other.sparseList.begin(), other.sparseList.end());
+        this->sparseList.merge(other.sparseList);
       } else if (other.sparse) {
         // other is sparse, but this is not
         addToRegisters(other.sparseList);
@@ -654,11 +752,7 @@ void HyperLogLogPlusMinus<T>::merge(const HyperLogLogPlusMinus<T>& other) {
           this->sparseList.clear();
         } else {
           // merge registers
-          for (size_t i = 0; i < other.M.size(); ++i) {
-            if (other.M[i] > this->M[i]) {
-              this->M[i] = other.M[i];
-            }
-          }
+          maxRegisters(this->M.data(), other.M.data(), other.M.size());
         }
       }
     }
@@ -678,6 +772,12 @@ HyperLogLogPlusMinus<T>& HyperLogLogPlusMinus<T>::operator+=(const HyperLogLogPl
 
 template<>
 uint64_t HyperLogLogPlusMinus<uint64_t>::flajoletCardinality(bool use_sparse_precision) const {
+    if (!sparseBuffer.empty()) {
+      // estimate on a copy w/ the buffered hashes in the sparse list
+      HyperLogLogPlusMinus<uint64_t> flushed(*this);
+      flushed.flushSparseBuffer();
+      return flushed.flajoletCardinality(use_sparse_precision);
+    }
     vector<uint8_t> M = this->M;
     if (sparse) {
       if (use_sparse_precision) {
@@ -721,6 +821,12 @@ uint64_t HyperLogLogPlusMinus<uint64_t>::flajoletCardinality(bool use_sparse_pre
  */
 template<>
 uint64_t HyperLogLogPlusMinus<uint64_t>::ertlCardinality() const {
+    if (!sparseBuffer.empty()) {
+      // estimate on a copy w/ the buffered hashes in the sparse list
+      HyperLogLogPlusMinus<uint64_t> flushed(*this);
+      flushed.flushSparseBuffer();
+      return flushed.ertlCardinality();
+    }
     size_t q, m;
     vector<int> C;
     if (sparse) {
@@ -755,6 +861,12 @@ uint64_t HyperLogLogPlusMinus<uint64_t>::ertlCardinality() const {
 
 template<>
 uint64_t HyperLogLogPlusMinus<uint64_t>::heuleCardinality(bool correct_bias) const {
+    if (!sparseBuffer.empty()) {
+      // estimate on a copy w/ the buffered hashes in the sparse list
+      HyperLogLogPlusMinus<uint64_t> flushed(*this);
+      flushed.flushSparseBuffer();
+      return flushed.heuleCardinality(correct_bias);
+    }
     if (p > 18) {
       cerr << "Heule HLL++ estimate only works with value of p up to 18 - returning Ertl estimate." << endl;
       return(ertlCardinality());
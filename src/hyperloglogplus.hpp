@@ -44,16 +44,55 @@ using namespace std;
 uint64_t murmurhash3_finalizer (uint64_t key);
 
 
-// Heule et al. encode the sparse list with variable length encoding
-//   see section 5.3.2. This implementation just uses a sorted vector or unordered_set.
-typedef unordered_set<uint32_t> SparseListType;
-// Other possible SparseList types:
-// // typedef vector<uint32_t> SparseListType;
-// The sorted vector implementation is pretty inefficient currently, as the vector
-// is always kept sorted. 
-// //typedef unordered_set<uint32_t, NoHash<uint32_t> > SparseListType;
-// No real performance gain from using the hash value directly - and probably problems
-// with the bucket assignment, since unordered_set expects size_t hashes
+// Sparse representation: sorted list of the distinct encoded hashes. As
+//   in Heule et al., section 5.3.2, the differences between consecutive
+//   values are stored w/ a variable length encoding (7 bits per byte).
+class SparseList {
+public:
+  class const_iterator {
+  public:
+    const_iterator(const uint8_t* pos, const uint8_t* end) : pos(pos), end(end), val(0) { next(); }
+    uint32_t operator*() const { return val; }
+    const_iterator& operator++() { next(); return *this; }
+    bool operator==(const const_iterator& other) const { return pos == other.pos && done == other.done; }
+    bool operator!=(const const_iterator& other) const { return !(*this == other); }
+  private:
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint32_t val;
+    bool done;
+    void next() {
+      done = pos == end;
+      if (done) return;
+      uint32_t delta = 0;
+      for (int shift = 0; ; shift += 7) {
+        delta |= uint32_t(*pos & 0x7f) << shift;
+        if (!(*pos++ & 0x80)) break;
+      }
+      val += delta;
+    }
+  };
+
+  SparseList() : n(0) {}
+  size_t size() const { return n; }
+  bool empty() const { return n == 0; }
+  void clear() { bytes.clear(); n = 0; }
+  const_iterator begin() const { return const_iterator(bytes.data(), bytes.data() + bytes.size()); }
+  const_iterator end() const { return const_iterator(bytes.data() + bytes.size(), bytes.data() + bytes.size()); }
+  bool contains(uint32_t val) const;
+
+  // Add n_vals sorted, distinct values / the values of other
+  void merge(const uint32_t* vals, size_t n_vals);
+  void merge(const SparseList& other);
+
+private:
+  vector<uint8_t> bytes;
+  size_t n;
+
+  template<typename IT1, typename IT2>
+  void merge_sorted(IT1 a, IT1 a_end, IT2 b, IT2 b_end, size_t b_bytes);
+};
+typedef SparseList SparseListType;
 
 /**
  * HyperLogLogPlusMinus class for counting the number of unique 64-bit values in stream
@@ -70,6 +109,7 @@ private:
 
   bool sparse;          // sparse representation of the data?
   SparseListType sparseList;
+  vector<uint32_t> sparseBuffer; // encoded hashes not yet merged into sparseList
   HASH (*bit_mixer) (uint64_t);
 
   // sparse versions of p and m
@@ -79,6 +119,7 @@ private:
                                      //   6 bits for rank + 
                                      //   1 flag bit indicating if bits p..pPrime are 0
   static const uint32_t mPrime = 1 << pPrime; // 2^pPrime
+  static const size_t minSparseBuffer = 16;
 
 public:
   bool use_n_observed = true; // return min(estimate, n_observed) instead of estimate
@@ -94,6 +135,7 @@ public:
 
   // Add items or other HLL to this sketch
   void insert(uint64_t item);
+  void insert(const uint64_t* items, size_t n_items);
   void insert(const vector<uint64_t>& items);
 
   // Merge another sketch into this one
@@ -118,6 +160,9 @@ public:
 private:
   void switchToNormalRepresentation();
   void addToRegisters(const SparseListType &sparseList);
+  // sort-merge sparseBuffer into sparseList, s.t. the sketch is the same
+  // as if each hash had been added to sparseList on insertion
+  void flushSparseBuffer();
 
 };
 
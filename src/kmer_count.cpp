@@ -0,0 +1,326 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Collects the distinct canonical k-mers of the library sequences and writes
+// them as a sorted database (w/ zero values) and its index, replacing
+// jellyfish count/merge and db_sort.
+//
+// In one pass over the library, k-mers are partitioned by the high bits of
+// their bin key (scrambled minimizer) into buckets, which are appended in
+// blocks to a temporary file. Then the buckets, which are consecutive ranges
+// of bins, are sorted and deduplicated in parallel and written in order.
+
+#include "kraken_headers.hpp"
+#include "krakendb.hpp"
+#include "krakenutil.hpp"
+#include "seqreader.hpp"
+#include <algorithm>
+
+using namespace std;
+using namespace kraken;
+
+uint8_t Kmer_len = 31;
+uint8_t Bin_key_nt = 15;
+int Num_threads = 1;
+uint64_t Num_buckets = 1024;
+string Output_DB_filename, Index_filename, Tmp_dir;
+vector<string> Input_filenames;
+
+// Number of k-mers buffered per bucket and thread before they are written
+static const size_t BUCKET_BUFFER_SIZE = 8192;
+// Bases per input block
+static const size_t INPUT_BLOCK_SIZE = 1 << 24;
+
+// a block of k-mers of one bucket in the temporary file
+struct kmer_block {
+  uint64_t offset;
+  uint64_t n_kmers;
+};
+
+int Tmp_fd = -1;
+uint64_t Tmp_file_size = 0;
+
+static void parse_command_line(int argc, char **argv);
+static void usage(int exit_code=EX_USAGE);
+
+static void write_at(int fd, uint64_t offset, const char *data, uint64_t size, const string &filename) {
+  for (uint64_t done = 0; done < size; ) {
+    ssize_t ret = pwrite(fd, data + done, size - done, offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to write to %s", filename.c_str());
+    done += ret;
+  }
+}
+
+static void read_at(int fd, uint64_t offset, char *data, uint64_t size) {
+  for (uint64_t done = 0; done < size; ) {
+    ssize_t ret = pread(fd, data + done, size - done, offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to read from temporary file");
+    done += ret;
+  }
+}
+
+// Appends the distinct buffered k-mers of a bucket at an offset reserved
+// atomically
+static void flush_bucket(vector<uint64_t> &buffer, vector<kmer_block> &blocks) {
+  if (buffer.empty())
+    return;
+  sort(buffer.begin(), buffer.end());
+  buffer.erase(unique(buffer.begin(), buffer.end()), buffer.end());
+  kmer_block block;
+  block.n_kmers = buffer.size();
+  block.offset = __sync_fetch_and_add(&Tmp_file_size, block.n_kmers * sizeof(uint64_t));
+  write_at(Tmp_fd, block.offset, (char *) buffer.data(), block.n_kmers * sizeof(uint64_t), "temporary file");
+  blocks.push_back(block);
+  buffer.clear();
+}
+
+// Scans the library and writes the k-mers of each bucket to the temporary
+// file; returns the blocks of each bucket
+static vector<vector<kmer_block> > partition_kmers(KrakenDB &db, int bucket_shift) {
+  vector<vector<kmer_block> > bucket_blocks(Num_buckets);
+  uint64_t xor_mask = KrakenDB::index2_xor_mask(Bin_key_nt);
+  uint64_t n_kmers = 0, n_bases = 0;
+
+  for (size_t f = 0; f < Input_filenames.size(); f++) {
+    SequenceBlockReader reader(Input_filenames[f], INPUT_BLOCK_SIZE);
+    if (reader.is_fastq())
+      errx(EX_DATAERR, "%s: library sequences must be in FASTA format", Input_filenames[f].c_str());
+#ifdef _OPENMP
+    #pragma omp parallel reduction(+:n_kmers,n_bases)
+#endif
+    {
+      vector<vector<uint64_t> > buffers(Num_buckets);
+      vector<vector<kmer_block> > my_blocks(Num_buckets);
+      SequenceBlock block;
+      DNASequence dna;
+      while (reader.read_block(block)) {
+        while (block.next_sequence(dna)) {
+          n_bases += dna.seq.size();
+          KmerScanner scanner(dna.seq);
+          scanner.track_minimizers(Bin_key_nt, xor_mask);
+          uint64_t *kmer_ptr;
+          while ((kmer_ptr = scanner.next_kmer()) != NULL) {
+            if (scanner.ambig_kmer())
+              continue;
+            uint64_t bucket = scanner.minimizer() >> bucket_shift;
+            buffers[bucket].push_back(db.canonical_representation(*kmer_ptr));
+            if (buffers[bucket].size() == BUCKET_BUFFER_SIZE)
+              flush_bucket(buffers[bucket], my_blocks[bucket]);
+            ++n_kmers;
+          }
+        }
+      }
+      for (uint64_t b = 0; b < Num_buckets; b++)
+        flush_bucket(buffers[b], my_blocks[b]);
+#ifdef _OPENMP
+      #pragma omp critical(bucket_blocks)
+#endif
+      for (uint64_t b = 0; b < Num_buckets; b++)
+        bucket_blocks[b].insert(bucket_blocks[b].end(), my_blocks[b].begin(), my_blocks[b].end());
+    }
+  }
+  cerr << "kmer_count: Read " << n_bases << " bp with " << n_kmers << " k-mers" << endl;
+  return bucket_blocks;
+}
+
+int main(int argc, char **argv) {
+  #ifdef _OPENMP
+  omp_set_num_threads(1);
+  #endif
+
+  parse_command_line(argc, argv);
+
+  KmerScanner::set_k(Kmer_len);
+  // No k-mers yet, but allows access to KDB functions
+  string header = KrakenDB::make_header(Kmer_len, 0);
+  KrakenDB db(&header[0]);
+
+  uint64_t entries = 1ull << (Bin_key_nt * 2);
+  if (Num_buckets > entries)
+    Num_buckets = entries;
+  int bucket_shift = 0;
+  while ((entries >> bucket_shift) > Num_buckets)
+    ++bucket_shift;
+
+  if (Tmp_dir.empty())
+    Tmp_dir = get_directory(Output_DB_filename);
+  string tmp_filename = Tmp_dir + "/kmer_count.XXXXXX";
+  Tmp_fd = mkstemp(&tmp_filename[0]);
+  if (Tmp_fd < 0)
+    err(EX_CANTCREAT, "unable to create temporary file %s", tmp_filename.c_str());
+  // the file is removed once it is closed
+  unlink(tmp_filename.c_str());
+
+  cerr << "kmer_count: Partitioning k-mers into " << Num_buckets << " buckets ..." << endl;
+  vector<vector<kmer_block> > bucket_blocks = partition_kmers(db, bucket_shift);
+
+  int output_fd = open(Output_DB_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (output_fd < 0)
+    err(EX_CANTCREAT, "unable to create %s", Output_DB_filename.c_str());
+
+  // Sort and deduplicate buckets in parallel, write them in order. The bin
+  // counts of a bucket are only touched by the thread sorting it.
+  cerr << "kmer_count: Sorting buckets ...";
+  uint64_t *bin_offsets = new uint64_t[ entries + 1 ];
+  uint64_t key_len = db.get_key_len();
+  uint64_t pair_size = db.pair_size();
+  uint64_t bins_per_bucket = 1ull << bucket_shift;
+  uint64_t key_ct = 0;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    vector<uint64_t> kmers, b_keys;
+    vector<char> pairs;
+#ifdef _OPENMP
+    #pragma omp for ordered schedule(dynamic,1)
+#endif
+    for (uint64_t b = 0; b < Num_buckets; b++) {
+      uint64_t n = 0;
+      for (size_t i = 0; i < bucket_blocks[b].size(); i++)
+        n += bucket_blocks[b][i].n_kmers;
+      kmers.resize(n);
+      n = 0;
+      for (size_t i = 0; i < bucket_blocks[b].size(); i++) {
+        const kmer_block &block = bucket_blocks[b][i];
+        read_at(Tmp_fd, block.offset, (char *) (kmers.data() + n), block.n_kmers * sizeof(uint64_t));
+        n += block.n_kmers;
+      }
+      sort(kmers.begin(), kmers.end());
+      kmers.erase(unique(kmers.begin(), kmers.end()), kmers.end());
+
+      // counting sort of the (sorted) k-mers into their bins
+      uint64_t *bin_counts = bin_offsets + (b << bucket_shift);
+      fill(bin_counts, bin_counts + bins_per_bucket, 0);
+      b_keys.resize(kmers.size());
+      for (size_t i = 0; i < kmers.size(); i++) {
+        b_keys[i] = db.bin_key(kmers[i], Bin_key_nt) - (b << bucket_shift);
+        bin_counts[b_keys[i]]++;
+      }
+      vector<uint64_t> bin_pos(bins_per_bucket);
+      for (uint64_t j = 1; j < bins_per_bucket; j++)
+        bin_pos[j] = bin_pos[j-1] + bin_counts[j-1];
+      pairs.assign(kmers.size() * pair_size, 0);
+      for (size_t i = 0; i < kmers.size(); i++)
+        memcpy(&pairs[bin_pos[b_keys[i]]++ * pair_size], &kmers[i], key_len);
+
+#ifdef _OPENMP
+      #pragma omp ordered
+#endif
+      {
+        write_at(output_fd, header.size() + key_ct * pair_size, pairs.data(), pairs.size(), Output_DB_filename);
+        key_ct += kmers.size();
+      }
+    }
+  }
+  close(Tmp_fd);
+  cerr << " done - " << key_ct << " distinct k-mers" << endl;
+
+  header = KrakenDB::make_header(Kmer_len, key_ct);
+  write_at(output_fd, 0, header.data(), header.size(), Output_DB_filename);
+  close(output_fd);
+
+  // bin_offsets holds the counts of the bins
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i <= entries; i++) {
+    uint64_t count = i < entries ? bin_offsets[i] : 0;
+    bin_offsets[i] = offset;
+    offset += count;
+  }
+  KrakenDB::write_index(Index_filename, Bin_key_nt, bin_offsets);
+  delete[] bin_offsets;
+
+  return 0;
+}
+
+void parse_command_line(int argc, char **argv) {
+  int opt;
+  long long sig;
+
+  if (argc > 1 && strcmp(argv[1], "-h") == 0)
+    usage(0);
+  while ((opt = getopt(argc, argv, "k:n:t:b:o:i:T:")) != -1) {
+    switch (opt) {
+      case 'k' :
+        sig = atoll(optarg);
+        if (sig < 1 || sig > 31)
+          errx(EX_USAGE, "k-mer length out of range");
+        Kmer_len = (uint8_t) sig;
+        break;
+      case 'n' :
+        sig = atoll(optarg);
+        // the index has 4^nt entries
+        if (sig < 1 || sig > 16)
+          errx(EX_USAGE, "bin key length out of range");
+        Bin_key_nt = (uint8_t) sig;
+        break;
+      case 't' :
+        sig = atoll(optarg);
+        if (sig <= 0)
+          errx(EX_USAGE, "can't use nonpositive thread count");
+        #ifdef _OPENMP
+        if (sig > omp_get_num_procs())
+          errx(EX_USAGE, "thread count exceeds number of processors");
+        Num_threads = sig;
+        omp_set_num_threads(Num_threads);
+        #endif
+        break;
+      case 'b' :
+        sig = atoll(optarg);
+        if (sig < 1 || (sig & (sig - 1)))
+          errx(EX_USAGE, "number of buckets must be a power of two");
+        Num_buckets = sig;
+        break;
+      case 'o' :
+        Output_DB_filename = optarg;
+        break;
+      case 'i' :
+        Index_filename = optarg;
+        break;
+      case 'T' :
+        Tmp_dir = optarg;
+        break;
+      default:
+        usage();
+        break;
+    }
+  }
+
+  if (Bin_key_nt >= Kmer_len)
+    errx(EX_USAGE, "bin key length must be smaller than the k-mer length");
+  if (Output_DB_filename.empty() || Index_filename.empty() || optind == argc)
+    usage();
+  for (int i = optind; i < argc; i++)
+    Input_filenames.push_back(argv[i]);
+}
+
+void usage(int exit_code) {
+  cerr << "Usage: kmer_count [-k k] [-n nt] [-t threads] [-b buckets] [-T tmp dir] <-o output db> <-i output idx> <FASTA file(s)>\n"
+       << "  -k k        K-mer length (default: " << (int) Kmer_len << ")\n"
+       << "  -n nt       Minimizer length of the index, at most 16 (default: " << (int) Bin_key_nt << ")\n"
+       << "  -b buckets  Number of buckets, a power of two (default: " << Num_buckets << "). The\n"
+       << "              temporary file takes up to 8 bytes per k-mer occurrence in the library\n"
+       << "              (repeats close to each other are stored once), and sorting a bucket\n"
+       << "              needs as much RAM for its part of the file; use more buckets for\n"
+       << "              larger libraries.\n"
+       << "  -T dir      Directory for the temporary file (default: directory of the output db)\n";
+  exit(exit_code);
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kmerstore.hpp"
+#include "krakendb.hpp"
+#include "compactdb.hpp"
+#include "hashdb.hpp"
+
+namespace kraken {
+
+bool KmerStore::needs_index(const char *ptr) {
+  return ! CompactDB::is_compact_db(ptr) && ! HashDB::is_hash_db(ptr);
+}
+
+KmerStore *KmerStore::open(char *ptr, size_t filesize, char *index_ptr) {
+  if (ptr == NULL)
+    errx(EX_DATAERR, "pointer is NULL");
+  if (CompactDB::is_compact_db(ptr))
+    return new CompactDB(ptr);
+  if (HashDB::is_hash_db(ptr))
+    return new HashDB(ptr);
+
+  // KrakenDB checks its own magic
+  KrakenDB *db = new KrakenDB(ptr, filesize);
+  if (index_ptr != NULL)
+    db->set_index(index_ptr);
+  return db;
+}
+
+} // namespace
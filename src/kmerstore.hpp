@@ -0,0 +1,181 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KMERSTORE_HPP
+#define KMERSTORE_HPP
+
+#include "kraken_headers.hpp"
+
+namespace kraken {
+  // Interface of the storage engines mapping canonical k-mers to taxids.
+  // KmerStore::open() picks the engine from the magic at the start of the
+  // DB file:
+  //   "JFLISTDN", "KRAKBLK1"  KrakenDB, sorted k-mers w/ a minimizer index
+  //   "KRAKEF01"              CompactDB, read-only Elias-Fano coded k-mers
+  //   "KRAKHT01"              HashDB, read-only hash table
+  // Everything is inline or pure, so programs that use a single engine
+  // don't need to link the others; only open() lives in kmerstore.cpp.
+  class KmerStore {
+    public:
+    // State a thread keeps between lookups of consecutive k-mers of a
+    // read (the range of the last bin for KrakenDB)
+    struct QueryState {
+      QueryState() : last_bin_key(0), min_pos(1), max_pos(0) {}
+      uint64_t last_bin_key;
+      int64_t min_pos;
+      int64_t max_pos;
+    };
+
+    virtual ~KmerStore() {}
+
+    // Engine for the DB at ptr; index_ptr points to its mmap'ed index if
+    // needs_index(ptr). W/o the index, only iteration is possible.
+    static KmerStore *open(char *ptr, size_t filesize, char *index_ptr);
+    static bool needs_index(const char *ptr);
+
+    virtual const char *engine_name() = 0;
+    uint8_t get_k() const { return k; }   // how many nt are in each key?
+    virtual uint64_t get_key_ct() = 0;    // how many keys are there?
+
+    // Bin keys group k-mers by minimizer. bin_key_nt() is the minimizer
+    // length, or 0 if the engine ignores bin keys.
+    virtual uint8_t bin_key_nt() = 0;
+    virtual uint64_t bin_key_xor_mask() = 0;
+    virtual uint64_t bin_key(uint64_t kmer) = 0;
+
+    // Value ptr of a canonical k-mer w/ the bin key b_key, or NULL
+    virtual const uint32_t *lookup(uint64_t kmer, uint64_t b_key, QueryState &state) = 0;
+    // Look up n k-mers, storing value ptrs (or NULL) in results
+    virtual void lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                              size_t n, const uint32_t **results) = 0;
+
+    // Iteration over the pairs at positions 0 .. get_key_ct()-1
+    virtual uint64_t get_key(uint64_t pos) = 0;
+    virtual uint32_t get_value(uint64_t pos) = 0;
+    // Only for engines opened on writable memory
+    virtual void set_value(uint64_t pos, uint32_t val) = 0;
+
+    // Every pair has a distinct id in 0 .. pair_id_ct()-1, so that hits can
+    // be counted in a bitmap (see DBHits); it is the position of the pair
+    // unless the engine says otherwise.
+    virtual uint64_t pair_id_ct() { return get_key_ct(); }
+    // id of the pair of kmer; val_ptr is the value ptr returned for it by a
+    // lookup (in the loaded chunk)
+    virtual uint64_t pair_id(uint64_t kmer, const uint32_t *val_ptr) = 0;
+    virtual uint32_t pair_id_value(uint64_t id) { return get_value(id); }
+
+    // Chunk loading: only k-mers of the loaded chunk can be found by
+    // lookup_in_chunk(). Unchunked engines have one chunk that is always
+    // loaded.
+    virtual void prepare_chunking(const uint64_t max_bytes_for_db) { (void) max_bytes_for_db; }
+    virtual uint32_t chunks() const { return 1; }
+    virtual void load_chunk(const uint32_t db_chunk_id) { (void) db_chunk_id; }
+    virtual bool is_minimizer_in_chunk(const uint64_t minimizer, const uint32_t db_chunk_id) const {
+      (void) minimizer;
+      return db_chunk_id == 0;
+    }
+    // chunk containing the bin of minimizer, or chunks() if there is none
+    virtual uint32_t chunk_of_minimizer(const uint64_t minimizer) const {
+      (void) minimizer;
+      return 0;
+    }
+    virtual const uint32_t *lookup_in_chunk(uint64_t kmer, uint64_t b_key, QueryState &state) {
+      return lookup(kmer, b_key, state);
+    }
+
+    // return a count of k-mers for all taxons
+    virtual std::map<uint32_t,uint64_t> count_taxons() {
+      return count_values(get_key_ct(), [this](uint64_t pos) { return get_value(pos); });
+    }
+
+    // Code mostly from Jellyfish 1.6 source, rev. comp. of a k-mer with n nt.
+    // If n is not specified, use k in DB, otherwise use first n nt in kmer
+    static uint64_t reverse_complement(uint64_t kmer, uint8_t n) {
+      kmer = ((kmer >> 2)  & 0x3333333333333333UL) | ((kmer & 0x3333333333333333UL) << 2);
+      kmer = ((kmer >> 4)  & 0x0F0F0F0F0F0F0F0FUL) | ((kmer & 0x0F0F0F0F0F0F0F0FUL) << 4);
+      kmer = ((kmer >> 8)  & 0x00FF00FF00FF00FFUL) | ((kmer & 0x00FF00FF00FF00FFUL) << 8);
+      kmer = ((kmer >> 16) & 0x0000FFFF0000FFFFUL) | ((kmer & 0x0000FFFF0000FFFFUL) << 16);
+      kmer = ( kmer >> 32                        ) | ( kmer                         << 32);
+      return (((uint64_t)-1) - kmer) >> (8 * sizeof(kmer) - (n << 1));
+    }
+    uint64_t reverse_complement(uint64_t kmer) const {
+      return reverse_complement(kmer, k);
+    }
+
+    // Lexicographically smallest of k-mer and reverse comp. of k-mer
+    static uint64_t canonical_representation(uint64_t kmer, uint8_t n) {
+      uint64_t revcom = reverse_complement(kmer, n);
+      return kmer < revcom ? kmer : revcom;
+    }
+    uint64_t canonical_representation(uint64_t kmer) const {
+      return canonical_representation(kmer, k);
+    }
+
+    protected:
+    KmerStore() : k(0) {}
+    uint8_t k;
+
+    // Count of the values value_at(0 .. n-1), by a parallel scan: each
+    // thread counts in an array indexed by value (values from
+    // MAX_DENSE_VALUE on in a map), and the arrays are summed at the end.
+    static const uint32_t MAX_DENSE_VALUE = 1u << 24;
+    template <typename ValueAt>
+    static std::map<uint32_t,uint64_t> count_values(uint64_t n, ValueAt value_at) {
+      std::vector<uint64_t> counts;
+      std::map<uint32_t,uint64_t> taxon_counts;
+#ifdef _OPENMP
+      #pragma omp parallel
+#endif
+      {
+        std::vector<uint64_t> my_counts;
+        std::map<uint32_t,uint64_t> my_sparse_counts;
+#ifdef _OPENMP
+        #pragma omp for schedule(static)
+#endif
+        for (uint64_t i = 0; i < n; i++) {
+          uint32_t val = value_at(i);
+          if (val >= MAX_DENSE_VALUE) {
+            ++my_sparse_counts[val];
+            continue;
+          }
+          if (val >= my_counts.size())
+            my_counts.resize(std::max((size_t) val + 1, 2 * my_counts.size()));
+          ++my_counts[val];
+        }
+#ifdef _OPENMP
+        #pragma omp critical(count_values)
+#endif
+        {
+          if (counts.size() < my_counts.size())
+            counts.resize(my_counts.size());
+          for (size_t v = 0; v < my_counts.size(); v++)
+            counts[v] += my_counts[v];
+          for (auto it = my_sparse_counts.begin(); it != my_sparse_counts.end(); ++it)
+            taxon_counts[it->first] += it->second;
+        }
+      }
+      for (size_t v = counts.size(); v-- > 0; )
+        if (counts[v] != 0)
+          taxon_counts.insert(taxon_counts.begin(), std::make_pair((uint32_t) v, counts[v]));
+      return taxon_counts;
+    }
+  };
+}
+
+#endif
@@ -22,6 +22,7 @@
 #include "krakendb.hpp"
 #include "quickfile.hpp"
 #include <unordered_map>
+#include <algorithm>
 
 using std::string;
 using std::vector;
@@ -31,6 +32,12 @@ namespace kraken {
 // File type code for Jellyfish/Kraken DBs
 static const char * DATABASE_FILE_TYPE = "JFLISTDN";
 
+// File type code for Kraken DBs w/ blocked layout: same header as above,
+// followed by all keys as 64-bit ints and then all values, each array
+// starting on a cache line
+static const char * BLOCKED_DATABASE_FILE_TYPE = "KRAKBLK1";
+static const uint64_t CACHE_LINE_SIZE = 64;
+
 // File type code on Kraken DB index
 // Next byte determines # of indexed nt
 static const char * KRAKEN_INDEX_STRING = "KRAKIDX";
@@ -54,6 +61,11 @@ KrakenDB::KrakenDB() {
   key_bits = 0;
   k = 0;
   _filesize = 0;
+  blocked = false;
+  keys = NULL;
+  vals = NULL;
+  data = NULL;
+  data_size = 0;
 }
 
 // Assumes ptr points to start of a readable mmap'ed file
@@ -64,8 +76,11 @@ KrakenDB::KrakenDB(char *ptr, size_t filesize) {
   if (ptr == NULL) {
     errx(EX_DATAERR, "pointer is NULL");
   }
+  blocked = false;
   if (strncmp(ptr, DATABASE_FILE_TYPE, strlen(DATABASE_FILE_TYPE))) {
-    errx(EX_DATAERR,"database in improper format - found %s", string(ptr, strlen(DATABASE_FILE_TYPE)).c_str());
+    blocked = true;
+    if (strncmp(ptr, BLOCKED_DATABASE_FILE_TYPE, strlen(BLOCKED_DATABASE_FILE_TYPE)))
+      errx(EX_DATAERR,"database in improper format - found %s", string(ptr, strlen(DATABASE_FILE_TYPE)).c_str());
   }
   memcpy(&key_bits, ptr + 8, 8);
   memcpy(&val_len, ptr + 16, 8);
@@ -74,6 +89,10 @@ KrakenDB::KrakenDB(char *ptr, size_t filesize) {
     errx(EX_DATAERR, "can only handle 4 byte DB values");
   k = key_bits / 2;
   key_len = key_bits / 8 + !! (key_bits % 8);
+  keys = blocked ? (uint64_t *) (ptr + blocked_keys_offset()) : NULL;
+  vals = blocked ? (uint32_t *) (ptr + blocked_vals_offset()) : NULL;
+  data = NULL;
+  data_size = 0;
   std::cerr << "Loaded database with " << key_ct << " keys with k of " << (size_t)k << " [val_len " << val_len << ", key_len " << key_len << "]." << std::endl;
 }
 
@@ -88,56 +107,192 @@ size_t KrakenDB::filesize() const {
 
 //using std::map to have the keys sorted
 std::map<uint32_t,uint64_t> KrakenDB::count_taxons() {
-  char *ptr = get_pair_ptr();
-  size_t pair_sz = pair_size();
-
-  std::map<uint32_t, uint64_t> taxon_counts;
-  if (ptr == NULL) { 
-    std::cerr << "Kraken database pointer is NULL [pair_sz: " << pair_sz << ", key_ct: "<<key_ct<<", key_len: "<< key_len<<"]!" << std::endl;
+  if (fptr == NULL) { 
+    std::cerr << "Kraken database pointer is NULL [pair_sz: " << pair_size() << ", key_ct: "<<key_ct<<", key_len: "<< key_len<<"]!" << std::endl;
     exit(1);
   }
-  for (uint64_t i = 0; i < key_ct; i++) {
-    if (i % 10000000 == 1) {
-      fprintf(stderr, "\r %.2f %%", 100*(double)i/(double)key_ct );
-    }
-    uint32_t* taxon = (uint32_t *) (ptr + pair_sz * i + key_len);
-    if (taxon == NULL) {
-        std::cerr << "taxon is NULL (i is " << i << " and key_ct is " << key_ct << ")" << std::endl;
-    } else {
-        uint32_t taxon_i = *taxon;
-        ++taxon_counts[taxon_i];
+  if (blocked)
+    return count_values(key_ct, [this](uint64_t pos) { return vals[pos]; });
+  const char *values = get_pair_ptr() + key_len;
+  const uint64_t pair_sz = pair_size();
+  return count_values(key_ct, [values, pair_sz](uint64_t pos) {
+    uint32_t val;
+    memcpy(&val, values + pos * pair_sz, sizeof(val));
+    return val;
+  });
+}
+
+
+// Threads of the OpenMP team work on consecutive parts of [0, n)
+static void thread_range(uint64_t n, uint64_t &first, uint64_t &end) {
+  uint64_t t = 0, n_threads = 1;
+#ifdef _OPENMP
+  t = omp_get_thread_num();
+  n_threads = omp_get_num_threads();
+#endif
+  first = n * t / n_threads;
+  end = n * (t + 1) / n_threads;
+}
+
+// a[i] becomes the sum of a[0..i-1], a[n] the sum of all
+static void exclusive_prefix_sum(uint64_t *a, uint64_t n) {
+  int n_threads = 1;
+#ifdef _OPENMP
+  n_threads = omp_get_max_threads();
+#endif
+  vector<uint64_t> sums(n_threads + 1, 0);
+#ifdef _OPENMP
+  #pragma omp parallel num_threads(n_threads)
+#endif
+  {
+    int t = 0;
+#ifdef _OPENMP
+    t = omp_get_thread_num();
+#endif
+    uint64_t first, end;
+    thread_range(n, first, end);
+    uint64_t sum = 0;
+    for (uint64_t i = first; i < end; i++)
+      sum += a[i];
+    sums[t + 1] = sum;
+#ifdef _OPENMP
+    #pragma omp barrier
+#endif
+    sum = 0;
+    for (int u = 0; u <= t; u++)
+      sum += sums[u];
+    for (uint64_t i = first; i < end; i++) {
+      uint64_t count = a[i];
+      a[i] = sum;
+      sum += count;
     }
+    if (end == n)
+      a[n] = sum;
   }
-  fprintf(stderr, "\r");
-  return taxon_counts;
 }
 
-
-// Creates an index, indicating starting positions of each bin
-// Bins contain k-mer/taxon pairs with k-mers that share a bin key
-void KrakenDB::make_index(string index_filename, uint8_t nt) {
+// Finds the bin boundaries of a DB sorted by bin key. Returns false as soon
+// as a k-mer is found in a lower bin than its predecessor.
+bool KrakenDB::find_bin_boundaries(uint64_t *bin_offsets, uint8_t nt) {
   uint64_t entries = 1ull << (nt * 2);
-  vector<uint64_t> bin_counts(entries);
-  char *ptr = get_pair_ptr();
+  if (key_ct == 0) {
+    std::fill(bin_offsets, bin_offsets + entries + 1, 0);
+    return true;
+  }
+  bool sorted = true;
+#ifdef _OPENMP
+  #pragma omp parallel
+#endif
+  {
+    uint64_t first, end;
+    thread_range(key_ct, first, end);
+    // bins after the bin of the previous k-mer up to the current bin start here
+    uint64_t next_bin = first == 0 ? 0 : bin_key(get_key(first - 1), nt) + 1;
+    for (uint64_t i = first; i < end; i++) {
+      uint64_t b_key = bin_key(get_key(i), nt);
+      if (b_key + 1 < next_bin) {
+        __atomic_store_n(&sorted, false, __ATOMIC_RELAXED);
+        break;
+      }
+      while (next_bin <= b_key)
+        bin_offsets[next_bin++] = i;
+      if (i % 65536 == 0 && !__atomic_load_n(&sorted, __ATOMIC_RELAXED))
+        break;
+    }
+    if (end == key_ct && first < end) {
+      while (next_bin <= entries)
+        bin_offsets[next_bin++] = key_ct;
+    }
+  }
+  return sorted;
+}
 
+// Counts the k-mers of each bin. K-mers are processed in blocks. The bin
+// keys of a block are computed in parallel and grouped by ranges of bins,
+// using per-thread histograms of the ranges; each range of bins is then
+// counted by a single thread, w/o atomic operations.
+void KrakenDB::count_bins(uint64_t *bin_counts, uint8_t nt) {
+  uint64_t entries = 1ull << (nt * 2);
+  const uint64_t block_size = 1 << 22;
+  int n_threads = 1;
 #ifdef _OPENMP
-  #pragma omp parallel for schedule(dynamic,400)
+  n_threads = omp_get_max_threads();
 #endif
-  for (uint64_t i = 0; i < key_ct; i++) {
-    uint64_t kmer = 0;
-    memcpy(&kmer, ptr + i * pair_size(), key_len);
-    uint64_t b_key = bin_key(kmer, nt);
+  int range_shift = 0;
+  while ((entries >> range_shift) > (uint64_t) n_threads * 16)
+    ++range_shift;
+  uint64_t n_ranges = entries >> range_shift;
+  vector<uint64_t> b_keys(std::min(block_size, key_ct));
+  vector<uint64_t> grouped_b_keys(b_keys.size());
+  vector<vector<uint64_t> > cursors(n_threads, vector<uint64_t>(n_ranges));
+  vector<uint64_t> range_starts(n_ranges + 1);
+  memset(bin_counts, 0, entries * sizeof(*bin_counts));
+
+  for (uint64_t block_start = 0; block_start < key_ct; block_start += block_size) {
+    uint64_t n = std::min(block_size, key_ct - block_start);
 #ifdef _OPENMP
-    #pragma omp atomic
+    #pragma omp parallel num_threads(n_threads)
 #endif
-    bin_counts[b_key]++;
+    {
+      int t = 0;
+#ifdef _OPENMP
+      t = omp_get_thread_num();
+#endif
+      uint64_t first, end;
+      thread_range(n, first, end);
+      vector<uint64_t> &cursor = cursors[t];
+      std::fill(cursor.begin(), cursor.end(), 0);
+      for (uint64_t i = first; i < end; i++) {
+        b_keys[i] = bin_key(get_key(block_start + i), nt);
+        cursor[b_keys[i] >> range_shift]++;
+      }
+#ifdef _OPENMP
+      #pragma omp barrier
+      #pragma omp single
+#endif
+      {
+        uint64_t pos = 0;
+        for (uint64_t r = 0; r < n_ranges; r++) {
+          range_starts[r] = pos;
+          for (int u = 0; u < n_threads; u++) {
+            uint64_t count = cursors[u][r];
+            cursors[u][r] = pos;
+            pos += count;
+          }
+        }
+        range_starts[n_ranges] = pos;
+      }
+      for (uint64_t i = first; i < end; i++)
+        grouped_b_keys[cursor[b_keys[i] >> range_shift]++] = b_keys[i];
+#ifdef _OPENMP
+      #pragma omp barrier
+      #pragma omp for schedule(dynamic)
+#endif
+      for (uint64_t r = 0; r < n_ranges; r++) {
+        for (uint64_t i = range_starts[r]; i < range_starts[r+1]; i++)
+          bin_counts[grouped_b_keys[i]]++;
+      }
+    }
   }
+}
 
+// Creates an index, indicating starting positions of each bin
+// Bins contain k-mer/taxon pairs with k-mers that share a bin key
+void KrakenDB::make_index(string index_filename, uint8_t nt) {
+  uint64_t entries = 1ull << (nt * 2);
   uint64_t *bin_offsets = new uint64_t[ entries + 1 ];
-  bin_offsets[0] = 0;
-  for (uint64_t i = 1; i <= entries; i++)
-    bin_offsets[i] = bin_offsets[i-1] + bin_counts[i-1];
 
+  if (! find_bin_boundaries(bin_offsets, nt)) {
+    count_bins(bin_offsets, nt);
+    exclusive_prefix_sum(bin_offsets, entries);
+  }
+
+  write_index(index_filename, nt, bin_offsets);
+  delete[] bin_offsets;
+}
+
+void KrakenDB::write_index(string index_filename, uint8_t nt, const uint64_t *bin_offsets) {
+  uint64_t entries = 1ull << (nt * 2);
   QuickFile idx_file(index_filename, "w",
     strlen(KRAKEN_INDEX2_STRING) + 1 + sizeof(*bin_offsets) * (entries + 1));
   char *idx_ptr = idx_file.ptr();
@@ -147,14 +302,92 @@ void KrakenDB::make_index(string index_filename, uint8_t nt) {
   memcpy(idx_ptr, bin_offsets, sizeof(*bin_offsets) * (entries + 1));
 }
 
+// Only the fields used by Kraken are set, the hash matrices are zero
+std::string KrakenDB::make_header(uint8_t k, uint64_t key_ct) {
+  uint64_t key_bits = 2 * k;
+  uint64_t val_len = 4;
+  std::string header(72 + 2 * (4 + 8 * key_bits), '\0');
+  memcpy(&header[0], DATABASE_FILE_TYPE, strlen(DATABASE_FILE_TYPE));
+  memcpy(&header[8], &key_bits, 8);
+  memcpy(&header[16], &val_len, 8);
+  memcpy(&header[48], &key_ct, 8);
+  return header;
+}
+
+uint64_t KrakenDB::index2_xor_mask(uint8_t nt) {
+  return INDEX2_XOR_MASK & ((1ull << (nt * 2)) - 1);
+}
+
 // Simple accessor
 char *KrakenDB::get_ptr() {
   return fptr;
 }
 
 // Returns start of k-mer/taxon pair array (skips header)
+// There is no pair array in the blocked layout, see get_key()/get_value_ptr()
 char *KrakenDB::get_pair_ptr() {
-  return fptr == NULL ? NULL : fptr + header_size();
+  return fptr == NULL || blocked ? NULL : fptr + header_size();
+}
+
+bool KrakenDB::is_blocked() { return blocked; }
+
+// Key of the pair at position pos
+uint64_t KrakenDB::get_key(uint64_t pos) {
+  if (blocked)
+    return keys[pos];
+  uint64_t key = 0;
+  memcpy(&key, get_pair_ptr() + pos * pair_size(), key_len);
+  return key & ((1ull << key_bits) - 1);
+}
+
+// Value of the pair at position pos
+uint32_t *KrakenDB::get_value_ptr(uint64_t pos) {
+  if (blocked)
+    return vals + pos;
+  return (uint32_t *) (get_pair_ptr() + pos * pair_size() + key_len);
+}
+
+uint32_t KrakenDB::get_value(uint64_t pos) {
+  return *get_value_ptr(pos);
+}
+
+void KrakenDB::set_value(uint64_t pos, uint32_t val) {
+  *get_value_ptr(pos) = val;
+}
+
+// The id of a pair is its position. Value ptrs into a loaded chunk are
+// relative to the first pair of the chunk.
+uint64_t KrakenDB::pair_id(uint64_t kmer, const uint32_t *val_ptr) {
+  (void) kmer;
+  const char *p = (const char *) val_ptr;
+  if (data != NULL && p >= data && p < data + data_size) {
+    uint64_t first = data_offset / pair_size();
+    if (blocked)
+      return first + (val_ptr - chunk_vals);
+    return first + (p - key_len - data) / pair_size();
+  }
+  if (blocked)
+    return val_ptr - vals;
+  return (p - key_len - get_pair_ptr()) / pair_size();
+}
+
+static uint64_t round_to_cache_line(uint64_t offset) {
+  return (offset + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+}
+
+// File offsets of the key and value arrays in the blocked layout
+uint64_t KrakenDB::blocked_keys_offset() {
+  return round_to_cache_line(header_size());
+}
+
+uint64_t KrakenDB::blocked_vals_offset() {
+  return round_to_cache_line(blocked_keys_offset() + key_ct * sizeof(uint64_t));
+}
+
+std::string KrakenDB::blocked_header() {
+  std::string header(BLOCKED_DATABASE_FILE_TYPE);
+  header.append(fptr + header.size(), header_size() - header.size());
+  return header;
 }
 
 // Simple accessor
@@ -167,13 +400,17 @@ void KrakenDB::set_index(KrakenDBIndex *i_ptr) {
   index_ptr = i_ptr;
 }
 
+void KrakenDB::set_index(char *idx_ptr) {
+  own_index = KrakenDBIndex(idx_ptr);
+  index_ptr = &own_index;
+}
+
 // Simple accessors/convenience methods
-uint8_t KrakenDB::get_k() { return k; }
 uint64_t KrakenDB::get_key_bits() { return key_bits; }
 uint64_t KrakenDB::get_key_len() { return key_len; }
 uint64_t KrakenDB::get_val_len() { return val_len; }
 uint64_t KrakenDB::get_key_ct() { return key_ct; }
-uint64_t KrakenDB::pair_size() { return key_len + val_len; }
+uint64_t KrakenDB::pair_size() { return (blocked ? sizeof(uint64_t) : key_len) + val_len; }
 size_t KrakenDB::header_size() { return 72 + 2 * (4 + 8 * key_bits); }
 
 // Bin key: each k-mer is made of several overlapping m-mers, m < k
@@ -182,7 +419,7 @@ size_t KrakenDB::header_size() { return 72 + 2 * (4 + 8 * key_bits); }
 uint64_t KrakenDB::bin_key(uint64_t kmer, uint64_t idx_nt) {
   uint8_t nt = idx_nt;
   uint64_t xor_mask = INDEX2_XOR_MASK;
-  uint64_t mask = 1 << (nt * 2);
+  uint64_t mask = 1ull << (nt * 2);
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
@@ -201,7 +438,7 @@ uint64_t KrakenDB::bin_key(uint64_t kmer) {
   uint8_t nt = index_ptr->indexed_nt();
   uint8_t idx_type = index_ptr->index_type();
   uint64_t xor_mask = idx_type == 1 ? 0 : INDEX2_XOR_MASK;
-  uint64_t mask = 1 << (nt * 2);
+  uint64_t mask = 1ull << (nt * 2);
   mask--;
   xor_mask &= mask;
   uint64_t min_bin_key = ~0;
@@ -214,35 +451,8 @@ uint64_t KrakenDB::bin_key(uint64_t kmer) {
   return min_bin_key;
 }
 
-// Code mostly from Jellyfish 1.6 source
-uint64_t KrakenDB::reverse_complement(uint64_t kmer, uint8_t n) {
-  kmer = ((kmer >> 2)  & 0x3333333333333333UL) | ((kmer & 0x3333333333333333UL) << 2);
-  kmer = ((kmer >> 4)  & 0x0F0F0F0F0F0F0F0FUL) | ((kmer & 0x0F0F0F0F0F0F0F0FUL) << 4);
-  kmer = ((kmer >> 8)  & 0x00FF00FF00FF00FFUL) | ((kmer & 0x00FF00FF00FF00FFUL) << 8);
-  kmer = ((kmer >> 16) & 0x0000FFFF0000FFFFUL) | ((kmer & 0x0000FFFF0000FFFFUL) << 16);
-  kmer = ( kmer >> 32                        ) | ( kmer                         << 32);
-  return (((uint64_t)-1) - kmer) >> (8 * sizeof(kmer) - (n << 1));
-}
-
-// Code mostly from Jellyfish 1.6 source
-uint64_t KrakenDB::reverse_complement(uint64_t kmer) {
-  kmer = ((kmer >> 2)  & 0x3333333333333333UL) | ((kmer & 0x3333333333333333UL) << 2);
-  kmer = ((kmer >> 4)  & 0x0F0F0F0F0F0F0F0FUL) | ((kmer & 0x0F0F0F0F0F0F0F0FUL) << 4);
-  kmer = ((kmer >> 8)  & 0x00FF00FF00FF00FFUL) | ((kmer & 0x00FF00FF00FF00FFUL) << 8);
-  kmer = ((kmer >> 16) & 0x0000FFFF0000FFFFUL) | ((kmer & 0x0000FFFF0000FFFFUL) << 16);
-  kmer = ( kmer >> 32                        ) | ( kmer                         << 32);
-  return (((uint64_t)-1) - kmer) >> (8 * sizeof(kmer) - (k << 1));
-}
-
-// Lexicographically smallest of k-mer and reverse comp. of k-mer
-uint64_t KrakenDB::canonical_representation(uint64_t kmer, uint8_t n) {
-  uint64_t revcom = reverse_complement(kmer, n);
-  return kmer < revcom ? kmer : revcom;
-}
-
-uint64_t KrakenDB::canonical_representation(uint64_t kmer) {
-  uint64_t revcom = reverse_complement(kmer, k);
-  return kmer < revcom ? kmer : revcom;
+uint64_t KrakenDB::bin_key_xor_mask() {
+  return index_ptr->index_type() == 1 ? 0 : index2_xor_mask(index_ptr->indexed_nt());
 }
 
 // perform search over last range to speed up queries
@@ -251,11 +461,8 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t *last_bin_key,
                                int64_t *min_pos, int64_t *max_pos,
                                bool retry_on_failure)
 {
-  int64_t min, max, mid;
-  uint64_t comp_kmer;
+  int64_t min, max;
   uint64_t b_key;
-  char *ptr = get_pair_ptr();
-  size_t pair_sz = pair_size();
 
   // Use provided values if they exist and are valid
   if (retry_on_failure && *min_pos <= *max_pos) {
@@ -276,29 +483,10 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t *last_bin_key,
     }
   }
 
-  // Binary search with large window
-  while (min + 15 <= max) {
-    mid = min + (max - min) / 2;
-    comp_kmer = 0;
-    memcpy(&comp_kmer, ptr + pair_sz * mid, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer > comp_kmer)
-      min = mid + 1;
-    else if (kmer < comp_kmer)
-      max = mid - 1;
-    else
-      return (uint32_t *) (ptr + pair_sz * mid + key_len);
-  }
-  // Linear search once window shrinks
-  for (mid = min; mid <= max; mid++) {
-    comp_kmer = 0;
-    memcpy(&comp_kmer, ptr + pair_sz * mid, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer == comp_kmer)
-      return (uint32_t *) (ptr + pair_sz * mid + key_len);
-  }
+  uint32_t *answer = search_bin(kmer, min, max);
+  if (answer != NULL)
+    return answer;
 
-  uint32_t *answer = NULL;
   // ROF implies the provided values might be out of date
   // If they are, we'll update them and search again
   if (retry_on_failure) {
@@ -325,16 +513,88 @@ uint32_t *KrakenDB::kmer_query(uint64_t kmer) {
   return kmer_query(kmer, NULL, NULL, NULL, false);
 }
 
+// Search w/in the bin of a precomputed bin key
+uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t b_key) {
+  return search_bin(kmer, index_ptr->at(b_key), index_ptr->at(b_key + 1) - 1);
+}
+
+// As above, but reuse the last range when the bin key is unchanged
+// (bin keys are not recomputed, hence no retry is necessary)
+uint32_t *KrakenDB::kmer_query(uint64_t kmer, uint64_t b_key,
+                               uint64_t *last_bin_key,
+                               int64_t *min_pos, int64_t *max_pos)
+{
+  if (b_key != *last_bin_key || *min_pos > *max_pos) {
+    *last_bin_key = b_key;
+    *min_pos = index_ptr->at(b_key);
+    *max_pos = index_ptr->at(b_key + 1) - 1;
+  }
+  return search_bin(kmer, *min_pos, *max_pos);
+}
+
+const char *KrakenDB::engine_name() {
+  return blocked ? "sorted (blocked)" : "sorted (pairs)";
+}
+
+uint8_t KrakenDB::bin_key_nt() {
+  return index_ptr->indexed_nt();
+}
+
+const uint32_t *KrakenDB::lookup(uint64_t kmer, uint64_t b_key, QueryState &state) {
+  return kmer_query(kmer, b_key, &state.last_bin_key, &state.min_pos, &state.max_pos);
+}
+
+const uint32_t *KrakenDB::lookup_in_chunk(uint64_t kmer, uint64_t b_key, QueryState &state) {
+  return kmer_query_with_db_chunks(kmer, b_key, &state.last_bin_key, &state.min_pos, &state.max_pos);
+}
+
+// How many k-mers ahead of the current one are prefetched. Index entries
+// are requested BATCH_PREFETCH_DIST k-mers ahead, the bins half as far
+// ahead, when their index entries should have arrived.
+static const size_t BATCH_PREFETCH_DIST = 16;
+
+void KrakenDB::prefetch_bin(uint64_t b_key) {
+  uint64_t min = index_ptr->at(b_key);
+  uint64_t max = index_ptr->at(b_key + 1);
+  if (min >= max)
+    return;
+  if (blocked) {
+    // interpolation search starts w/ reading both ends of the bin
+    __builtin_prefetch(keys + min);
+    __builtin_prefetch(keys + max - 1);
+  } else {
+    __builtin_prefetch(get_pair_ptr() + pair_size() * (min + (max - min) / 2));
+  }
+}
+
+void KrakenDB::lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                            size_t n, const uint32_t **results)
+{
+  uint64_t *index_array = index_ptr->get_array();
+  const size_t half_dist = BATCH_PREFETCH_DIST / 2;
+  for (size_t i = 0; i < n && i < BATCH_PREFETCH_DIST; i++)
+    __builtin_prefetch(index_array + b_keys[i]);
+  for (size_t i = 0; i < n && i < half_dist; i++)
+    prefetch_bin(b_keys[i]);
+
+  for (size_t i = 0; i < n; i++) {
+    if (i + BATCH_PREFETCH_DIST < n)
+      __builtin_prefetch(index_array + b_keys[i + BATCH_PREFETCH_DIST]);
+    if (i + half_dist < n)
+      prefetch_bin(b_keys[i + half_dist]);
+    results[i] = search_bin(kmers[i], index_array[b_keys[i]],
+                            index_array[b_keys[i] + 1] - 1);
+  }
+}
+
 // perform search over last range to speed up queries
 // NOTE: retry_on_failure implies all pointer params are non-NULL
 uint32_t *KrakenDB::kmer_query_with_db_chunks(uint64_t kmer, uint64_t *last_bin_key,
                                int64_t *min_pos, int64_t *max_pos,
                                bool retry_on_failure)
 {
-  int64_t min, max, mid;
-  uint64_t comp_kmer;
+  int64_t min, max;
   uint64_t b_key;
-  size_t pair_sz = pair_size();
 
   // Use provided values if they exist and are valid
   if (retry_on_failure && *min_pos <= *max_pos) {
@@ -355,29 +615,10 @@ uint32_t *KrakenDB::kmer_query_with_db_chunks(uint64_t kmer, uint64_t *last_bin_
     }
   }
 
-  // Binary search with large window
-  while (min + 15 <= max) {
-    mid = min + (max - min) / 2;
-    comp_kmer = 0;
-    memcpy(&comp_kmer, data + pair_sz * mid - data_offset, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer > comp_kmer)
-      min = mid + 1;
-    else if (kmer < comp_kmer)
-      max = mid - 1;
-    else
-      return (uint32_t *) (data + pair_sz * mid - data_offset + key_len);
-  }
-  // Linear search once window shrinks
-  for (mid = min; mid <= max; mid++) {
-    comp_kmer = 0;
-    memcpy(&comp_kmer, data + pair_sz * mid - data_offset, key_len);
-    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
-    if (kmer == comp_kmer)
-      return (uint32_t *) (data + pair_sz * mid - data_offset + key_len);
-  }
+  uint32_t *answer = search_bin(kmer, min, max, true);
+  if (answer != NULL)
+    return answer;
 
-  uint32_t *answer = NULL;
   // ROF implies the provided values might be out of date
   // If they are, we'll update them and search again
   if (retry_on_failure) {
@@ -404,15 +645,123 @@ uint32_t *KrakenDB::kmer_query_with_db_chunks(uint64_t kmer) {
   return kmer_query_with_db_chunks(kmer, NULL, NULL, NULL, false);
 }
 
+// Search w/in the bin of a precomputed bin key - the bin must be part of
+// the loaded chunk
+uint32_t *KrakenDB::kmer_query_with_db_chunks(uint64_t kmer, uint64_t b_key,
+                                              uint64_t *last_bin_key,
+                                              int64_t *min_pos, int64_t *max_pos)
+{
+  if (b_key != *last_bin_key || *min_pos > *max_pos) {
+    *last_bin_key = b_key;
+    *min_pos = index_ptr->at_with_db_chunks(b_key);
+    *max_pos = index_ptr->at_with_db_chunks(b_key + 1) - 1;
+  }
+  return search_bin(kmer, *min_pos, *max_pos, true);
+}
+
+// Search w/in positions min..max of the DB, or of the loaded chunk
+uint32_t *KrakenDB::search_bin(uint64_t kmer, int64_t min, int64_t max, bool in_chunk) {
+  int64_t first = in_chunk ? data_offset / pair_size() : 0;
+  if (blocked) {
+    uint64_t *bin_keys = in_chunk ? chunk_keys : keys;
+    uint32_t *bin_vals = in_chunk ? chunk_vals : vals;
+    return search_blocked_bin(kmer, bin_keys, bin_vals, min - first, max - first);
+  }
+  char *pairs = in_chunk ? data : get_pair_ptr();
+  return search_pair_bin(kmer, pairs, min - first, max - first);
+}
+
+// Interpolation search over the keys of the blocked layout. K-mers in a bin
+// are close to uniformly distributed, so the position of kmer is estimated
+// from the closest keys known to be smaller and larger. Bisection is used
+// if that does not converge quickly, and a linear scan once the remaining
+// keys fit in a cache line.
+uint32_t *KrakenDB::search_blocked_bin(uint64_t kmer, const uint64_t *bin_keys,
+                                       uint32_t *bin_vals, int64_t min, int64_t max) {
+  if (min > max || kmer < bin_keys[min] || kmer > bin_keys[max])
+    return NULL;
+  if (kmer == bin_keys[min])
+    return bin_vals + min;
+  if (kmer == bin_keys[max])
+    return bin_vals + max;
+
+  // invariant: bin_keys[min] < kmer < bin_keys[max]
+  uint64_t min_key = bin_keys[min], max_key = bin_keys[max];
+  int probes = 0;
+  while (max - min > (int64_t) (CACHE_LINE_SIZE / sizeof(uint64_t))) {
+    int64_t mid;
+    if (probes++ < 4)
+      mid = min + 1 + (int64_t) ((double) (kmer - min_key) / (double) (max_key - min_key) * (max - min - 1));
+    else
+      mid = min + (max - min) / 2;
+    if (mid >= max)
+      mid = max - 1;
+    uint64_t mid_key = bin_keys[mid];
+    if (mid_key < kmer) {
+      min = mid;
+      min_key = mid_key;
+    }
+    else if (mid_key > kmer) {
+      max = mid;
+      max_key = mid_key;
+    }
+    else
+      return bin_vals + mid;
+  }
+  for (int64_t i = min + 1; i < max && bin_keys[i] <= kmer; i++) {
+    if (bin_keys[i] == kmer)
+      return bin_vals + i;
+  }
+  return NULL;
+}
+
+// Binary search with large window, linear search once window shrinks
+uint32_t *KrakenDB::search_pair_bin(uint64_t kmer, char *pairs, int64_t min, int64_t max) {
+  int64_t mid;
+  uint64_t comp_kmer;
+  size_t pair_sz = pair_size();
+
+  while (min + 15 <= max) {
+    mid = min + (max - min) / 2;
+    comp_kmer = 0;
+    memcpy(&comp_kmer, pairs + pair_sz * mid, key_len);
+    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
+    if (kmer > comp_kmer)
+      min = mid + 1;
+    else if (kmer < comp_kmer)
+      max = mid - 1;
+    else
+      return (uint32_t *) (pairs + pair_sz * mid + key_len);
+  }
+  for (mid = min; mid <= max; mid++) {
+    comp_kmer = 0;
+    memcpy(&comp_kmer, pairs + pair_sz * mid, key_len);
+    comp_kmer &= (1ull << key_bits) - 1;  // trim any excess
+    if (kmer == comp_kmer)
+      return (uint32_t *) (pairs + pair_sz * mid + key_len);
+  }
+  return NULL;
+}
+
 uint32_t KrakenDB::chunks() const {
   return this->_chunks;
 }
 
 void KrakenDB::load_chunk(const uint32_t db_chunk_id) {
-  char* db_chunk_start = get_pair_ptr() + dbx_chunk_bounds[db_chunk_id] * pair_size();
   data_offset = dbx_chunk_bounds[db_chunk_id] * pair_size();
   const size_t db_chunk_len = (dbx_chunk_bounds[db_chunk_id + 1] - dbx_chunk_bounds[db_chunk_id]) * pair_size();
-  memcpy(data, db_chunk_start, db_chunk_len);
+  if (blocked) {
+    // keys of the chunk, followed by its values
+    const uint64_t first = dbx_chunk_bounds[db_chunk_id];
+    const uint64_t n = dbx_chunk_bounds[db_chunk_id + 1] - first;
+    chunk_keys = (uint64_t *) data;
+    chunk_vals = (uint32_t *) (data + n * sizeof(uint64_t));
+    memcpy(chunk_keys, keys + first, n * sizeof(uint64_t));
+    memcpy(chunk_vals, vals + first, n * sizeof(uint32_t));
+  } else {
+    char* db_chunk_start = get_pair_ptr() + data_offset;
+    memcpy(data, db_chunk_start, db_chunk_len);
+  }
 
   char* id_chunk_start = index_ptr->fptr + strlen(KRAKEN_INDEX_STRING) + 1 + (idx_chunk_bounds[db_chunk_id] * 8);
   index_ptr->data_offset = idx_chunk_bounds[db_chunk_id] * 8;
@@ -493,8 +842,9 @@ void KrakenDB::prepare_chunking(const uint64_t max_bytes_for_db) {
     // printf("- %" PRIu64 ": %s\n", idx_size + dbx_size, (idx_size + dbx_size <= data_size ? "ok" : "NOT OK, does not fit into data"));
 
     // especially the last chunk can have 0 k-mers but a huge part of minimizers in it (that did not occur in any k-mer in the database)
-    // in that case we can skip that chunk!
-    if (dbx_pos == dbx_chunk_bounds.back())
+    // in that case we can skip that chunk! Empty chunks before it are kept, though: the next chunk would
+    // otherwise start at the skipped minimizers, and its index would not fit into "data" anymore
+    if (dbx_pos == dbx_chunk_bounds.back() && idx_pos == max_idx_pos)
       continue;
 
     idx_chunk_bounds.push_back(idx_pos);
@@ -525,6 +875,14 @@ bool KrakenDB::is_minimizer_in_chunk(const uint64_t minimizer, const uint32_t db
     return idx_chunk_bounds[db_chunk_id] <= minimizer && minimizer < idx_chunk_bounds[db_chunk_id + 1];
 }
 
+uint32_t KrakenDB::chunk_of_minimizer(const uint64_t minimizer) const {
+  std::vector<uint64_t>::const_iterator it =
+    std::upper_bound(idx_chunk_bounds.begin(), idx_chunk_bounds.end(), minimizer);
+  if (it == idx_chunk_bounds.begin() || it == idx_chunk_bounds.end())
+    return _chunks;
+  return it - idx_chunk_bounds.begin() - 1;
+}
+
 KrakenDBIndex::KrakenDBIndex() {
   fptr = NULL;
   idx_type = 1;
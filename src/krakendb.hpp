@@ -21,6 +21,7 @@
 #define KRAKENDB_HPP
 
 #include "kraken_headers.hpp"
+#include "kmerstore.hpp"
 #include <unordered_map>
 #include <map>
 
@@ -52,13 +53,16 @@ namespace kraken {
     uint64_t data_offset;
   };
 
-  class KrakenDB {
+  // Engine of k-mers sorted by minimizer bin, w/ an index of the bins
+  class KrakenDB : public KmerStore {
     public:
 
     char *get_ptr();            // Return the file pointer
     char *get_pair_ptr();       // Return pointer to start of pairs
+    bool is_blocked();          // keys and values stored separately?
+    uint64_t get_key(uint64_t pos);        // key of pair at position pos
+    uint32_t *get_value_ptr(uint64_t pos); // value of pair at position pos
     KrakenDBIndex *get_index(); // Return ptr to assoc'd index obj
-    uint8_t get_k();            // how many nt are in each key?
     uint64_t get_key_bits();    // how many bits are in each key?
     uint64_t get_key_len();     // how many bytes does each key occupy?
     uint64_t get_val_len();     // how many bytes does each value occupy?
@@ -73,6 +77,18 @@ namespace kraken {
                          int64_t *min_pos, int64_t *max_pos,
                          bool retry_on_failure=true);
 
+    // search the bin of a precomputed bin key (e.g. KmerScanner::minimizer())
+    // the range of the last bin is reused if the bin key did not change
+    uint32_t *kmer_query(uint64_t kmer, uint64_t b_key);
+    uint32_t *kmer_query(uint64_t kmer, uint64_t b_key, uint64_t *last_bin_key,
+                         int64_t *min_pos, int64_t *max_pos);
+
+    // Look up n k-mers w/ precomputed bin keys, storing value ptrs (or NULL)
+    // in results. The index entries and bins of upcoming k-mers are
+    // prefetched, so that several lookups are in flight at any time.
+    void lookup_batch(const uint64_t *kmers, const uint64_t *b_keys,
+                      size_t n, const uint32_t **results);
+
     uint32_t *kmer_query_with_db_chunks(uint64_t kmer);  // return ptr to pair w/ kmer
 
     // perform search over last range to speed up queries
@@ -80,6 +96,10 @@ namespace kraken {
                                         int64_t *min_pos, int64_t *max_pos,
                                         bool retry_on_failure=true);
 
+    // search the bin of a precomputed bin key in the loaded chunk
+    uint32_t *kmer_query_with_db_chunks(uint64_t kmer, uint64_t b_key, uint64_t *last_bin_key,
+                                        int64_t *min_pos, int64_t *max_pos);
+
     // return a count of k-mers for all taxons
     std::map<uint32_t,uint64_t> count_taxons();
     
@@ -88,19 +108,36 @@ namespace kraken {
     uint64_t bin_key(uint64_t kmer, uint64_t idx_nt);
     uint64_t bin_key(uint64_t kmer);
 
-    // Code from Jellyfish, rev. comp. of a k-mer with n nt.
-    // If n is not specified, use k in DB, otherwise use first n nt in kmer
-    uint64_t reverse_complement(uint64_t kmer, uint8_t n);
-    uint64_t reverse_complement(uint64_t kmer);
+    // XOR mask applied to canonical m-mers to get bin keys of the index
+    uint64_t bin_key_xor_mask();
 
-    // Return lexicographically smallest of kmer/revcom(kmer)
-    // If n is not specified, use k in DB, otherwise use first n nt in kmer
-    uint64_t canonical_representation(uint64_t kmer, uint8_t n);
-    uint64_t canonical_representation(uint64_t kmer);
+    // KmerStore interface
+    const char *engine_name();
+    uint8_t bin_key_nt();
+    const uint32_t *lookup(uint64_t kmer, uint64_t b_key, QueryState &state);
+    const uint32_t *lookup_in_chunk(uint64_t kmer, uint64_t b_key, QueryState &state);
+    uint32_t get_value(uint64_t pos);
+    void set_value(uint64_t pos, uint32_t val);
+    uint64_t pair_id(uint64_t kmer, const uint32_t *val_ptr);
 
     void make_index(std::string index_filename, uint8_t nt);
+    // Write an index (v2) w/ the given 4^nt+1 bin offsets
+    static void write_index(std::string index_filename, uint8_t nt, const uint64_t *bin_offsets);
+
+    // Header of a DB (Jellyfish format) w/ key_ct k-mers and 4-byte values
+    static std::string make_header(uint8_t k, uint64_t key_ct);
+    // XOR mask of the bin keys of a v2 index w/ nt-mers
+    static uint64_t index2_xor_mask(uint8_t nt);
+
+    // Header of this DB for the blocked layout (keys and values in separate,
+    // cache-line aligned arrays at the file offsets below)
+    std::string blocked_header();
+    uint64_t blocked_keys_offset();
+    uint64_t blocked_vals_offset();
 
     void set_index(KrakenDBIndex *i_ptr);
+    // use an index owned by this DB, at the mmap'ed file ptr
+    void set_index(char *idx_ptr);
 
     size_t filesize() const;
 
@@ -116,13 +153,15 @@ namespace kraken {
     void load_chunk(const uint32_t db_chunk_id);
     void prepare_chunking(const uint64_t max_bytes_for_db);
     bool is_minimizer_in_chunk(const uint64_t minimizer, const uint32_t db_chunk_id) const;
+    // chunk containing the bin of minimizer, or chunks() if there is none
+    uint32_t chunk_of_minimizer(const uint64_t minimizer) const;
 
     private:
 
     size_t _filesize;
     char *fptr;
     KrakenDBIndex *index_ptr;
-    uint8_t k;
+    KrakenDBIndex own_index;
     uint64_t key_bits;
     uint64_t key_len;
     uint64_t val_len;
@@ -130,6 +169,24 @@ namespace kraken {
 
     uint64_t upper_bound(const uint64_t first, const uint64_t last);
 
+    // search for kmer in positions min..max (inclusive) of a bin
+    uint32_t *search_bin(uint64_t kmer, int64_t min, int64_t max, bool in_chunk = false);
+    uint32_t *search_pair_bin(uint64_t kmer, char *pairs, int64_t min, int64_t max);
+    uint32_t *search_blocked_bin(uint64_t kmer, const uint64_t *bin_keys, uint32_t *bin_vals,
+                                 int64_t min, int64_t max);
+
+    void prefetch_bin(uint64_t b_key);
+
+    // see make_index()
+    bool find_bin_boundaries(uint64_t *bin_offsets, uint8_t nt);
+    void count_bins(uint64_t *bin_counts, uint8_t nt);
+
+    bool blocked;
+    uint64_t *keys;  // blocked layout only
+    uint32_t *vals;
+    uint64_t *chunk_keys;
+    uint32_t *chunk_vals;
+
     uint32_t _chunks;
     std::vector<uint64_t> idx_chunk_bounds;
     std::vector<uint64_t> dbx_chunk_bounds;
@@ -222,6 +222,51 @@ namespace kraken {
     loaded_nt = 0;
     if (pos2 - pos1 + 1 < k)
       curr_pos = pos2;
+
+    mmer_nt = 0;
+    mmer_mask = 0;
+    mmer_xor_mask = 0;
+    fwd_mmer = 0;
+    rev_mmer = 0;
+    n_shifted = 0;
+    deque_head = 0;
+    deque_size = 0;
+  }
+
+  void KmerScanner::track_minimizers(uint8_t nt, uint64_t xor_mask) {
+    if (nt == 0 || nt > k || k - nt + 1 > 32)
+      errx(EX_SOFTWARE, "KmerScanner can't track minimizers of length %u with k of %u",
+           (unsigned) nt, (unsigned) k);
+    mmer_nt = nt;
+    mmer_mask = nt == 32 ? ~0ull : (1ull << (nt * 2)) - 1;
+    mmer_xor_mask = xor_mask & mmer_mask;
+  }
+
+  // Add the m-mer ending at the nt that was just shifted into kmer, and drop
+  // m-mers from the front of the deque that are no longer part of the k-mer
+  inline void KmerScanner::push_mmer(uint64_t nt_code) {
+    fwd_mmer = ((fwd_mmer << 2) | nt_code) & mmer_mask;
+    rev_mmer = (rev_mmer >> 2) | ((3 - nt_code) << (2 * (mmer_nt - 1)));
+    if (++n_shifted < mmer_nt)
+      return;
+
+    uint64_t value = mmer_xor_mask ^ (fwd_mmer < rev_mmer ? fwd_mmer : rev_mmer);
+    while (deque_size > 0 && deque_vals[(deque_head + deque_size - 1) & 31] >= value)
+      deque_size--;
+    uint8_t back = (deque_head + deque_size) & 31;
+    deque_vals[back] = value;
+    deque_pos[back] = n_shifted;
+    deque_size++;
+
+    uint64_t window = k - mmer_nt + 1;
+    while (deque_pos[deque_head] + window <= n_shifted) {
+      deque_head = (deque_head + 1) & 31;
+      deque_size--;
+    }
+  }
+
+  uint64_t KmerScanner::minimizer() {
+    return deque_vals[deque_head];
   }
 
   uint8_t KmerScanner::get_k() { return k; }
@@ -273,6 +318,8 @@ namespace kraken {
       }
       kmer &= kmer_mask;
       ambig &= mini_kmer_mask;
+      if (mmer_nt)
+        push_mmer(kmer & 3);
     }
     return &kmer;
   }
@@ -51,6 +51,14 @@ uint32_t lca(const std::unordered_map<uint32_t, uint32_t> &parent_map, uint32_t
     uint64_t *next_kmer();  // NULL when seq exhausted
     bool ambig_kmer();  // does last returned kmer have non-ACGT?
 
+    // Rolling minimizer mode: keep track of the XOR-scrambled canonical
+    // nt-mers while scanning, so that the bin key of every k-mer is
+    // available in amortized O(1) (same value as KrakenDB::bin_key()).
+    // Must be called before the first invocation of next_kmer().
+    void track_minimizers(uint8_t nt, uint64_t xor_mask);
+    // bin key of last returned kmer (undefined if ambig_kmer())
+    uint64_t minimizer();
+
 
     static uint8_t get_k();
     // MUST be called before first invocation of KmerScanner()
@@ -63,6 +71,18 @@ uint32_t lca(const std::unordered_map<uint32_t, uint32_t> &parent_map, uint32_t
     uint32_t ambig; // is there an ambiguous nucleotide in the kmer?
     int64_t loaded_nt;
 
+    void push_mmer(uint64_t nt_code);
+
+    // minimizer state: monotone deque over the m-mers of the current k-mer,
+    // kept in a ring buffer (a k-mer never has more than 32 m-mers)
+    uint8_t mmer_nt;  // 0 if minimizers are not tracked
+    uint64_t mmer_mask, mmer_xor_mask;
+    uint64_t fwd_mmer, rev_mmer;
+    uint64_t n_shifted;  // number of nt shifted into kmer
+    uint64_t deque_vals[32];
+    uint64_t deque_pos[32];
+    uint8_t deque_head, deque_size;
+
     static uint8_t k;  // init. to 0 b/c static
     static uint64_t kmer_mask;
     static uint32_t mini_kmer_mask;
@@ -20,6 +20,10 @@
 
 #include "kraken_headers.hpp"
 #include "quickfile.hpp"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
 using std::string;
 
@@ -30,6 +34,9 @@ QuickFile::QuickFile() {
   fptr = NULL;
   filesize = 0;
   fd = -1;
+  writable = false;
+  anonymous = false;
+  map_size = 0;
 }
 
 QuickFile::QuickFile(string filename_str, string mode, size_t size) {
@@ -75,6 +82,74 @@ void QuickFile::open_file(string filename_str, string mode, size_t size) {
   if (fptr == MAP_FAILED)
     err(EX_OSERR, "unable to mmap %s", filename);
   valid = true;
+  writable = mode != "r";
+  anonymous = false;
+  map_size = filesize;
+}
+
+// Interleave pages of [addr, addr+len) across all NUMA nodes we may use
+static void interleave_memory(char *addr, size_t len) {
+#ifdef __linux__
+  const unsigned long max_node = 1024;
+  unsigned long node_mask[max_node / (8 * sizeof(unsigned long))];
+  memset(node_mask, 0, sizeof(node_mask));
+  if (syscall(SYS_get_mempolicy, NULL, node_mask, max_node, NULL, MPOL_F_MEMS_ALLOWED) != 0 ||
+      syscall(SYS_mbind, addr, len, MPOL_INTERLEAVE, node_mask, max_node, 0) != 0)
+    warn("unable to interleave memory across NUMA nodes");
+#else
+  (void) addr; (void) len;
+  warnx("NUMA interleaving is only supported on Linux");
+#endif
+}
+
+void QuickFile::copy_to_memory(bool huge_pages, bool numa_interleave) {
+  if (writable)
+    errx(EX_SOFTWARE, "only files opened read-only can be copied to memory");
+  if (anonymous)
+    return;
+
+  const size_t huge_page_size = 2 << 20;
+  size_t size = filesize;
+  char *mem = (char *) MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages) {
+    size = (filesize + huge_page_size - 1) / huge_page_size * huge_page_size;
+    mem = (char *) mmap(0, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED)
+      size = filesize;
+  }
+#endif
+  if (mem == MAP_FAILED) {
+    mem = (char *) mmap(0, size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+      err(EX_OSERR, "unable to allocate %lu bytes", (unsigned long) size);
+#ifdef MADV_HUGEPAGE
+    // no reserved huge pages - use transparent huge pages instead
+    if (huge_pages && madvise(mem, size, MADV_HUGEPAGE) != 0)
+      warn("unable to use transparent huge pages");
+#endif
+  }
+  // placement has to be set before the pages are touched
+  if (numa_interleave)
+    interleave_memory(mem, size);
+
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(dynamic)
+#endif
+  for (size_t pos = 0; pos < filesize; pos += huge_page_size) {
+    size_t len = filesize - pos;
+    if (len > huge_page_size)
+      len = huge_page_size;
+    memcpy(mem + pos, fptr + pos, len);
+  }
+  mprotect(mem, size, PROT_READ);
+
+  munmap(fptr, filesize);
+  fptr = mem;
+  map_size = size;
+  anonymous = true;
 }
 
 void QuickFile::load_file() {
@@ -129,14 +204,15 @@ QuickFile::~QuickFile() {
 }
 
 void QuickFile::sync_file() {
-  msync(fptr, filesize, MS_SYNC);
+  if (! anonymous)
+    msync(fptr, filesize, MS_SYNC);
 }
 
 void QuickFile::close_file() {
   if (! valid)
     return;
   sync_file();
-  munmap(fptr, filesize);
+  munmap(fptr, map_size);
   close(fd);
   valid = false;
 }
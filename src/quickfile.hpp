@@ -34,6 +34,10 @@ namespace kraken {
     char *ptr();
     size_t size();
     void load_file();
+    // Copy file into anonymous memory backed by huge pages (explicit
+    // hugetlbfs pages if reserved, transparent huge pages otherwise) and/or
+    // interleaved across NUMA nodes. Only for files opened read-only.
+    void copy_to_memory(bool huge_pages, bool numa_interleave);
     void sync_file();
     void close_file();
 
@@ -43,6 +47,9 @@ namespace kraken {
     int fd;
     char *fptr;
     size_t filesize;
+    bool writable;
+    bool anonymous;  // fptr points to a copy of the file (see copy_to_memory)
+    size_t map_size;
   };
 
   std::vector<char> slurp_file(std::string filename, size_t lSize = 0);
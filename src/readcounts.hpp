@@ -73,6 +73,13 @@ namespace kraken {
       kmers.insert(kmer);
     }
 
+    void add_kmers(const uint64_t *new_kmers, size_t n); // add n k-mers at once
+
+    // count n k-mers whose unique count is kept elsewhere (see DBHits)
+    void add_kmer_count(uint64_t n) {
+      n_kmers += n;
+    }
+
     ReadCounts& operator+=(const ReadCounts& other) {
       n_reads += other.n_reads;
       n_kmers += other.n_kmers;
@@ -128,5 +135,17 @@ namespace kraken {
     return(kmers.size());
   }
 
+  template<>
+  inline void ReadCounts< HyperLogLogPlusMinus<uint64_t> >::add_kmers(const uint64_t *new_kmers, size_t n) {
+    n_kmers += n;
+    kmers.insert(new_kmers, n);
+  }
+
+  template<typename T>
+  void ReadCounts< T >::add_kmers(const uint64_t *new_kmers, size_t n) {
+    n_kmers += n;
+    kmers.insert(new_kmers, new_kmers + n);
+  }
+
 }
 #endif
@@ -19,6 +19,8 @@
 
 #include "kraken_headers.hpp"
 #include "seqreader.hpp"
+#include <sched.h>
+#include <zlib.h>
 
 using namespace std;
 
@@ -132,3 +134,376 @@ namespace kraken {
     return valid;
   }
 } // namespace
+
+namespace kraken {
+  // Pointer past the end of the line starting at p (and its newline)
+  static inline const char *next_line(const char *p, const char *end) {
+    const char *nl = (const char *) memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl + 1;
+  }
+
+  // End of the line starting at p, w/o newline
+  static inline const char *line_end(const char *p, const char *end) {
+    const char *nl = (const char *) memchr(p, '\n', end - p);
+    return nl == NULL ? end : nl;
+  }
+
+  // ID is the first word of the header
+  static void set_id(DNASequence &dna) {
+    const string &header = dna.header_line;
+    size_t start = 0;
+    while (start < header.size() && isspace(header[start]))
+      ++start;
+    size_t end = start;
+    while (end < header.size() && ! isspace(header[end]))
+      ++end;
+    dna.id.assign(header, start, end - start);
+  }
+
+  SequenceBlock::SequenceBlock() : id(0), fastq(false), pos(0) {}
+
+  bool SequenceBlock::next_sequence(DNASequence &dna) {
+    const char *begin = data.data();
+    const char *end = begin + data.size();
+    const char *p = begin + pos;
+    if (p >= end)
+      return false;
+    pos = data.size();  // stop at the end of the block unless the record is fine
+
+    const char *e = line_end(p, end);
+    if (fastq) {
+      if (e == p)
+        return false;  // Sometimes FASTQ files have empty last lines
+      if (*p != '@') {
+        if (*p != '\r')
+          warnx("malformed fastq file - sequence header (%s)", string(p, e).c_str());
+        return false;
+      }
+      dna.header_line.assign(p + 1, e);
+      set_id(dna);
+      p = next_line(p, end);
+      e = line_end(p, end);
+      dna.seq.assign(p, e);
+      p = next_line(p, end);
+      e = line_end(p, end);
+      if (p == e || *p != '+') {
+        if (p == end || *p != '\r')
+          warnx("malformed fastq file - quality header (%s)", string(p, e).c_str());
+        return false;
+      }
+      p = next_line(p, end);
+      e = line_end(p, end);
+      dna.quals.assign(p, e);
+      p = next_line(p, end);
+    }
+    else {
+      if (*p != '>') {
+        warnx("malformed fasta file - expected header char > not found");
+        return false;
+      }
+      dna.header_line.assign(p + 1, e);
+      set_id(dna);
+      dna.seq.clear();
+      for (p = next_line(p, end); p < end && *p != '>'; p = next_line(p, end))
+        dna.seq.append(p, line_end(p, end));
+    }
+    pos = p - begin;
+    return true;
+  }
+
+  size_t SequenceBlock::parse(std::vector<DNASequence> &work_unit) {
+    size_t n = 0, total_nt = 0;
+    while (true) {
+      if (n == work_unit.size())
+        work_unit.emplace_back();
+      if (! next_sequence(work_unit[n]))
+        break;
+      total_nt += work_unit[n++].seq.size();
+    }
+    work_unit.resize(n);
+    return total_nt;
+  }
+
+  // BGZF blocks are gzip members w/ the compressed block size in an extra
+  // field; returns the size of the member starting at p, or 0 if it is none
+  static size_t bgzf_block_size(const unsigned char *p, size_t len) {
+    if (len < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || ! (p[3] & 4))
+      return 0;
+    size_t xlen = p[10] | (p[11] << 8);
+    for (size_t i = 12; i + 4 <= 12 + xlen && i + 4 <= len; ) {
+      size_t slen = p[i + 2] | (p[i + 3] << 8);
+      if (p[i] == 'B' && p[i + 1] == 'C' && slen == 2 && i + 6 <= len)
+        return (p[i + 4] | (p[i + 5] << 8)) + 1;
+      i += 4 + slen;
+    }
+    return 0;
+  }
+
+  // Decompress the BGZF member at p, appending to out
+  static void inflate_bgzf_block(const unsigned char *p, size_t len, string &out) {
+    size_t xlen = p[10] | (p[11] << 8);
+    uint32_t isize;
+    memcpy(&isize, p + len - 4, 4);
+    size_t old_size = out.size();
+    out.resize(old_size + isize);
+    if (isize == 0)
+      return;
+
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, -15) != Z_OK)
+      errx(EX_SOFTWARE, "unable to initialize zlib");
+    zs.next_in = (Bytef *) p + 12 + xlen;
+    zs.avail_in = len - 12 - xlen - 8;
+    zs.next_out = (Bytef *) &out[old_size];
+    zs.avail_out = isize;
+    int ret = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || zs.avail_out != 0)
+      errx(EX_DATAERR, "corrupt BGZF block");
+  }
+
+  static void inflate_bgzf(const string &compressed, string &data) {
+    data.clear();
+    const unsigned char *p = (const unsigned char *) compressed.data();
+    for (size_t i = 0; i < compressed.size(); ) {
+      size_t member_size = bgzf_block_size(p + i, compressed.size() - i);
+      inflate_bgzf_block(p + i, member_size, data);
+      i += member_size;
+    }
+  }
+
+  PrefixedFileBuf::PrefixedFileBuf(FILE *file, const string &prefix)
+    : file(file), prefix(prefix), prefix_done(false), buffer(1 << 16)
+  {
+    setg(NULL, NULL, NULL);
+  }
+
+  PrefixedFileBuf::int_type PrefixedFileBuf::underflow() {
+    if (gptr() < egptr())
+      return traits_type::to_int_type(*gptr());
+    if (! prefix_done) {
+      prefix_done = true;
+      if (! prefix.empty()) {
+        setg(&prefix[0], &prefix[0], &prefix[0] + prefix.size());
+        return traits_type::to_int_type(*gptr());
+      }
+    }
+    size_t n = fread(&buffer[0], 1, buffer.size(), file);
+    if (n == 0)
+      return traits_type::eof();
+    setg(&buffer[0], &buffer[0], &buffer[0] + n);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  // The input is opened once and its first bytes are only read once, so that
+  // it can be a pipe
+  SequenceBlockReader::SequenceBlockReader(string filename, size_t block_size, bool interleaved)
+    : input(NULL), bgzf(false), input_buf(NULL), file(NULL), fastq(false),
+      interleaved(interleaved), block_size(block_size), eof(false), next_id(0), turn(0)
+  {
+#ifdef _OPENMP
+    omp_init_lock(&read_lock);
+#endif
+    unsigned char header[18];
+    input = fopen(filename.c_str(), "rb");
+    if (input == NULL)
+      err(EX_NOINPUT, "can't open %s", filename.c_str());
+    size_t n = fread(header, 1, sizeof(header), input);
+    if (n == sizeof(header) && bgzf_block_size(header, sizeof(header)) > 0) {
+      // the first blocks start the carry, to peek at the first record
+      string compressed;
+      bgzf = true;
+      read_bgzf_member(header, compressed);
+      inflate_bgzf(compressed, carry);
+      while (carry.empty() && ! eof)
+        read_more(carry);
+      fastq = ! carry.empty() && carry[0] == '@';
+    }
+    else {
+      input_buf = new PrefixedFileBuf(input, string((char *) header, n));
+      file = new bxz::istream(input_buf);
+      fastq = file->peek() == '@';
+      file->clear();
+    }
+    if (fastq)
+      this->block_size *= 2;
+  }
+
+  SequenceBlockReader::~SequenceBlockReader() {
+    delete file;
+    delete input_buf;
+    fclose(input);
+#ifdef _OPENMP
+    omp_destroy_lock(&read_lock);
+#endif
+  }
+
+  bool SequenceBlockReader::is_fastq() {
+    return fastq;
+  }
+
+  void SequenceBlockReader::read_raw(string &data) {
+    data.resize(block_size);
+    file->read(&data[0], block_size);
+    data.resize(file->gcount());
+    if (data.empty())
+      eof = true;
+  }
+
+  // Append the BGZF member w/ the given header, which was already read
+  void SequenceBlockReader::read_bgzf_member(const unsigned char *header, string &compressed) {
+    const size_t header_size = 18;
+    size_t member_size = bgzf_block_size(header, header_size);
+    if (member_size < header_size + 8)
+      errx(EX_DATAERR, "corrupt BGZF block");
+    size_t old_size = compressed.size();
+    compressed.resize(old_size + member_size);
+    memcpy(&compressed[old_size], header, header_size);
+    if (fread(&compressed[old_size + header_size], 1, member_size - header_size, input)
+        != member_size - header_size)
+      errx(EX_DATAERR, "truncated BGZF file");
+  }
+
+  // Read compressed BGZF blocks w/ about block_size bytes of data, which are
+  // decompressed by inflate_bgzf once the read lock is released
+  void SequenceBlockReader::read_bgzf(string &compressed) {
+    unsigned char header[18];
+    size_t data_size = 0;
+    compressed.clear();
+    while (! eof && data_size < block_size) {
+      size_t n = fread(header, 1, sizeof(header), input);
+      if (n == 0) {
+        eof = true;
+        break;
+      }
+      if (n < sizeof(header))
+        errx(EX_DATAERR, "corrupt BGZF block");
+      read_bgzf_member(header, compressed);
+      uint32_t isize;
+      memcpy(&isize, &compressed[compressed.size() - 4], 4);
+      data_size += isize;
+    }
+  }
+
+  // End of the record starting at p, or NULL if it is incomplete. FASTA
+  // records are complete once the next header is seen.
+  static const char *next_record_end(const char *p, const char *end, bool fastq) {
+    if (fastq) {
+      for (int line = 0; line < 4; ++line) {
+        p = (const char *) memchr(p, '\n', end - p);
+        if (p == NULL)
+          return NULL;
+        ++p;
+      }
+      return p;
+    }
+    p = (const char *) memmem(p, end - p, "\n>", 2);
+    return p == NULL ? NULL : p + 1;
+  }
+
+  // Offset after the last complete record (or pair) in data, which starts w/ a record
+  size_t SequenceBlockReader::complete_records_end(const string &data) {
+    if (! fastq && ! interleaved) {
+      size_t last_header = data.rfind("\n>");
+      return last_header == string::npos ? 0 : last_header + 1;
+    }
+    const char *begin = data.data();
+    const char *end = begin + data.size();
+    const char *complete_end = begin;
+    size_t n_records = 0;
+    for (const char *p = begin; (p = next_record_end(p, end, fastq)) != NULL; ) {
+      if (! interleaved || ++n_records % 2 == 0)
+        complete_end = p;
+    }
+    return complete_end - begin;
+  }
+
+  // Offset after the first n_records records in data, or npos if incomplete
+  size_t SequenceBlockReader::records_end(const string &data, size_t n_records) {
+    const char *begin = data.data();
+    const char *end = begin + data.size();
+    const char *p = begin;
+    for (size_t i = 0; i < n_records; ++i) {
+      if ((p = next_record_end(p, end, fastq)) == NULL)
+        return string::npos;
+    }
+    return p - begin;
+  }
+
+  // Append the next data of the input
+  void SequenceBlockReader::read_more(string &data) {
+    string more, compressed;
+#ifdef _OPENMP
+    omp_set_lock(&read_lock);
+#endif
+    if (bgzf)
+      read_bgzf(compressed);
+    else if (! eof)
+      read_raw(more);
+#ifdef _OPENMP
+    omp_unset_lock(&read_lock);
+#endif
+    if (bgzf)
+      inflate_bgzf(compressed, more);
+    data.append(more);
+  }
+
+  bool SequenceBlockReader::read_block(SequenceBlock &block) {
+    string compressed;
+    block.fastq = fastq;
+    block.pos = 0;
+    block.data.clear();
+
+#ifdef _OPENMP
+    omp_set_lock(&read_lock);
+#endif
+    block.id = next_id++;
+    if (bgzf)
+      read_bgzf(compressed);
+    else if (! eof)
+      read_raw(block.data);
+    bool at_eof = eof;
+#ifdef _OPENMP
+    omp_unset_lock(&read_lock);
+#endif
+    if (bgzf)
+      inflate_bgzf(compressed, block.data);
+
+    // Records are completed w/ the start of the next block in input order
+    while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != block.id)
+      sched_yield();
+    carry.append(block.data);
+    block.data.swap(carry);
+    size_t end = at_eof ? block.data.size() : complete_records_end(block.data);
+    carry.assign(block.data, end, string::npos);
+    block.data.resize(end);
+    __atomic_store_n(&turn, block.id + 1, __ATOMIC_RELEASE);
+
+    return ! (at_eof && block.data.empty());
+  }
+
+  void SequenceBlockReader::read_records(SequenceBlock &block, uint64_t id, size_t n_records) {
+    block.id = id;
+    block.fastq = fastq;
+    block.pos = 0;
+
+    while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != id)
+      sched_yield();
+    size_t end;
+    while ((end = records_end(carry, n_records)) == string::npos && ! eof)
+      read_more(carry);
+    if (end == string::npos)
+      end = carry.size();
+    block.data.assign(carry, 0, end);
+    carry.erase(0, end);
+    __atomic_store_n(&turn, id + 1, __ATOMIC_RELEASE);
+  }
+
+  bool SequenceBlockReader::at_end() {
+    while (carry.empty() && ! eof)
+      read_more(carry);
+    // Sometimes FASTQ files have empty last lines
+    return carry.find_first_not_of("\r\n") == string::npos;
+  }
+} // namespace
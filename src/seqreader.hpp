@@ -60,6 +60,87 @@ namespace kraken {
     bxz::ifstream file;
     bool valid;
   };
+
+  // Complete FASTA/FASTQ records of the input, handed out by
+  // SequenceBlockReader and parsed by the thread that got them
+  class SequenceBlock {
+    public:
+    SequenceBlock();
+    // Parse next record into dna, reusing its buffers; false at end of block
+    bool next_sequence(DNASequence &dna);
+    // Parse all records into work_unit, returns the number of bases
+    size_t parse(std::vector<DNASequence> &work_unit);
+
+    uint64_t id;   // blocks are numbered in input order
+    std::string data;
+
+    private:
+    friend class SequenceBlockReader;
+    bool fastq;
+    size_t pos;
+  };
+
+  // Stream buffer of a FILE that first returns the bytes already read from
+  // it, so that pipes can be sniffed for BGZF and still read from the start
+  class PrefixedFileBuf : public std::streambuf {
+    public:
+    PrefixedFileBuf(FILE *file, const std::string &prefix);
+
+    protected:
+    int_type underflow();
+
+    private:
+    FILE *file;
+    std::string prefix;
+    bool prefix_done;
+    std::vector<char> buffer;
+  };
+
+  // Reads the input in large blocks of complete records, so that only the
+  // handoff of blocks is serialized between threads. Compressed input is
+  // decompressed by bxzstr, except for BGZF files (bgzip), whose independent
+  // blocks are decompressed by the reading threads in parallel.
+  class SequenceBlockReader {
+    public:
+    // block_size is about the number of bases per block; FASTQ blocks are
+    // twice as large to hold the qualities. With interleaved, records come
+    // in pairs and blocks never split a pair.
+    SequenceBlockReader(std::string filename, size_t block_size, bool interleaved = false);
+    ~SequenceBlockReader();
+    bool is_fastq();
+    // Thread-safe, false at end of input. Blocks may be empty if a single
+    // record is larger than the block size.
+    bool read_block(SequenceBlock &block);
+    // Thread-safe, reads the next n_records records into the block with the
+    // given id, for matching the blocks of another reader (mate files). Ids
+    // must be used in order; fewer records are returned at end of input.
+    void read_records(SequenceBlock &block, uint64_t id, size_t n_records);
+    // True if there is no record left; call when no thread is reading
+    bool at_end();
+
+    private:
+    void read_raw(std::string &data);
+    void read_bgzf(std::string &compressed);
+    void read_bgzf_member(const unsigned char *header, std::string &compressed);
+    void read_more(std::string &data);
+    size_t complete_records_end(const std::string &data);
+    size_t records_end(const std::string &data, size_t n_records);
+
+    FILE *input;
+    bool bgzf;
+    PrefixedFileBuf *input_buf;  // w/o BGZF, the input read through file
+    bxz::istream *file;
+    bool fastq;
+    bool interleaved;
+    size_t block_size;
+    bool eof;
+    uint64_t next_id;
+    uint64_t turn;       // id of the block that may take the carry next
+    std::string carry;   // incomplete record at the end of the last block
+#ifdef _OPENMP
+    omp_lock_t read_lock;
+#endif
+  };
 }
 
 #endif
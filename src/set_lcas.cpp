@@ -27,8 +27,12 @@
 #include "uid_mapping.hpp"
 #include <unordered_map>
 #include <map>
+#include <memory>
+#include <algorithm>
+#include <queue>
 
 #define SKIP_LEN 50000
+#define LCA_MEMO_SIZE 256  // per set_lcas call, must be a power of two
 
 using namespace std;
 using namespace kraken;
@@ -39,6 +43,10 @@ void process_files();
 void process_single_file();
 void process_file(string filename, uint32_t taxid);
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_contaminant_taxid = false);
+void build_lca_index();
+void apply_lca_updates();
+struct lca_update;
+void add_lca_updates(const vector<lca_update> &updates);
 
 int Num_threads = 1;
 string DB_filename, Index_filename,
@@ -60,6 +68,7 @@ bool Use_uids_instead_of_taxids = false;
 bool Output_UID_map_to_STDOUT = false;
 bool Pretend = false;
 uint32_t Minimum_sequence_size = 0;
+uint64_t Update_buffer_size = 0;  // out-of-core mode if > 0
 
 string UID_map_filename;
 ofstream UID_map_file;
@@ -76,6 +85,32 @@ unordered_map<string, uint32_t> ID_to_taxon_map;
 unordered_map<uint32_t, bool> SeqId_added;
 KrakenDB Database;
 TaxonomyDB<uint32_t> taxdb;
+unique_ptr<LCAIndex<uint32_t> > Lca_index;
+
+// An update of the out-of-core mode (-B): the k-mer gets the LCA with taxid,
+// or taxid itself w/ -T if the caller flagged it as a contaminant taxid.
+// Updates are sorted like the database, by bin (minimizer) and k-mer, and
+// stay in the order of the sequences for equal k-mers (see -T and -R).
+struct lca_update {
+  uint32_t bin;
+  uint32_t taxid : 31;
+  uint32_t is_contaminant_taxid : 1;
+  uint64_t kmer;
+  bool operator<(const lca_update &rhs) const {
+    return bin < rhs.bin || (bin == rhs.bin && kmer < rhs.kmer);
+  }
+};
+
+// Sorted runs of updates in a temporary file
+struct lca_update_run {
+  uint64_t offset;
+  uint64_t n_updates;
+};
+
+vector<lca_update> Update_buffer;
+vector<lca_update_run> Update_runs;
+int Update_fd = -1;
+uint64_t Update_file_size = 0;
 
 const string prefix = "kraken:taxid|";
 
@@ -135,19 +170,23 @@ int main(int argc, char **argv) {
   KrakenDBIndex db_index(idx_file.ptr());
   Database.set_index(&db_index);
 
+  if (Update_buffer_size > 0) {
+    if (db_index.indexed_nt() > 16)
+      errx(EX_DATAERR, "-B requires a minimizer length of at most 16");
+    Update_buffer.reserve(Update_buffer_size / sizeof(lca_update));
+  }
+
   if (One_FASTA_file)
     process_single_file();
   else
     process_files();
 
+  if (Update_buffer_size > 0)
+    apply_lca_updates();
+
   if (!Kmer_count_filename.empty()) {
-    ofstream ofs(Kmer_count_filename.c_str());
     cerr << "Writing kmer counts to " << Kmer_count_filename << "..." << endl;
-    auto counts = Database.count_taxons();
-    for (auto it = counts.begin(); it != counts.end(); ++it) {
-      ofs << it->first << '\t' << it->second << '\n';
-    }
-    ofs.close();
+    TaxonomyDB<uint32_t>::writeGenomeSizes(Database.count_taxons(), Kmer_count_filename);
   }
 
   if (Operate_in_RAM && !Pretend) {
@@ -269,6 +308,7 @@ void process_single_file() {
   //cerr << "Processing FASTA files" << endl;
  
   ID_to_taxon_map = read_seqid_to_taxid_map(ID_to_taxon_map_filename, taxdb, Parent_map, Add_taxIds_for_Assembly, Add_taxIds_for_Sequences);
+  build_lca_index();
 
   FastaReader reader(Multi_fasta_filename);
   DNASequence dna;
@@ -388,6 +428,7 @@ void process_files() {
   }
   string line;
   uint32_t seqs_processed = 0;
+  build_lca_index();
 
   while (map_file.good()) {
     getline(map_file, line);
@@ -426,16 +467,80 @@ void process_file(string filename, uint32_t taxid) {
   // Or maybe asembly_summary file?
 //}
 
+// Call after all new taxids are inserted into taxdb
+void build_lca_index() {
+  taxdb.buildDenseIndex();
+  Lca_index.reset(new LCAIndex<uint32_t>(taxdb));
+}
+
+// Sets the value of a k-mer w/ taxid. lca_of(val) gives the LCA of taxid and val
+template<typename LCA_FUNC>
+inline void update_value(uint32_t *val_ptr, uint32_t taxid, bool is_contaminant_taxid, LCA_FUNC lca_of) {
+  if (Use_uids_instead_of_taxids) {
+#ifdef _OPENMP
+    #pragma omp critical(new_uid)
+#endif
+    *val_ptr = uid_mapping(Taxids_to_UID_map, UID_to_taxids_vec, taxid, *val_ptr, current_uid, UID_map_file);
+  } else {
+    if (Reset_taxid) {
+      *val_ptr = 0;
+    } else {
+      if (!Force_contaminant_taxid) {
+        *val_ptr = lca_of(*val_ptr);
+      } else {
+        if (*val_ptr == TID_CONTAMINANT1 || *val_ptr == TID_CONTAMINANT2) {
+          // keep value
+        } else if (is_contaminant_taxid) {
+          // When Force_contaminant_taxid is set, do not compute lca, but assign the taxid
+          // of the (last) sequence to k-mers
+          *val_ptr = taxid;
+        } else {
+          *val_ptr = lca_of(*val_ptr);
+        }
+      }
+    }
+  }
+}
+
 void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_contaminant_taxid) {
+  // Most k-mers of a sequence hit the same few values, so remember the last
+  //  LCA computed for each value. An empty slot (value 0) maps to taxid.
+  uint32_t memo_val[LCA_MEMO_SIZE];
+  uint32_t memo_lca[LCA_MEMO_SIZE];
+  fill_n(memo_val, LCA_MEMO_SIZE, 0);
+  fill_n(memo_lca, LCA_MEMO_SIZE, taxid);
+  auto memo_lca_of = [&](uint32_t val) {
+    size_t slot = (val * 2654435761u) >> 24 & (LCA_MEMO_SIZE - 1);
+    if (memo_val[slot] != val) {
+      memo_val[slot] = val;
+      memo_lca[slot] = Lca_index->lca(taxid, val);
+    }
+    return memo_lca[slot];
+  };
+
   KmerScanner scanner(seq, start, finish);
+  scanner.track_minimizers(Database.get_index()->indexed_nt(), Database.bin_key_xor_mask());
   uint64_t *kmer_ptr;
   uint32_t *val_ptr;
+  vector<lca_update> updates;
+  if (Update_buffer_size > 0 && taxid >= (1u << 31))
+    errx(EX_DATAERR, "-B requires taxonomy IDs below 2^31, got %u", taxid);
 
   while ((kmer_ptr = scanner.next_kmer()) != NULL) {
     if (scanner.ambig_kmer())
       continue;
+    if (Update_buffer_size > 0) {
+      lca_update update;
+      update.bin = scanner.minimizer();
+      update.taxid = taxid;
+      update.is_contaminant_taxid = is_contaminant_taxid;
+      update.kmer = Database.canonical_representation(*kmer_ptr);
+      updates.push_back(update);
+      continue;
+    }
     val_ptr = Database.kmer_query(
-                Database.canonical_representation(*kmer_ptr)
+                Database.canonical_representation(*kmer_ptr),
+                scanner.minimizer()
     );
     if (val_ptr == NULL) {
       if (! Allow_extra_kmers) {
@@ -447,32 +552,157 @@ void set_lcas(uint32_t taxid, string &seq, size_t start, size_t finish, bool is_
       continue;
     }
 
-    // TODO: Should I use pragma omp critical here?
-    if (Use_uids_instead_of_taxids) {
+    update_value(val_ptr, taxid, is_contaminant_taxid, memo_lca_of);
+  }
+
+  if (!updates.empty())
+    add_lca_updates(updates);
+}
+
+void write_update_run() {
+  if (Update_buffer.empty())
+    return;
+  // stable, so that updates of a k-mer keep the order of the sequences
+  stable_sort(Update_buffer.begin(), Update_buffer.end());
+  lca_update_run run;
+  run.offset = Update_file_size;
+  run.n_updates = Update_buffer.size();
+  const char *data = (const char *) Update_buffer.data();
+  uint64_t size = Update_buffer.size() * sizeof(lca_update);
+  for (uint64_t done = 0; done < size; ) {
+    ssize_t ret = pwrite(Update_fd, data + done, size - done, run.offset + done);
+    if (ret <= 0)
+      err(EX_IOERR, "unable to write to temporary file");
+    done += ret;
+  }
+  Update_file_size += size;
+  Update_runs.push_back(run);
+  Update_buffer.clear();
+}
+
+// Collects the updates of a part of a sequence; full buffers are sorted
+// and written as a run to a temporary file next to the output database
+void add_lca_updates(const vector<lca_update> &updates) {
 #ifdef _OPENMP
-      #pragma omp critical(new_uid)
+  #pragma omp critical(lca_updates)
 #endif
-      *val_ptr = uid_mapping(Taxids_to_UID_map, UID_to_taxids_vec, taxid, *val_ptr, current_uid, UID_map_file);
-    } else {
-	  if (Reset_taxid) {
-	    *val_ptr = 0;
-	  } else {
-        if (!Force_contaminant_taxid) {
-          *val_ptr = lca(Parent_map, taxid, *val_ptr);
-        } else {
-          if (*val_ptr == TID_CONTAMINANT1 || *val_ptr == TID_CONTAMINANT2) {
-            // keep value
-          } else if (is_contaminant_taxid) {
-            // When Force_contaminant_taxid is set, do not compute lca, but assign the taxid
-            // of the (last) sequence to k-mers
-            *val_ptr = taxid;
-          } else {
-            *val_ptr = lca(Parent_map, taxid, *val_ptr);
-          }
-		}
+  {
+    if (Update_fd < 0) {
+      string tmp_file_name = get_directory(Output_DB_filename.empty() ? DB_filename : Output_DB_filename) + "set_lcas.XXXXXX";
+      Update_fd = mkstemp(&tmp_file_name[0]);
+      if (Update_fd < 0)
+        err(EX_CANTCREAT, "unable to create temporary file %s", tmp_file_name.c_str());
+      // the file is removed once it is closed
+      unlink(tmp_file_name.c_str());
+    }
+    uint64_t max_updates = max<uint64_t>(Update_buffer_size / sizeof(lca_update), 1);
+    for (size_t i = 0; i < updates.size(); ) {
+      size_t n = min<size_t>(updates.size() - i, max_updates - Update_buffer.size());
+      Update_buffer.insert(Update_buffer.end(), updates.begin() + i, updates.begin() + i + n);
+      i += n;
+      if (Update_buffer.size() >= max_updates)
+        write_update_run();
+    }
+  }
+}
+
+// Reads a sorted run of updates in small blocks
+class UpdateRunReader {
+  public:
+  UpdateRunReader(const lca_update_run &run, size_t block_size)
+    : next_offset(run.offset), n_left(run.n_updates), block(block_size), pos(0), end(0) {}
+
+  // false when the run is exhausted
+  bool next(lca_update &update) {
+    if (pos == end) {
+      if (n_left == 0)
+        return false;
+      end = min<uint64_t>(n_left, block.size());
+      char *data = (char *) block.data();
+      uint64_t size = end * sizeof(lca_update);
+      for (uint64_t done = 0; done < size; ) {
+        ssize_t ret = pread(Update_fd, data + done, size - done, next_offset + done);
+        if (ret <= 0)
+          err(EX_IOERR, "unable to read from temporary file");
+        done += ret;
       }
+      next_offset += size;
+      n_left -= end;
+      pos = 0;
+    }
+    update = block[pos++];
+    return true;
+  }
+
+  private:
+  uint64_t next_offset;
+  uint64_t n_left;
+  vector<lca_update> block;
+  size_t pos, end;
+};
+
+// Merges the sorted runs and applies the updates in one sequential pass over
+// the database, one bin after the other
+void apply_lca_updates() {
+  write_update_run();
+  cerr << "Applying LCA updates from " << Update_runs.size() << " sorted runs ..." << endl;
+  // runs share the memory of the update buffer for reading
+  size_t block_size = max<size_t>(Update_buffer_size / sizeof(lca_update) / max<size_t>(Update_runs.size(), 1), 1024);
+  Update_buffer.clear();
+  Update_buffer.shrink_to_fit();
+  vector<UpdateRunReader> readers;
+  for (size_t i = 0; i < Update_runs.size(); ++i)
+    readers.push_back(UpdateRunReader(Update_runs[i], block_size));
+
+  // heap of the next update of each run; equal updates are taken from earlier runs first
+  typedef pair<lca_update, size_t> heap_entry;
+  auto later = [](const heap_entry &a, const heap_entry &b) {
+    return b.first < a.first || (!(a.first < b.first) && a.second > b.second);
+  };
+  priority_queue<heap_entry, vector<heap_entry>, decltype(later)> heap(later);
+  for (size_t i = 0; i < readers.size(); ++i) {
+    lca_update update;
+    if (readers[i].next(update))
+      heap.push(heap_entry(update, i));
+  }
+
+  KrakenDBIndex *index = Database.get_index();
+  uint64_t bin = 0, pos = 0, bin_end = 0;
+  bool in_bin = false;
+  uint64_t n_applied = 0, n_missing = 0;
+  while (!heap.empty()) {
+    heap_entry top = heap.top();
+    heap.pop();
+    const lca_update &update = top.first;
+    if (!in_bin || update.bin != bin) {
+      bin = update.bin;
+      in_bin = true;
+      pos = index->at(bin);
+      bin_end = index->at(bin + 1);
+    }
+    while (pos < bin_end && Database.get_key(pos) < update.kmer)
+      ++pos;
+    if (pos < bin_end && Database.get_key(pos) == update.kmer) {
+      const uint32_t taxid = update.taxid;
+      update_value(Database.get_value_ptr(pos), taxid, update.is_contaminant_taxid,
+                   [&](uint32_t val) { return Lca_index->lca(taxid, val); });
+      ++n_applied;
+    } else {
+      if (! Allow_extra_kmers)
+        errx(EX_DATAERR, "kmer found in sequence that is not in database");
+      ++n_missing;
     }
+    lca_update next;
+    if (readers[top.second].next(next))
+      heap.push(heap_entry(next, top.second));
   }
+  if (Update_fd >= 0)
+    close(Update_fd);
+  Update_fd = -1;
+  cerr << "Applied " << n_applied << " updates";
+  if (n_missing > 0)
+    cerr << " (" << n_missing << " k-mers were not in the database)";
+  cerr << endl;
 }
 
 void parse_command_line(int argc, char **argv) {
@@ -481,7 +711,7 @@ void parse_command_line(int argc, char **argv) {
 
   if (argc > 1 && strcmp(argv[1], "-h") == 0)
     usage(0);
-  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xMTRvb:aApI:o:Sc:E:")) != -1) {
+  while ((opt = getopt(argc, argv, "f:d:i:t:n:m:F:xMTRvb:aApI:o:Sc:E:B:")) != -1) {
     switch (opt) {
       case 'f' :
         File_to_taxon_map_filename = optarg;
@@ -549,6 +779,11 @@ void parse_command_line(int argc, char **argv) {
       case 'p' :
         Pretend = true;
         break;
+      case 'B' :
+        Update_buffer_size = parse_human_readable_size(optarg);
+        if (Update_buffer_size == 0)
+          errx(EX_USAGE, "invalid buffer size for -B");
+        break;
       default:
         usage();
         break;
@@ -588,7 +823,12 @@ void usage(int exit_code) {
        << "  -T               When a k-mer appears in a 'synthetic construct' sequence, force the taxID to be the 'synthetic construct' taxID, instead of the LCA." << endl
 	   << "  -E #             Exclude sequences that are shorter than the threshold." << endl
        << "  -I filename      Write UIDs into database, and output (binary) UID-to-taxid map to filename" << endl
+       << "  -c filename      Write the number of k-mers of each taxon to filename (binary), for reports" << endl
        << "  -p               Pretend - do not write database back to disk (when working in RAM)" << endl
+       << "  -B size          Out-of-core mode: collect the updates of the k-mers in sorted runs of" << endl
+       << "                   size bytes (e.g. 8G) in a temporary file, and apply them in one" << endl
+       << "                   sequential pass over the database. Use it w/o -M when the database" << endl
+       << "                   does not fit into RAM." << endl
        << "  -v               Verbose output" << endl
        << "  -h               Print this message" << endl
        << endl
@@ -29,10 +29,17 @@
 #include <string>
 #include <unordered_map>
 #include <vector>
+#include <memory>
 #include <unordered_set>
 #include <iomanip>
 #include <sstream>
 #include <stdexcept>
+#include <map>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "report-cols.hpp"
 //#include "readcounts.hpp"
 
@@ -223,11 +230,19 @@ class TaxonomyDB {
     TaxonomyDB(const std::string inFileName, bool hasGenomeSizes = false);
     TaxonomyDB();
 
-    TaxonomyDB(TaxonomyDB&& rhs) : entries(std::move(rhs.entries)) {
+    TaxonomyDB(TaxonomyDB&& rhs) : entries(std::move(rhs.entries)),
+      denseIndex(std::move(rhs.denseIndex)), denseTaxIDs(std::move(rhs.denseTaxIDs)),
+      denseParents(std::move(rhs.denseParents)), denseDepths(std::move(rhs.denseDepths)),
+      denseRanks(std::move(rhs.denseRanks)) {
     }
 
     TaxonomyDB& operator=(TaxonomyDB&& rhs) {
       entries = std::move(rhs.entries);
+      denseIndex = std::move(rhs.denseIndex);
+      denseTaxIDs = std::move(rhs.denseTaxIDs);
+      denseParents = std::move(rhs.denseParents);
+      denseDepths = std::move(rhs.denseDepths);
+      denseRanks = std::move(rhs.denseRanks);
       return *this;
     }
 
@@ -260,14 +275,37 @@ class TaxonomyDB {
     int isBelowInTree(TAXID upper, TAXID lower) const;
 
     void setGenomeSizes(const std::unordered_map<TAXID, uint64_t> & genomeSizes);
+    // Genome sizes (k-mer counts) of a DB: a text file of taxid and count
+    // per line, or the binary format written by writeGenomeSizes()
     void readGenomeSizes(string file);
+    static void writeGenomeSizes(const std::map<TAXID, uint64_t>& genomeSizes, string file);
     void setGenomeSize(const TAXID taxid, const uint64_t genomeSize);
 
     void printReport();
 
+    // Dense numbering of the taxa, so that the tree can be walked in flat
+    // arrays. Built at load time (call again after insert): taxa are numbered
+    // breadth-first, parents before children. Index 0 is taxon 0, which is
+    // also the parent of the roots.
+    void buildDenseIndex();
+    uint32_t getDenseIndex(const TAXID taxID) const; // 0 if not in the taxonomy
+    // Dense LCA of a and b, 0 if they are in different trees
+    // LCA(0,x) = LCA(x,0) = x
+    uint32_t getDenseLCA(uint32_t a, uint32_t b) const;
+    // Same as kraken::resolve_tree: the taxon of the highest weighted
+    // root-to-leaf path, or the LCA of all tied ones. hits are pairs of
+    // dense index and count, sorted by index.
+    TAXID resolveDenseTree(const std::vector<std::pair<uint32_t, uint32_t> >& hits) const;
+
     std::unordered_map<TAXID, TaxonomyEntry<TAXID> > entries;
     bool genomeSizes_are_set;
 
+    std::unordered_map<TAXID, uint32_t> denseIndex;
+    std::vector<TAXID> denseTaxIDs;
+    std::vector<uint32_t> denseParents;
+    std::vector<uint32_t> denseDepths;
+    std::vector<TaxRank::RANK> denseRanks;
+
   private:
 
     std::unordered_map<TAXID, TaxonomyEntry<TAXID> >
@@ -275,18 +313,46 @@ class TaxonomyDB {
 };
 
 
+// LCA queries on the dense index of a TaxonomyDB in O(log depth) w/o
+// allocations, by binary lifting. Rebuild it when taxa are added.
+template<typename TAXID>
+class LCAIndex {
+  public:
+    explicit LCAIndex(const TaxonomyDB<TAXID>& taxdb);
+    // Same as kraken::lca: LCA(0,x) = LCA(x,0) = x, and 1 (the root) if
+    // there is no common ancestor
+    TAXID lca(TAXID a, TAXID b) const;
+    // 0 if a and b are in different trees
+    uint32_t denseLCA(uint32_t a, uint32_t b) const;
+
+  private:
+    const TaxonomyDB<TAXID>& _taxdb;
+    std::vector<std::vector<uint32_t> > _ancestors; // [j][i] is the 2^j-th ancestor of i, or 0
+};
+
 template<typename TAXID, typename READCOUNTS>
 class TaxReport {
   private:
     std::ostream& _reportOfb;
     const TaxonomyDB<TAXID> & _taxdb;
     const std::unordered_map<TAXID, READCOUNTS>& _taxCounts; // set in constructor, from classification
-    //std::unordered_map<const TaxonomyEntry<TAXID>*, vector<const TaxonomyEntry<TAXID>*> > _children;
-    std::unordered_map<const TaxonomyEntry<TAXID>*, vector<const READCOUNTS*> > _children;
-    std::unordered_map<const TaxonomyEntry<TAXID>*, READCOUNTS> _cladeCounts; // consider accessing by TaxEntry*
+    // What the report shows of the summed counts of a clade; the k-mer
+    // sets are merged into the parent once this is taken
+    struct CladeCounts {
+      uint64_t n_reads;
+      uint64_t n_kmers;
+      uint64_t n_unique_kmers;
+      uint64_t readCount() const { return n_reads; }
+      uint64_t kmerCount() const { return n_kmers; }
+      uint64_t uniqueKmerCount() const { return n_unique_kmers; }
+      bool operator<(const CladeCounts& other) const {
+        return n_reads < other.n_reads || (n_reads == other.n_reads && n_kmers < other.n_kmers);
+      }
+    };
+    std::unordered_map<const TaxonomyEntry<TAXID>*, CladeCounts> _cladeCounts;
     uint64_t _total_n_reads = 0;
     bool _show_zeros;
-    void printLine(const TaxonomyEntry<TAXID>& tax, const READCOUNTS& rc, unsigned depth);
+    void printLine(const TaxonomyEntry<TAXID>& tax, const CladeCounts& rc, unsigned depth);
     READCOUNTS setCladeCounts(const TaxonomyEntry<TAXID>* tax, unordered_map<const TaxonomyEntry<TAXID>*, unordered_set<const TaxonomyEntry<TAXID>*> >& _children);
 
   public:
@@ -438,7 +504,9 @@ TaxonomyDB<TAXID>::TaxonomyDB() : genomeSizes_are_set(false) { }
 template<typename TAXID>
 TaxonomyDB<TAXID>::TaxonomyDB(const std::string inFileName, bool hasGenomeSizes) :
   entries( readTaxonomyIndex_(inFileName, hasGenomeSizes) ), genomeSizes_are_set(hasGenomeSizes)
-{ }
+{
+  buildDenseIndex();
+}
 
 template<typename TAXID>
 unordered_map<TAXID, TaxonomyEntry<TAXID>> readDumps(const std::string namesDumpFileName, const std::string nodesDumpFileName) {
@@ -454,6 +522,7 @@ unordered_map<TAXID, TaxonomyEntry<TAXID>> readDumps(const std::string namesDump
 template<typename TAXID>
 TaxonomyDB<TAXID>::TaxonomyDB(const std::string namesDumpFileName, const std::string nodesDumpFileName) : 
   entries(readDumps<TAXID>(namesDumpFileName, nodesDumpFileName)) {
+    buildDenseIndex();
   }
 
 template<typename TAXID>
@@ -558,6 +627,157 @@ template<typename TAXID>
 void TaxonomyDB<TAXID>::readTaxonomyIndex(const std::string inFileName, bool hasGenomeSizes) {
   entries = readTaxonomyIndex_(inFileName, hasGenomeSizes);
   genomeSizes_are_set = hasGenomeSizes;
+  buildDenseIndex();
+}
+
+template<typename TAXID>
+void TaxonomyDB<TAXID>::buildDenseIndex() {
+  denseIndex.clear();
+  denseTaxIDs.clear();
+  denseParents.clear();
+  denseDepths.clear();
+  denseRanks.clear();
+
+  // children by parent; the roots are children of 0
+  std::unordered_map<TAXID, std::vector<TAXID> > children;
+  for (auto it = entries.begin(); it != entries.end(); ++it) {
+    if (it->first == 0)
+      continue;
+    TAXID parent = it->second.parent == NULL ? 0 : it->second.parent->taxonomyID;
+    children[parent].push_back(it->first);
+  }
+
+  denseIndex.reserve(entries.size());
+  denseTaxIDs.reserve(entries.size());
+  denseParents.reserve(entries.size());
+  denseDepths.reserve(entries.size());
+  denseRanks.reserve(entries.size());
+  denseIndex[0] = 0;
+  denseTaxIDs.push_back(0);
+  denseParents.push_back(0);
+  denseDepths.push_back(0);
+  denseRanks.push_back(TaxRank::no_rank);
+  for (size_t i = 0; i < denseTaxIDs.size(); ++i) {
+    auto child_it = children.find(denseTaxIDs[i]);
+    if (child_it == children.end())
+      continue;
+    std::sort(child_it->second.begin(), child_it->second.end());
+    for (TAXID child : child_it->second) {
+      denseIndex[child] = denseTaxIDs.size();
+      denseTaxIDs.push_back(child);
+      denseParents.push_back(i);
+      denseDepths.push_back(i == 0 ? 0 : denseDepths[i] + 1);
+      auto rank_it = TaxRank::string_to_rank.find(entries.at(child).rank);
+      denseRanks.push_back(rank_it == TaxRank::string_to_rank.end() ? TaxRank::unknown : rank_it->second);
+    }
+  }
+}
+
+template<typename TAXID>
+uint32_t TaxonomyDB<TAXID>::getDenseIndex(const TAXID taxID) const {
+  auto it = denseIndex.find(taxID);
+  return it == denseIndex.end() ? 0 : it->second;
+}
+
+template<typename TAXID>
+uint32_t TaxonomyDB<TAXID>::getDenseLCA(uint32_t a, uint32_t b) const {
+  if (a == 0 || b == 0)
+    return a ? a : b;
+  while (denseDepths[a] > denseDepths[b])
+    a = denseParents[a];
+  while (denseDepths[b] > denseDepths[a])
+    b = denseParents[b];
+  while (a != b) {
+    a = denseParents[a];
+    b = denseParents[b];
+  }
+  return a;
+}
+
+template<typename TAXID>
+LCAIndex<TAXID>::LCAIndex(const TaxonomyDB<TAXID>& taxdb) : _taxdb(taxdb) {
+  uint32_t max_depth = 0;
+  for (size_t i = 0; i < taxdb.denseDepths.size(); ++i)
+    max_depth = std::max(max_depth, taxdb.denseDepths[i]);
+  _ancestors.push_back(taxdb.denseParents);
+  for (size_t j = 1; (1ull << j) <= max_depth; ++j) {
+    const std::vector<uint32_t>& prev = _ancestors.back();
+    std::vector<uint32_t> next(prev.size());
+    for (size_t i = 0; i < prev.size(); ++i)
+      next[i] = prev[prev[i]];
+    _ancestors.push_back(std::move(next));
+  }
+}
+
+template<typename TAXID>
+uint32_t LCAIndex<TAXID>::denseLCA(uint32_t a, uint32_t b) const {
+  if (a == 0 || b == 0)
+    return a ? a : b;
+  const std::vector<uint32_t>& depths = _taxdb.denseDepths;
+  if (depths[a] < depths[b])
+    std::swap(a, b);
+  for (uint32_t diff = depths[a] - depths[b], j = 0; diff > 0; diff >>= 1, ++j) {
+    if (diff & 1)
+      a = _ancestors[j][a];
+  }
+  if (a == b)
+    return a;
+  for (size_t j = _ancestors.size(); j-- > 0; ) {
+    if (_ancestors[j][a] != _ancestors[j][b]) {
+      a = _ancestors[j][a];
+      b = _ancestors[j][b];
+    }
+  }
+  return _ancestors[0][a];
+}
+
+template<typename TAXID>
+TAXID LCAIndex<TAXID>::lca(TAXID a, TAXID b) const {
+  if (a == 0 || b == 0)
+    return a ? a : b;
+  uint32_t dense_a = _taxdb.getDenseIndex(a);
+  uint32_t dense_b = _taxdb.getDenseIndex(b);
+  if (dense_a == 0 || dense_b == 0)
+    return a == b ? a : 1;  // a taxon w/o parents only has itself in common
+  uint32_t dense_lca = denseLCA(dense_a, dense_b);
+  return dense_lca == 0 ? 1 : _taxdb.denseTaxIDs[dense_lca];
+}
+
+template<typename TAXID>
+TAXID TaxonomyDB<TAXID>::resolveDenseTree(const std::vector<std::pair<uint32_t, uint32_t> >& hits) const {
+  if (hits.empty())
+    return 0;
+
+  // parents come before their children, so there are no hits above min_index
+  const uint32_t min_index = hits.front().first;
+  std::vector<uint32_t> max_taxa;
+  uint32_t max_score = 0;
+  for (size_t i = 0; i < hits.size(); ++i) {
+    // sum the hits on the path to the root
+    uint32_t score = 0;
+    size_t h = i;
+    for (uint32_t node = hits[i].first; node >= min_index && node != 0; node = denseParents[node]) {
+      while (hits[h].first > node)
+        --h;
+      if (hits[h].first == node)
+        score += hits[h].second;
+    }
+    if (score > max_score) {
+      max_taxa.clear();
+      max_score = score;
+    }
+    if (score == max_score)
+      max_taxa.push_back(hits[i].first);
+  }
+
+  // If two paths are tied for max, return LCA of all
+  uint32_t lca = max_taxa[0];
+  for (size_t i = 1; i < max_taxa.size(); ++i) {
+    lca = getDenseLCA(lca, max_taxa[i]);
+    if (lca == 0)
+      return 1;  // different trees, as kraken::lca
+  }
+  return denseTaxIDs[lca];
 }
 
 template<typename TAXID>
@@ -864,21 +1084,65 @@ void TaxonomyDB<TAXID>::setGenomeSize(const TAXID taxid, const uint64_t genomeSi
   }
 }
 
+// Binary genome sizes: the magic, the number of taxa n (uint64_t), n counts
+// (uint64_t) and n taxids (uint32_t), so that it can be used mmap'ed
+static const char GENOME_SIZES_MAGIC[] = "KRAKCNT1";
+static const size_t GENOME_SIZES_HEADER_SIZE = 8 + sizeof(uint64_t);
+
+template<typename TAXID>
+void TaxonomyDB<TAXID>::writeGenomeSizes(const std::map<TAXID, uint64_t>& genomeSizes, string file) {
+  std::ofstream outFile(file, std::ofstream::binary);
+  if (!outFile.is_open())
+    throw std::runtime_error("unable to open file " + file);
+  uint64_t n = genomeSizes.size();
+  outFile.write(GENOME_SIZES_MAGIC, 8);
+  outFile.write((const char *) &n, sizeof(n));
+  for (auto it = genomeSizes.begin(); it != genomeSizes.end(); ++it)
+    outFile.write((const char *) &it->second, sizeof(uint64_t));
+  for (auto it = genomeSizes.begin(); it != genomeSizes.end(); ++it) {
+    uint32_t taxid = it->first;
+    outFile.write((const char *) &taxid, sizeof(taxid));
+  }
+  outFile.close();
+  if (!outFile)
+    throw std::runtime_error("unable to write file " + file);
+}
+
 template<typename TAXID>
 void TaxonomyDB<TAXID>::readGenomeSizes(string file) {
-  //for (auto entry_it = entries.begin(); entry_it != entries.end(); ++entry_it) {
-  //  entry_it->second.genomeSize = 0;
-  //  entry_it->second.genomeSizeOfChildren = 0;
-  //}
   cerr << "Reading genome sizes from " << file << " ...";
-  std::ifstream inFile(file);
-  if (!inFile.is_open())
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0)
     throw std::runtime_error("unable to open file " + file);
-  TAXID taxonomyID;
-  uint64_t size;
-  while (!inFile.eof()) {
-    inFile >> taxonomyID >> size;
-    setGenomeSize(taxonomyID, size);
+  struct stat sb;
+  if (fstat(fd, &sb) < 0)
+    throw std::runtime_error("unable to stat file " + file);
+  char magic[8];
+  if (sb.st_size >= (off_t) GENOME_SIZES_HEADER_SIZE && ::read(fd, magic, 8) == 8
+      && memcmp(magic, GENOME_SIZES_MAGIC, 8) == 0) {
+    void *ptr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::runtime_error("unable to mmap file " + file);
+    const char *data = (const char *) ptr;
+    uint64_t n;
+    memcpy(&n, data + 8, sizeof(n));
+    if ((uint64_t) sb.st_size != GENOME_SIZES_HEADER_SIZE + n * (sizeof(uint64_t) + sizeof(uint32_t)))
+      throw std::runtime_error("truncated genome sizes file " + file);
+    const uint64_t *sizes = (const uint64_t *) (data + GENOME_SIZES_HEADER_SIZE);
+    const uint32_t *taxids = (const uint32_t *) (sizes + n);
+    for (uint64_t i = 0; i < n; ++i)
+      setGenomeSize(taxids[i], sizes[i]);
+    munmap(ptr, sb.st_size);
+  } else {
+    ::close(fd);
+    std::ifstream inFile(file);
+    if (!inFile.is_open())
+      throw std::runtime_error("unable to open file " + file);
+    TAXID taxonomyID;
+    uint64_t size;
+    while (inFile >> taxonomyID >> size)
+      setGenomeSize(taxonomyID, size);
   }
 
   cerr << " done" << endl;
@@ -931,46 +1195,90 @@ TaxReport<TAXID,READCOUNTS>::TaxReport(std::ostream& reportOfb, const TaxonomyDB
     bool show_zeros) : _reportOfb(reportOfb), _taxdb(taxdb), _taxCounts(readCounts), _show_zeros(show_zeros) {
 
   cerr << "Setting values in the taxonomy tree ...";
-  //unordered_map<const TaxonomyEntry<TAXID>*, unordered_set<const TaxonomyEntry<TAXID>*> > _children1;
+  // Nodes are the taxa w/ counts and their ancestors. Clade counts are
+  // summed bottom-up, a level of the tree at a time: a node takes its own
+  // counts and moves in the clade counts of its children, one level down,
+  // so the nodes of a level are done in parallel w/o locking.
+  // Level 0 is taxon 0, which is not the parent of the roots here.
+  const uint32_t NO_NODE = (uint32_t)-1;
+  std::vector<uint32_t> node_of_dense(taxdb.denseTaxIDs.size(), NO_NODE);
+  std::vector<const TaxonomyEntry<TAXID>*> node_tax;
+  std::vector<const READCOUNTS*> node_counts;
+  std::vector<uint32_t> node_parent;
+  std::vector<std::vector<uint32_t> > levels;
   for (auto it = _taxCounts.begin(); it != _taxCounts.end(); ++it) {
-    auto tax_it = taxdb.entries.find(it->first);
-    if (tax_it == taxdb.entries.end()) {
+    uint32_t dense = taxdb.getDenseIndex(it->first);
+    if (dense == 0 && (it->first != 0 || taxdb.entries.count(0) == 0)) {
       cerr << "No entry for " << it->first << " in database!" << endl;
-    } else {
-      const TaxonomyEntry<TAXID>* tax = &(tax_it->second);
-      while (tax != NULL) {
-        _children[tax].push_back(&(it->second));
-        /*
-        auto res = (_children1[tax->parent]).insert(tax);
-        if (!res.second)
-          break;
-        */
-        tax = tax->parent;
+      continue;
+    }
+    uint32_t child = NO_NODE;
+    while (true) {
+      uint32_t node = node_of_dense[dense];
+      const bool is_new = node == NO_NODE;
+      if (is_new) {
+        node = node_of_dense[dense] = node_tax.size();
+        node_tax.push_back(&taxdb.entries.at(taxdb.denseTaxIDs[dense]));
+        node_counts.push_back(NULL);
+        node_parent.push_back(NO_NODE);
+        const size_t level = dense == 0 ? 0 : taxdb.denseDepths[dense] + 1;
+        if (levels.size() <= level)
+          levels.resize(level + 1);
+        levels[level].push_back(node);
       }
+      if (child == NO_NODE)
+        node_counts[node] = &(it->second);
+      else
+        node_parent[child] = node;
+      if (!is_new || node_tax[node]->parent == NULL)
+        break;
+      child = node;
+      dense = taxdb.denseParents[dense];
     }
   }
 
-  //cerr << " Nr children: " << _children.size() << endl;
-
-
+  // children of node i are children[child_start[i] .. child_start[i+1]-1]
+  const size_t n_nodes = node_tax.size();
+  std::vector<uint32_t> child_start(n_nodes + 1, 0);
+  std::vector<uint32_t> children(n_nodes);
+  for (size_t i = 0; i < n_nodes; ++i)
+    if (node_parent[i] != NO_NODE)
+      ++child_start[node_parent[i] + 1];
+  for (size_t i = 0; i < n_nodes; ++i)
+    child_start[i + 1] += child_start[i];
+  std::vector<uint32_t> child_end(child_start.begin(), child_start.end() - 1);
+  for (size_t i = 0; i < n_nodes; ++i)
+    if (node_parent[i] != NO_NODE)
+      children[child_end[node_parent[i]]++] = i;
+
+  std::vector<std::unique_ptr<READCOUNTS> > clade_counts(n_nodes);
+  std::vector<CladeCounts> shown_counts(n_nodes);
+  for (size_t l = levels.size(); l-- > 0; ) {
+    const std::vector<uint32_t>& level = levels[l];
 #ifdef _OPENMP
-  #pragma omp parallel for schedule(dynamic, 50)
+    #pragma omp parallel for schedule(dynamic, 16)
 #endif
-  for (size_t i = 0; i < _children.size(); ++i) {
-
-    auto cit = _children.begin();
-    advance(cit, i);
-    READCOUNTS rc = *(cit->second.front());
-    for (size_t j = 1; j < cit->second.size(); ++j)
-       rc += *(cit->second[j]);
-
-#ifdef _OPENMP
-    #pragma omp critical(update_clade_counts)
-#endif
-    {
-      _cladeCounts.insert( std::make_pair( cit->first, std::move(rc) ) );
+    for (size_t j = 0; j < level.size(); ++j) {
+      const uint32_t node = level[j];
+      uint32_t c = child_start[node];
+      // every node has its own counts or a child, whose counts it takes over
+      std::unique_ptr<READCOUNTS> rc;
+      if (node_counts[node] != NULL)
+        rc.reset(new READCOUNTS(*node_counts[node]));
+      else
+        rc = std::move(clade_counts[children[c++]]);
+      for (; c < child_start[node + 1]; ++c) {
+        *rc += std::move(*clade_counts[children[c]]);
+        clade_counts[children[c]].reset();
+      }
+      shown_counts[node] = CladeCounts { rc->readCount(), rc->kmerCount(), rc->uniqueKmerCount() };
+      clade_counts[node] = std::move(rc);
     }
   }
+
+  _cladeCounts.reserve(n_nodes);
+  for (size_t i = 0; i < n_nodes; ++i)
+    _cladeCounts.insert(std::make_pair(node_tax[i], shown_counts[i]));
   
   cerr << " done" << endl;
 
@@ -1059,7 +1367,7 @@ void TaxReport<TAXID,READCOUNTS>::printReport(const TaxonomyEntry<TAXID>& tax, u
 
     // Sort children
     vector<size_t> pos;
-    unordered_map<size_t, READCOUNTS*> rc;
+    unordered_map<size_t, const CladeCounts*> rc;
     for (size_t i =0; i < tax.children.size(); ++i) {
       auto it = _cladeCounts.find(tax.children[i]);
       if (it != _cladeCounts.end()) {
@@ -1076,7 +1384,7 @@ void TaxReport<TAXID,READCOUNTS>::printReport(const TaxonomyEntry<TAXID>& tax, u
 }
 
 template<typename TAXID, typename READCOUNTS>
-void TaxReport<TAXID,READCOUNTS>::printLine(const TaxonomyEntry<TAXID>& tax, const READCOUNTS& rc, unsigned depth) {
+void TaxReport<TAXID,READCOUNTS>::printLine(const TaxonomyEntry<TAXID>& tax, const CladeCounts& rc, unsigned depth) {
   const auto r_it = _taxCounts.find(tax.taxonomyID);
   const bool has_tax_data = r_it != _taxCounts.end();
 
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2017-2018, Florian Breitwieser
+ *
+ * This file is part of the KrakenUniq taxonomic sequence classification system.
+ *
+ * KrakenUniq is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * KrakenUniq is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with KrakenUniq.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Checks the buffered sparse list of HyperLogLogPlusMinus against a model of
+// the unbuffered sketch, which adds each hash to the sparse list on insertion
+// and switches to the registers when a hash arrives while the list has m/4
+// values. Sparse sketches that are merged stay sparse.
+
+#include "hyperloglogplus.hpp"
+#include <iostream>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+typedef HyperLogLogPlusMinus<uint64_t> HLL;
+
+// The items are used as hashes. Distinct items have distinct top 25 bits,
+// i.e. distinct values in the sparse list.
+uint64_t identity(uint64_t x) {
+  return x;
+}
+
+struct Model {
+  size_t m;
+  bool sparse = true;
+  uint64_t n_observed = 0;
+  set<uint64_t> items;
+
+  Model(uint8_t p) : m(size_t(1) << p) { }
+
+  void insert(uint64_t item) {
+    ++n_observed;
+    if (sparse && items.size() + 1 > m/4)
+      sparse = false;
+    items.insert(item);
+  }
+
+  void merge(const Model& other) {
+    if (other.n_observed == 0)
+      return;
+    if (n_observed == 0) {
+      *this = other;
+      return;
+    }
+    n_observed += other.n_observed;
+    sparse = sparse && other.sparse;
+    items.insert(other.items.begin(), other.items.end());
+  }
+};
+
+// Builds a sketch with the model's representation and items: sparse
+// sketches of at most m/4 items are merged, or all items are inserted into
+// the registers.
+HLL expected_sketch(const Model& model, uint8_t p) {
+  HLL hll(p, model.sparse, identity);
+  hll.use_n_observed = false;
+  if (!model.sparse) {
+    for (uint64_t item : model.items)
+      hll.insert(item);
+    return hll;
+  }
+  vector<uint64_t> chunk;
+  for (auto it = model.items.begin(); it != model.items.end(); ) {
+    chunk.push_back(*it++);
+    if (chunk.size() == model.m/4 || it == model.items.end()) {
+      HLL part(p, true, identity);
+      part.insert(chunk);
+      hll.merge(std::move(part));
+      chunk.clear();
+    }
+  }
+  return hll;
+}
+
+size_t n_checks = 0, n_failed = 0;
+
+// The estimates are taken on a const reference, so a buffer is not flushed
+void check(const HLL& hll, const Model& model, uint8_t p, const string& what) {
+  HLL exp_hll = expected_sketch(model, p);
+  auto capped = [&](uint64_t est) { return min(est, model.n_observed); };
+  vector<pair<string, pair<uint64_t, uint64_t> > > results = {
+    {"nObserved", {hll.nObserved(), model.n_observed}},
+    {"ertl", {hll.cardinality(), capped(exp_hll.cardinality())}},
+    {"heule", {hll.heuleCardinality(), capped(exp_hll.heuleCardinality())}},
+    {"heule w/o bias correction", {hll.heuleCardinality(false), capped(exp_hll.heuleCardinality(false))}},
+    {"flajolet", {hll.flajoletCardinality(), capped(exp_hll.flajoletCardinality())}},
+    {"flajolet w/o sparse precision", {hll.flajoletCardinality(false), capped(exp_hll.flajoletCardinality(false))}}
+  };
+  ++n_checks;
+  for (const auto& r : results) {
+    if (r.second.first != r.second.second) {
+      cerr << "FAILED: " << what << " (p=" << int(p) << ", " << model.items.size() << " items, "
+           << (model.sparse ? "sparse" : "normal") << "): " << r.first << " is "
+           << r.second.first << ", expected " << r.second.second << endl;
+      ++n_failed;
+      return;
+    }
+  }
+}
+
+// Items w/ distinct top 25 bits. The first n_same_register items have the
+// index 1, so a sketch of them has a tiny estimate in the normal representation.
+vector<uint64_t> make_items(size_t n, uint8_t p, size_t n_same_register, mt19937_64& rng) {
+  set<uint64_t> prefixes;
+  vector<uint64_t> items;
+  while (items.size() < n) {
+    uint64_t x = rng();
+    if (items.size() < n_same_register)
+      x = (uint64_t(1) << (64-p)) | (x >> p);
+    if (prefixes.insert(x >> (64-25)).second)
+      items.push_back(x);
+  }
+  return items;
+}
+
+// Inserts m/4 - n_before items, then the batch of the items after them
+void check_switch(uint8_t p, size_t n_before, const vector<size_t>& batch, const string& what) {
+  mt19937_64 rng(n_before);
+  HLL hll(p, true, identity);
+  Model model(p);
+  size_t n_first = model.m/4 - n_before;
+  vector<uint64_t> items = make_items(n_first + batch.size(), p, n_first + batch.size(), rng);
+  for (size_t i = 0; i < n_first; ++i) {
+    hll.insert(items[i]);
+    model.insert(items[i]);
+  }
+  vector<uint64_t> batch_items;
+  for (size_t i : batch) {
+    batch_items.push_back(items[n_first + i]);
+    model.insert(items[n_first + i]);
+  }
+  hll.insert(batch_items);
+  check(hll, model, p, what);
+}
+
+void check_buffered_merge(uint8_t p) {
+  mt19937_64 rng(p);
+  size_t m = size_t(1) << p;
+  vector<uint64_t> items = make_items(m/2, p, m/2, rng);
+  // other has items w/ duplicates in its buffer, this has some of them
+  for (size_t n_other : {m/8, m/4 - 1, m/4, m/4 + 1}) {
+    for (size_t n_this : {size_t(0), size_t(5), m/8, m/4}) {
+      HLL other(p, true, identity), hll(p, true, identity);
+      Model other_model(p), model(p);
+      for (size_t i = 0; i < n_other; ++i) {
+        size_t j = i % 3 == 2 ? i - 1 : i;
+        other.insert(items[j]);
+        other_model.insert(items[j]);
+      }
+      for (size_t i = 0; i < n_this; ++i) {
+        hll.insert(items[m/2 - 1 - i]);
+        model.insert(items[m/2 - 1 - i]);
+      }
+      const HLL& const_other = other;
+      hll.merge(const_other);
+      model.merge(other_model);
+      string what = "merge(const&) of " + to_string(n_other) + " into " + to_string(n_this) + " insertions";
+      check(hll, model, p, what);
+      check(other, other_model, p, what + " (other)");
+      hll.insert(items[0]);
+      model.insert(items[0]);
+      check(hll, model, p, what + ", then insert");
+    }
+  }
+}
+
+// Random insertions, merges and copies on a few sketches
+void check_random(uint8_t p, unsigned seed, size_t n_ops) {
+  mt19937_64 rng(seed);
+  size_t m = size_t(1) << p;
+  vector<uint64_t> items = make_items(m/2, p, m/8, rng);
+  auto random_item = [&]() { return items[rng() % items.size()]; };
+
+  const size_t n_sketches = 4;
+  vector<HLL> hlls(n_sketches, HLL(p, true, identity));
+  vector<Model> models(n_sketches, Model(p));
+  for (size_t op = 0; op < n_ops; ++op) {
+    size_t a = rng() % n_sketches, b = rng() % n_sketches;
+    string what = "op " + to_string(op) + " (seed " + to_string(seed) + ")";
+    switch (rng() % 8) {
+    case 0: case 1: case 2: {
+      uint64_t item = random_item();
+      hlls[a].insert(item);
+      models[a].insert(item);
+      what += ": insert";
+      break; }
+    case 3: {
+      vector<uint64_t> batch(1 + rng() % 40);
+      for (auto& item : batch) {
+        item = random_item();
+        models[a].insert(item);
+      }
+      hlls[a].insert(batch);
+      what += ": insert " + to_string(batch.size());
+      break; }
+    case 4: {
+      if (a == b)
+        continue;
+      const HLL& other = hlls[b];
+      hlls[a].merge(other);
+      models[a].merge(models[b]);
+      check(hlls[b], models[b], p, what + ": merge(const&) (other)");
+      what += ": merge(const&)";
+      break; }
+    case 5: {
+      hlls[a] += HLL(hlls[b]);
+      models[a].merge(Model(models[b]));
+      what += ": merge(&&)";
+      break; }
+    case 6: {
+      hlls[a] = hlls[b];
+      models[a] = models[b];
+      what += ": copy";
+      break; }
+    case 7: {
+      if (models[a].items.size() < m/4 + m/8)
+        continue;
+      hlls[a] = HLL(p, true, identity);
+      models[a] = Model(p);
+      what += ": new";
+      break; }
+    }
+    check(hlls[a], models[a], p, what);
+  }
+}
+
+int main() {
+  for (uint8_t p : {10, 12}) {
+    // the m/4-th distinct value, then a duplicate in the same buffer
+    check_switch(p, 2, {0, 1, 0}, "switch on a duplicate after m/4 values");
+    check_switch(p, 2, {0, 1, 1, 1}, "switch on duplicates after m/4 values");
+    check_switch(p, 2, {0, 0, 1}, "no switch on a duplicate before m/4 values");
+    check_switch(p, 2, {0, 0, 0}, "no switch on duplicates before m/4 values");
+    check_switch(p, 1, {0, 0}, "switch on a duplicate of the m/4-th value");
+    check_switch(p, 2, {0, 1, 2}, "switch on a new value after m/4 values");
+    check_switch(p, 2, {0, 1}, "no switch at m/4 values");
+    vector<size_t> long_batch;
+    for (size_t i = 0; i < 100; ++i)
+      long_batch.push_back(i);
+    long_batch.push_back(3);
+    check_switch(p, 100, long_batch, "switch on a duplicate after m/4 values in a long batch");
+    check_buffered_merge(p);
+    for (unsigned seed = 1; seed <= 5; ++seed)
+      check_random(p, seed, 2000);
+  }
+  cerr << n_checks - n_failed << " of " << n_checks << " checks passed" << endl;
+  return n_failed == 0 ? 0 : 1;
+}
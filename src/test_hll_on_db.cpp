@@ -20,7 +20,7 @@
 #include "hyperloglogplus.hpp"
 #include "kraken_headers.hpp"
 #include "quickfile.hpp"
-#include "krakendb.hpp"
+#include "kmerstore.hpp"
 #include <iostream>
 #include <fstream>
 #include <random>
@@ -43,7 +43,7 @@ int main(int argc, char **argv) {
   db_file.open_file(db_name);
   db_file.load_file();
   cerr << "Fully loaded\n";
-  KrakenDB db(db_file.ptr());
+  KmerStore *db = KmerStore::open(db_file.ptr(), db_file.size(), NULL);
 
   //size_t p = stoi(argv[2]);
   bool sparse = bool(stoi(argv[2]));
@@ -69,22 +69,13 @@ int main(int argc, char **argv) {
   hll17.use_n_observed = false;
   hll18.use_n_observed = false;
 
-  char* ptr = db.get_ptr();
-  //char* pair_ptr = db.get_pair_ptr();
-  uint64_t key_len = db.get_key_len();     // how many bytes does each key occupy?
-  //uint64_t val_len = db.get_val_len();     // how many bytes does each value occupy?
-  uint64_t key_ct = db.get_key_ct();      // how many key/value pairs are there?
-  uint64_t pair_sz = db.pair_size();       // how many bytes does each pair occupy?
+  uint64_t key_ct = db->get_key_ct();      // how many key/value pairs are there?
 
   if (nr > key_ct) {
     cerr << nr << " is greater than " << key_ct << "!!!" << endl;
     exit(1);
   }
 
-  if (ptr == NULL) { 
-    std::cerr << "Kraken database pointer is NULL [pair_sz: " << pair_sz << ", key_ct: "<<key_ct<<", key_len: "<< key_len<<"]!" << std::endl;
-    exit(1);
-  }
   double prob = double(nr)/double(key_ct);
   std::random_device rd;  //Will be used to obtain a seed for the random number engine
   std::mt19937 gen(rd()); //Standard mersenne_twister_engine seeded with rd()
@@ -96,19 +87,16 @@ int main(int argc, char **argv) {
   size_t ctr = 0;
   for (uint64_t i = 0; i < key_ct; i++) {
     if (dis(gen) < prob) {
-      uint64_t* kmer = (uint64_t *) (ptr + pair_sz * i);
-      //uint32_t* taxon = (uint32_t *) (ptr + pair_sz * i + key_len);
-      //if (taxon == NULL) {
-      //  std::cerr << "taxon is NULL (i is " << i << " and key_ct is " << key_ct << ")" << std::endl;
-      hll10.add(*kmer);
-      hll11.add(*kmer);
-      hll12.add(*kmer);
-      hll13.add(*kmer);
-      hll14.add(*kmer);
-      hll15.add(*kmer);
-      hll16.add(*kmer);
-      hll17.add(*kmer);
-      hll18.add(*kmer);
+      uint64_t kmer = db->get_key(i);
+      hll10.add(kmer);
+      hll11.add(kmer);
+      hll12.add(kmer);
+      hll13.add(kmer);
+      hll14.add(kmer);
+      hll15.add(kmer);
+      hll16.add(kmer);
+      hll17.add(kmer);
+      hll18.add(kmer);
       ++ctr;
 
 	  double log_ctr = log10(ctr);
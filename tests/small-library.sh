@@ -0,0 +1,59 @@
+#!/bin/bash
+
+## Writes a small random library into the current directory, for the tests
+## of the database programs:
+##  library.fa       sequences of two genera that share parts, a 'synthetic
+##                   construct' (32630) that shares k-mers w/ both, and human
+##  seqid2taxid.map  sequence ID to taxon map of library.fa
+##  files/*.fa       one file per sequence, and files.map (file to taxon map)
+##  taxDB            taxonomy of the sequences
+
+set -eu
+
+printf '%s\n' \
+  $'1\t1\troot\tno rank' \
+  $'2\t1\tBacteria\tsuperkingdom' \
+  $'10\t2\tGenusA\tgenus' \
+  $'11\t2\tGenusB\tgenus' \
+  $'100\t10\tSpeciesA1\tspecies' \
+  $'101\t10\tSpeciesA2\tspecies' \
+  $'110\t11\tSpeciesB1\tspecies' \
+  $'111\t11\tSpeciesB2\tspecies' \
+  $'32630\t1\tsynthetic construct\tspecies' \
+  $'9606\t1\tHuman\tspecies' > taxDB
+
+mkdir -p files
+awk -v seed=${SMALL_LIBRARY_SEED:-7} '
+  function rs(n,   s, b, i) {
+    s = ""
+    while (n > 0) {
+      b = ""
+      for (i = 0; i < 100 && i < n; i++)
+        b = b substr("ACGT", int(rand() * 4) + 1, 1)
+      s = s b
+      n -= 100
+    }
+    return s
+  }
+  function write(id, taxid, seq,   i, f) {
+    f = "files/" id ".fa"
+    print ">" id > f
+    print ">" id > "library.fa"
+    for (i = 1; i <= length(seq); i += 70) {
+      print substr(seq, i, 70) > f
+      print substr(seq, i, 70) > "library.fa"
+    }
+    close(f)
+    print id "\t" taxid > "seqid2taxid.map"
+    print f "\t" taxid > "files.map"
+  }
+  BEGIN {
+    srand(seed)
+    A = rs(20000); B = rs(20000); C = rs(4000)
+    write("a1", 100, A rs(3000))
+    write("a2", 101, substr(A, 1, 12000) rs(3000) substr(C, 1, 2000))
+    write("b1", 110, B C)
+    write("b2", 111, substr(B, 5000) rs(1000) "NNNNNNNNNN" rs(1000))
+    write("sc", 32630, substr(C, 1000, 2000) substr(A, 5000, 3000) rs(1000))
+    write("h1", 9606, rs(5000) substr(B, 1, 1000))
+  }'
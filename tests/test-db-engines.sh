@@ -0,0 +1,66 @@
+#!/bin/bash
+
+## Checks that db_compress and db_hash keep the k-mers and taxa of a small
+## database, that a Bloom filter of it (db_bloom) has no false negatives, and
+## that input can be read from a pipe.
+## Usage: test-db-engines.sh [directory of the programs (default: ../src)]
+
+set -eu
+
+TESTS_DIR=$(cd `dirname $0` && pwd)
+BIN=$(cd ${1:-$TESTS_DIR/../src} && pwd)
+TMP_DIR=`mktemp -d`
+trap "rm -rf $TMP_DIR" EXIT
+cd $TMP_DIR
+
+$TESTS_DIR/small-library.sh
+$BIN/kmer_count -k 25 -n 13 -o database0.kdb -i database.idx library.fa 2> /dev/null
+$BIN/set_lcas -x -d database0.kdb -i database.idx -b taxDB -o database.kdb -F library.fa -m seqid2taxid.map 2> /dev/null
+$BIN/db_compress -d database.kdb -o compact.kdb 2> /dev/null
+$BIN/db_hash -d database.kdb -o hash.kdb 2> /dev/null
+# a high false positive rate, so that most lookups of the filter are close calls
+$BIN/db_bloom -e 0.3 -d database.kdb -o database.bloom 2> /dev/null
+
+N_FAILED=0
+check() {
+  if eval "$2"; then
+    echo "ok: $1"
+  else
+    echo "FAILED: $1"
+    N_FAILED=$((N_FAILED + 1))
+  fi
+}
+
+# build_db.sh gives kmer_count the library through a pipe (set_lcas changed
+# database0.kdb, so the file input is counted again)
+$BIN/kmer_count -k 25 -n 13 -o file.kdb -i file.idx library.fa 2> /dev/null
+$BIN/kmer_count -k 25 -n 13 -o pipe.kdb -i pipe.idx <(cat library.fa) 2> /dev/null
+check "k-mer set from a pipe" "cmp -s file.kdb pipe.kdb && cmp -s file.idx pipe.idx"
+
+# the engines store the k-mers in different orders
+$BIN/dump_db_kmers database.kdb 2> /dev/null | sort -n > database.kmers
+for DB in compact hash; do
+  $BIN/dump_db_kmers $DB.kdb 2> /dev/null | sort -n > $DB.kmers
+  check "$DB k-mers" "cmp -s database.kmers $DB.kmers"
+done
+
+# the library has all k-mers of the DB, and the Kraken output lists the taxon
+# of each, so any lost k-mer or taxon, or false negative, changes the output
+$BIN/classify -d database.kdb -i database.idx -a taxDB -o database.out library.fa 2> /dev/null
+$BIN/classify -d database.kdb -i database.idx -b database.bloom -a taxDB -o database_bloom.out library.fa 2> /dev/null
+check "Bloom filter" "cmp -s database.out database_bloom.out"
+# the reader sniffs the format of its input, which must not lose the start of a pipe
+$BIN/classify -d database.kdb -i database.idx -a taxDB -o pipe.out <(cat library.fa) 2> /dev/null
+check "input from a pipe" "cmp -s database.out pipe.out"
+$BIN/classify -d database.kdb -i database.idx -a taxDB -o pipe_gz.out <(gzip -c library.fa) 2> /dev/null
+check "gzip input from a pipe" "cmp -s database.out pipe_gz.out"
+for DB in compact hash; do
+  $BIN/classify -d $DB.kdb -a taxDB -o $DB.out library.fa 2> /dev/null
+  check "$DB classification" "cmp -s database.out $DB.out"
+  $BIN/classify -d $DB.kdb -b database.bloom -a taxDB -o ${DB}_bloom.out library.fa 2> /dev/null
+  check "$DB classification w/ Bloom filter" "cmp -s database.out ${DB}_bloom.out"
+  $BIN/db_bloom -e 0.3 -d $DB.kdb -o $DB.bloom 2> /dev/null
+  check "Bloom filter of $DB" "cmp -s database.bloom $DB.bloom"
+done
+
+[[ $N_FAILED -eq 0 ]]
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+## Checks that the out-of-core mode of set_lcas (-B) writes the same database
+## and k-mer counts as the in-place mode, on a small random library.
+## Usage: test-set-lcas-buffered.sh [directory of the programs (default: ../src)]
+
+set -eu
+
+TESTS_DIR=$(cd `dirname $0` && pwd)
+BIN=$(cd ${1:-$TESTS_DIR/../src} && pwd)
+TMP_DIR=`mktemp -d`
+trap "rm -rf $TMP_DIR" EXIT
+cd $TMP_DIR
+
+N_THREADS=`nproc`
+[[ $N_THREADS -gt 3 ]] && N_THREADS=3
+
+$TESTS_DIR/small-library.sh
+$BIN/kmer_count -k 25 -n 13 -t $N_THREADS -o database0.kdb -i database.idx library.fa 2> /dev/null
+
+N_FAILED=0
+check() {
+  NAME=$1; shift
+  $BIN/set_lcas -x -d database0.kdb -i database.idx -b taxDB -o in_place.kdb -c in_place.counts "$@" 2> /dev/null
+  # a 16k buffer holds 1024 updates, so there are many runs to merge
+  $BIN/set_lcas -x -d database0.kdb -i database.idx -b taxDB -o buffered.kdb -c buffered.counts -B 16k "$@" 2> /dev/null
+  if cmp -s in_place.kdb buffered.kdb && cmp -s in_place.counts buffered.counts; then
+    echo "ok: $NAME"
+  else
+    echo "FAILED: $NAME"
+    N_FAILED=$((N_FAILED + 1))
+  fi
+}
+
+check "-F/-m" -F library.fa -m seqid2taxid.map
+check "-F/-m -T" -F library.fa -m seqid2taxid.map -T
+check "-F/-m -t $N_THREADS" -F library.fa -m seqid2taxid.map -t $N_THREADS
+check "-F/-m -R" -F library.fa -m seqid2taxid.map -R
+check "-f" -f files.map
+check "-f -T" -f files.map -T
+check "-f -M" -f files.map -M
+
+[[ $N_FAILED -eq 0 ]]